@@ -0,0 +1,331 @@
+//! Microbenchmarks of the hashing kernels with regression detection.
+//!
+//! Every kernel is measured hot (working set fits into the caches) and, where it streams
+//! through nonce buffers, cold (buffer far larger than the LLC and caches flushed before each
+//! run). Results are compared against the last stored baseline.
+//!
+//!   cargo bench --bench kernels [filter]           run and compare against the baseline
+//!   BENCHER_SAVE_BASELINE=1 cargo bench ...         store the results as new baseline
+//!   BENCHER_REGRESSION_THRESHOLD=5 cargo bench ...  allowed slowdown in percent, default 10
+//!
+//! The bench exits with an error if any kernel regressed beyond the threshold.
+
+#[allow(dead_code)]
+#[path = "../src/buffer.rs"]
+mod buffer;
+#[allow(dead_code)]
+#[path = "../src/poc_hashing.rs"]
+mod poc_hashing;
+#[allow(dead_code)]
+#[path = "../src/shabal256.rs"]
+mod shabal256;
+
+use crate::buffer::PageAlignedByteBuffer;
+use crate::poc_hashing::{
+    calculate_scoop, find_best_deadline_rust, noncegen_rust, NONCE_SIZE,
+};
+use crate::shabal256::{shabal256_deadline_fast, shabal256_hash_fast};
+use libc::{c_void, uint64_t};
+use std::collections::BTreeMap;
+use std::env;
+use std::fs;
+use std::path::PathBuf;
+use std::process;
+use std::time::{Duration, Instant};
+
+// hot: 16 nonces = 4MiB, cold: 1024 nonces = 256MiB
+const HOT_NONCES: u64 = 16;
+const COLD_NONCES: u64 = 1024;
+// written before every cold run to push the nonce buffer out of the caches
+const EVICTION_SIZE: usize = 128 * 1024 * 1024;
+
+const SAMPLES: usize = 5;
+const SAMPLE_TIME: Duration = Duration::from_millis(500);
+const DEFAULT_THRESHOLD: f64 = 10.0;
+
+const NUMERIC_ID: u64 = 7_900_104_405_094_198_526;
+const GENSIG: [u8; 32] = [
+    0x5e, 0xc3, 0x58, 0x0d, 0x3b, 0x4f, 0x1e, 0x60, 0x8e, 0x1d, 0xc1, 0xa5, 0xf3, 0x2f, 0x90,
+    0x6e, 0x0a, 0x6a, 0xd5, 0x0d, 0xa2, 0x3c, 0x77, 0x40, 0xe2, 0x63, 0x3c, 0xbe, 0x5b, 0xe1,
+    0x9c, 0x42,
+];
+
+extern "C" {
+    fn init_shabal_sse2();
+    fn init_shabal_avx();
+    fn init_shabal_avx2();
+    fn init_shabal_avx512f();
+    fn noncegen_sse2(cache: *mut c_void, numeric_ID: uint64_t, local_startnonce: uint64_t, local_nonces: uint64_t);
+    fn noncegen_avx(cache: *mut c_void, numeric_ID: uint64_t, local_startnonce: uint64_t, local_nonces: uint64_t);
+    fn noncegen_avx2(cache: *mut c_void, numeric_ID: uint64_t, local_startnonce: uint64_t, local_nonces: uint64_t);
+    fn noncegen_avx512f(cache: *mut c_void, numeric_ID: uint64_t, local_startnonce: uint64_t, local_nonces: uint64_t);
+    fn find_best_deadline_sse2(data: *const c_void, scoop: uint64_t, nonce_count: uint64_t, gensig: *const c_void, best_deadline: *mut uint64_t, best_offset: *mut uint64_t);
+    fn find_best_deadline_avx(data: *const c_void, scoop: uint64_t, nonce_count: uint64_t, gensig: *const c_void, best_deadline: *mut uint64_t, best_offset: *mut uint64_t);
+    fn find_best_deadline_avx2(data: *const c_void, scoop: uint64_t, nonce_count: uint64_t, gensig: *const c_void, best_deadline: *mut uint64_t, best_offset: *mut uint64_t);
+    fn find_best_deadline_avx512f(data: *const c_void, scoop: uint64_t, nonce_count: uint64_t, gensig: *const c_void, best_deadline: *mut uint64_t, best_offset: *mut uint64_t);
+}
+
+type NoncegenFn = unsafe extern "C" fn(*mut c_void, uint64_t, uint64_t, uint64_t);
+type DeadlineFn =
+    unsafe extern "C" fn(*const c_void, uint64_t, uint64_t, *const c_void, *mut uint64_t, *mut uint64_t);
+
+struct Engine {
+    name: &'static str,
+    noncegen: NoncegenFn,
+    find_best_deadline: DeadlineFn,
+}
+
+fn engines() -> Vec<Engine> {
+    let mut engines = Vec::new();
+    if is_x86_feature_detected!("avx512f") {
+        unsafe { init_shabal_avx512f() };
+        engines.push(Engine {
+            name: "avx512f",
+            noncegen: noncegen_avx512f,
+            find_best_deadline: find_best_deadline_avx512f,
+        });
+    }
+    if is_x86_feature_detected!("avx2") {
+        unsafe { init_shabal_avx2() };
+        engines.push(Engine {
+            name: "avx2",
+            noncegen: noncegen_avx2,
+            find_best_deadline: find_best_deadline_avx2,
+        });
+    }
+    if is_x86_feature_detected!("avx") {
+        unsafe { init_shabal_avx() };
+        engines.push(Engine {
+            name: "avx",
+            noncegen: noncegen_avx,
+            find_best_deadline: find_best_deadline_avx,
+        });
+    }
+    if is_x86_feature_detected!("sse2") {
+        unsafe { init_shabal_sse2() };
+        engines.push(Engine {
+            name: "sse2",
+            noncegen: noncegen_sse2,
+            find_best_deadline: find_best_deadline_sse2,
+        });
+    }
+    engines
+}
+
+struct Bench {
+    filter: Option<String>,
+    results: BTreeMap<String, f64>,
+    eviction: Vec<u8>,
+}
+
+impl Bench {
+    fn selected(&self, name: &str) -> bool {
+        self.filter.as_ref().map_or(true, |f| name.contains(f.as_str()))
+    }
+
+    /// Runs `f` repeatedly, every call processes `units` items. Records the median
+    /// throughput in units/s. `prepare` runs before every call and isn't timed.
+    fn run<P: FnMut(&mut Vec<u8>), F: FnMut(u64)>(
+        &mut self,
+        name: &str,
+        unit: &str,
+        units: u64,
+        mut prepare: P,
+        mut f: F,
+    ) {
+        if !self.selected(name) {
+            return;
+        }
+        // warm up
+        prepare(&mut self.eviction);
+        f(0);
+
+        let mut samples = Vec::with_capacity(SAMPLES);
+        let mut iteration = 1;
+        for _ in 0..SAMPLES {
+            let mut busy = Duration::from_secs(0);
+            let mut done = 0u64;
+            while busy < SAMPLE_TIME {
+                prepare(&mut self.eviction);
+                let start = Instant::now();
+                f(iteration);
+                busy += start.elapsed();
+                done += units;
+                iteration += 1;
+            }
+            samples.push(done as f64 / duration_secs(busy));
+        }
+        samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        let median = samples[SAMPLES / 2];
+        println!("{: <40} {:>14.2} {}/s", name, median, unit);
+        self.results.insert(name.to_owned(), median);
+    }
+}
+
+fn duration_secs(d: Duration) -> f64 {
+    d.as_secs() as f64 + f64::from(d.subsec_nanos()) / 1e9
+}
+
+fn hot(_: &mut Vec<u8>) {}
+
+fn cold(eviction: &mut Vec<u8>) {
+    for i in (0..eviction.len()).step_by(64) {
+        eviction[i] = eviction[i].wrapping_add(1);
+    }
+}
+
+fn bench_shabal(bench: &mut Bench) {
+    let data = [0u8; 64];
+    let mut term = [0u32; 16];
+    term[0] = 0x80;
+    bench.run("shabal256_hash_fast", "hashes", 1, hot, |_| {
+        let hash = shabal256_hash_fast(&data, &term);
+        assert!(hash[0] != 0 || hash[1] != 0);
+    });
+
+    let hash1 = [1u8; 32];
+    let hash2 = [2u8; 32];
+    bench.run("shabal256_deadline_fast", "deadlines", 1, hot, |_| {
+        let deadline = shabal256_deadline_fast(&hash1, &hash2, &GENSIG);
+        assert!(deadline > 0);
+    });
+
+    bench.run("calculate_scoop", "scoops", 1, hot, |i| {
+        let scoop = calculate_scoop(500_000 + i, &GENSIG);
+        assert!(scoop < 4096);
+    });
+}
+
+fn bench_rust_kernels(bench: &mut Bench) {
+    let buffer = PageAlignedByteBuffer::new(HOT_NONCES as usize * NONCE_SIZE);
+    let data = buffer.get_buffer();
+    let mut data = data.lock().unwrap();
+
+    bench.run("noncegen_rust/hot", "nonces", HOT_NONCES, hot, |i| {
+        noncegen_rust(&mut data[..], NUMERIC_ID, i * HOT_NONCES, HOT_NONCES);
+    });
+    bench.run("find_best_deadline_rust/hot", "nonces", HOT_NONCES, hot, |i| {
+        find_best_deadline_rust(&data, i % 4096, HOT_NONCES, &GENSIG);
+    });
+}
+
+fn bench_simd_kernels(bench: &mut Bench, engine: &Engine) {
+    for &(temperature, nonces) in [("hot", HOT_NONCES), ("cold", COLD_NONCES)].iter() {
+        let prepare: fn(&mut Vec<u8>) = if temperature == "hot" { hot } else { cold };
+        let name = format!("noncegen_{}/{}", engine.name, temperature);
+        let deadline_name = format!("find_best_deadline_{}/{}", engine.name, temperature);
+        if !bench.selected(&name) && !bench.selected(&deadline_name) {
+            continue;
+        }
+
+        let buffer = PageAlignedByteBuffer::new(nonces as usize * NONCE_SIZE);
+        let data = buffer.get_buffer();
+        let mut data = data.lock().unwrap();
+        let noncegen = engine.noncegen;
+        let find_best_deadline = engine.find_best_deadline;
+
+        bench.run(&name, "nonces", nonces, prepare, |i| unsafe {
+            noncegen(
+                data.as_mut_ptr() as *mut c_void,
+                NUMERIC_ID,
+                i * nonces,
+                nonces,
+            );
+        });
+
+        // make sure the deadline benches see valid nonces even if noncegen was filtered
+        unsafe {
+            noncegen(data.as_mut_ptr() as *mut c_void, NUMERIC_ID, 0, nonces);
+        }
+        bench.run(&deadline_name, "nonces", nonces, prepare, |i| {
+            let mut deadline = 0u64;
+            let mut offset = 0u64;
+            unsafe {
+                find_best_deadline(
+                    data.as_ptr() as *const c_void,
+                    // a different scoop every run, so cold runs can't hit cached lines
+                    (i * 7) % 4096,
+                    nonces,
+                    GENSIG.as_ptr() as *const c_void,
+                    &mut deadline,
+                    &mut offset,
+                );
+            }
+            assert!(offset < nonces);
+        });
+    }
+}
+
+fn baseline_path() -> PathBuf {
+    let target = env::var("CARGO_TARGET_DIR").unwrap_or_else(|_| "target".to_owned());
+    PathBuf::from(target)
+        .join("bench-baselines")
+        .join("kernels.json")
+}
+
+fn load_baseline() -> BTreeMap<String, f64> {
+    fs::read_to_string(baseline_path())
+        .ok()
+        .and_then(|s| serde_json::from_str(&s).ok())
+        .unwrap_or_default()
+}
+
+fn save_baseline(results: &BTreeMap<String, f64>) {
+    let path = baseline_path();
+    fs::create_dir_all(path.parent().unwrap()).expect("can't create baseline directory");
+    fs::write(&path, serde_json::to_string_pretty(results).unwrap())
+        .expect("can't write baseline");
+    println!("baseline saved to {}", path.display());
+}
+
+fn main() {
+    // cargo passes --bench, everything else is a name filter
+    let filter = env::args().skip(1).find(|x| !x.starts_with("--"));
+    let threshold = env::var("BENCHER_REGRESSION_THRESHOLD")
+        .ok()
+        .and_then(|x| x.parse::<f64>().ok())
+        .unwrap_or(DEFAULT_THRESHOLD);
+
+    let mut bench = Bench {
+        filter,
+        results: BTreeMap::new(),
+        eviction: vec![0u8; EVICTION_SIZE],
+    };
+
+    bench_shabal(&mut bench);
+    bench_rust_kernels(&mut bench);
+    for engine in engines().iter() {
+        bench_simd_kernels(&mut bench, engine);
+    }
+
+    if env::var("BENCHER_SAVE_BASELINE").is_ok() {
+        save_baseline(&bench.results);
+        return;
+    }
+
+    let baseline = load_baseline();
+    if baseline.is_empty() {
+        println!("no baseline found, run with BENCHER_SAVE_BASELINE=1 to store one");
+        return;
+    }
+
+    let mut regressions = 0;
+    for (name, result) in bench.results.iter() {
+        if let Some(base) = baseline.get(name) {
+            let change = (result / base - 1.0) * 100.0;
+            if change < -threshold {
+                println!("REGRESSION {: <40} {:+.1}%", name, change);
+                regressions += 1;
+            } else {
+                println!("           {: <40} {:+.1}%", name, change);
+            }
+        }
+    }
+    if regressions > 0 {
+        println!(
+            "{} kernel(s) regressed by more than {}%",
+            regressions, threshold
+        );
+        process::exit(1);
+    }
+}
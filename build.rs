@@ -1,5 +1,65 @@
 extern crate cc;
 
+// global symbols of the avx2 and avx512f kernels, tuned builds prefix them
+#[cfg(not(target_env = "msvc"))]
+const AVX2_SYMBOLS: &[&str] = &[
+    "init_shabal_avx2",
+    "noncegen_avx2",
+    "find_best_deadline_avx2",
+    "find_best_deadline_sm_avx2",
+    "mshabal_init_avx2",
+    "mshabal_avx2",
+    "mshabal_close_avx2",
+    "mshabal_hash_fast_avx2",
+    "mshabal_deadline_fast_avx2",
+    "global_256",
+    "global_256_fast",
+];
+#[cfg(not(target_env = "msvc"))]
+const AVX512F_SYMBOLS: &[&str] = &[
+    "init_shabal_avx512f",
+    "noncegen_avx512f",
+    "find_best_deadline_avx512f",
+    "find_best_deadline_sm_avx512f",
+    "mshabal_init_avx512f",
+    "mshabal_avx512f",
+    "mshabal_close_avx512f",
+    "mshabal_hash_fast_avx512f",
+    "mshabal_deadline_fast_avx512f",
+    "global_512",
+    "global_512_fast",
+];
+
+// (prefix, -mtune) of the additional builds, the runtime picks one by the cpu it runs on
+#[cfg(not(target_env = "msvc"))]
+const AVX2_TUNES: &[(&str, &str)] = &[("zen", "znver2"), ("skylake", "skylake")];
+#[cfg(not(target_env = "msvc"))]
+const AVX512F_TUNES: &[(&str, &str)] =
+    &[("skylake", "skylake-avx512"), ("icelake", "icelake-server")];
+
+// the kernels of one extension tuned for `tune`, every global symbol gets `prefix`
+#[cfg(not(target_env = "msvc"))]
+fn compile_tuned(
+    shared_config: &cc::Build,
+    extension: &str,
+    symbols: &[&str],
+    files: &[&str],
+    prefix: &str,
+    tune: &str,
+) {
+    let mut config = shared_config.clone();
+    config
+        .flag(&format!("-m{}", extension))
+        .flag(&format!("-mtune={}", tune));
+    for symbol in symbols {
+        config.define(symbol, Some(format!("{}_{}", prefix, symbol).as_str()));
+    }
+    for file in files {
+        config.file(file);
+    }
+    config.compile(&format!("shabal_{}_{}", extension, prefix));
+}
+
 fn main() {
     let mut shared_config = cc::Build::new();
 
@@ -13,7 +73,7 @@ fn main() {
         .flag("/GL");
 
     #[cfg(not(target_env = "msvc"))]
-    shared_config.flag("-std=c99").flag("-mtune=native");
+    shared_config.flag("-std=c99").flag("-mtune=generic");
 
     let mut config = shared_config.clone();
 
@@ -66,4 +126,33 @@ fn main() {
         .file("src/c/mshabal_512_avx512f.c")
         .file("src/c/noncegen_512_avx512f.c")
         .compile("shabal_avx512");
+
+    #[cfg(not(target_env = "msvc"))]
+    {
+        for (prefix, tune) in AVX2_TUNES {
+            compile_tuned(
+                &shared_config,
+                "avx2",
+                AVX2_SYMBOLS,
+                &["src/c/mshabal_256_avx2.c", "src/c/noncegen_256_avx2.c"],
+                prefix,
+                tune,
+            );
+        }
+        for (prefix, tune) in AVX512F_TUNES {
+            compile_tuned(
+                &shared_config,
+                "avx512f",
+                AVX512F_SYMBOLS,
+                &[
+                    "src/c/mshabal_512_avx512f.c",
+                    "src/c/noncegen_512_avx512f.c",
+                ],
+                prefix,
+                tune,
+            );
+        }
+        println!("cargo:rustc-cfg=tuned_kernels");
+    }
+    println!("cargo:rustc-check-cfg=cfg(tuned_kernels)");
 }
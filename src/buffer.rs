@@ -35,9 +35,75 @@ impl Drop for PageAlignedByteBuffer {
 
 unsafe impl Send for PageAlignedByteBuffer {}
 
+/// Central accounting of the memory used by hashing buffers.
+///
+/// A reservation is accounting only, it doesn't allocate. Its holder allocates the buffer once
+/// the reservation has been granted and keeps both together, the reservation is returned to
+/// the budget when it is dropped.
+#[derive(Clone)]
+pub struct MemoryBudget {
+    // 0 = unlimited
+    limit: usize,
+    used: Arc<Mutex<usize>>,
+}
+
+pub struct MemoryReservation {
+    bytes: usize,
+    used: Arc<Mutex<usize>>,
+}
+
+impl MemoryBudget {
+    pub fn new(limit: usize) -> Self {
+        MemoryBudget {
+            limit,
+            used: Arc::new(Mutex::new(0)),
+        }
+    }
+
+    pub fn limit(&self) -> usize {
+        self.limit
+    }
+
+    pub fn used(&self) -> usize {
+        *self.used.lock().unwrap()
+    }
+
+    /// Reserves up to `bytes` in multiples of `granularity`. Returns `None` if not even
+    /// `granularity` bytes are available.
+    pub fn reserve(&self, bytes: usize, granularity: usize) -> Option<MemoryReservation> {
+        let mut used = self.used.lock().unwrap();
+        let bytes = if self.limit == 0 {
+            bytes
+        } else {
+            let available = self.limit.saturating_sub(*used);
+            bytes.min(available) / granularity * granularity
+        };
+        if bytes == 0 || bytes < granularity {
+            return None;
+        }
+        *used += bytes;
+        Some(MemoryReservation {
+            bytes,
+            used: self.used.clone(),
+        })
+    }
+}
+
+impl MemoryReservation {
+    pub fn bytes(&self) -> usize {
+        self.bytes
+    }
+}
+
+impl Drop for MemoryReservation {
+    fn drop(&mut self) {
+        *self.used.lock().unwrap() -= self.bytes;
+    }
+}
+
 #[cfg(test)]
 mod buffer_tests {
-    use super::PageAlignedByteBuffer;
+    use super::{MemoryBudget, PageAlignedByteBuffer};
 
     #[test]
     fn buffer_creation_destruction_test() {
@@ -46,4 +112,21 @@ mod buffer_tests {
         }
         assert!(true);
     }
+
+    #[test]
+    fn memory_budget_test() {
+        let budget = MemoryBudget::new(10 * 1024);
+        let a = budget.reserve(8 * 1024, 1024).unwrap();
+        assert_eq!(a.bytes(), 8 * 1024);
+        // degrade to what is left
+        let b = budget.reserve(8 * 1024, 1024).unwrap();
+        assert_eq!(b.bytes(), 2 * 1024);
+        assert!(budget.reserve(1024, 1024).is_none());
+        drop(a);
+        assert_eq!(budget.used(), 2 * 1024);
+        assert!(budget.reserve(1024, 1024).is_some());
+
+        let unlimited = MemoryBudget::new(0);
+        assert_eq!(unlimited.reserve(1 << 40, 1024).unwrap().bytes(), 1 << 40);
+    }
 }
@@ -11,3 +11,6 @@ void noncegen_avx(char *cache,
 
 void find_best_deadline_avx(char *data, uint64_t scoop, uint64_t nonce_count, char *gensig,
                             uint64_t *best_deadline, uint64_t *best_offset);                           
+
+void find_best_deadline_sm_avx(char *data, uint64_t nonce_count, char *gensig,
+                               uint64_t *best_deadline, uint64_t *best_offset);
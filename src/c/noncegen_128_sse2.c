@@ -198,6 +198,52 @@ void find_best_deadline_sse2(char *data, uint64_t scoop, uint64_t nonce_count, c
             char *u2 = data + i * NONCE_SIZE + mirrorscoop * SCOOP_SIZE * MSHABAL128_VECTOR_SIZE + HASH_SIZE * MSHABAL128_VECTOR_SIZE; 
 
 
+            mshabal_deadline_fast_sse2(&x, &gensig_simd, u1, u2, &term_simd, &d0, &d1, &d2, &d3);
+
+            SET_BEST_DEADLINE(d0, i + 0);
+            SET_BEST_DEADLINE(d1, i + 1);
+            SET_BEST_DEADLINE(d2, i + 2);
+            SET_BEST_DEADLINE(d3, i + 3);
+    }
+}
+
+// same as find_best_deadline_sse2 on one scoop of a scoop-major cache
+// data:            the scoop, per group of 4 nonces their interleaved first hashes followed
+//                  by the interleaved second hashes of their mirror scoop
+// nonce_count:     a multiple of the lane count
+void find_best_deadline_sm_sse2(char *data, uint64_t nonce_count, char *gensig,
+                                uint64_t *best_deadline, uint64_t *best_offset) {
+    uint64_t d0 = 0, d1 = 0, d2 = 0, d3 = 0;
+    char term[32];
+    write_term(term);
+
+    // local copy of global fast context
+    mshabal128_context_fast x;
+    memcpy(&x, &global_128_fast, sizeof(global_128_fast));
+
+    // prepare shabal inputs
+    union {
+        mshabal_u32 words[8 * MSHABAL128_VECTOR_SIZE];
+        __m128i data[8];
+    } gensig_simd, term_simd;
+
+    for (uint64_t i = 0; i < 16 * MSHABAL128_VECTOR_SIZE / 2; i += MSHABAL128_VECTOR_SIZE) {
+        size_t o = i;
+        gensig_simd.words[i + 0] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 1] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 2] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 3] = *(mshabal_u32 *)(gensig + o);
+        term_simd.words[i + 0] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 1] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 2] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 3] = *(mshabal_u32 *)(term + o);
+    }
+
+    for (uint64_t i = 0; i < nonce_count; i+=4) {
+            // one group of nonces: their scoop hashes, then the hashes of their mirror scoop
+            char *u1 = data + i * SCOOP_SIZE;
+            char *u2 = u1 + HASH_SIZE * MSHABAL128_VECTOR_SIZE;
+
             mshabal_deadline_fast_sse2(&x, &gensig_simd, u1, u2, &term_simd, &d0, &d1, &d2, &d3);
 
             SET_BEST_DEADLINE(d0, i + 0);
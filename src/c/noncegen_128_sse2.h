@@ -11,4 +11,6 @@ void noncegen_sse2(char *cache,
                 
 void find_best_deadline_sse2(char *data, uint64_t scoop, uint64_t nonce_count, char *gensig,
                              uint64_t *best_deadline, uint64_t *best_offset);
-                             
\ No newline at end of file
+
+void find_best_deadline_sm_sse2(char *data, uint64_t nonce_count, char *gensig,
+                                uint64_t *best_deadline, uint64_t *best_offset);
@@ -342,3 +342,87 @@ void find_best_deadline_avx512f(char *data, uint64_t scoop, uint64_t nonce_count
             SET_BEST_DEADLINE(d15, i + 15);        
     }
 }
+
+// same as find_best_deadline_avx512f on one scoop of a scoop-major cache
+// data:            the scoop, per group of 16 nonces their interleaved first hashes followed
+//                  by the interleaved second hashes of their mirror scoop
+// nonce_count:     a multiple of the lane count
+void find_best_deadline_sm_avx512f(char *data, uint64_t nonce_count, char *gensig,
+                                   uint64_t *best_deadline, uint64_t *best_offset) {
+    uint64_t d0 = 0, d1 = 0, d2 = 0, d3 = 0, d4 = 0, d5 = 0, d6 = 0, d7 = 0, d8 = 0, d9 = 0,
+             d10 = 0, d11 = 0, d12 = 0, d13 = 0, d14 = 0, d15 = 0;
+    char term[32];
+    write_term(term);
+
+    // local copy of global fast context
+    mshabal512_context_fast x;
+    memcpy(&x, &global_512_fast, sizeof(global_512_fast));
+
+    // prepare shabal inputs
+    union {
+        mshabal_u32 words[8 * MSHABAL512_VECTOR_SIZE];
+        __m512i data[8];
+    } gensig_simd, term_simd;
+
+    for (uint64_t i = 0; i < 16 * MSHABAL512_VECTOR_SIZE / 2; i += MSHABAL512_VECTOR_SIZE) {
+        size_t o = i / 4;
+        gensig_simd.words[i + 0] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 1] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 2] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 3] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 4] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 5] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 6] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 7] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 8] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 9] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 10] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 11] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 12] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 13] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 14] = *(mshabal_u32 *)(gensig + o);
+        gensig_simd.words[i + 15] = *(mshabal_u32 *)(gensig + o);
+        term_simd.words[i + 0] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 1] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 2] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 3] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 4] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 5] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 6] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 7] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 8] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 9] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 10] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 11] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 12] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 13] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 14] = *(mshabal_u32 *)(term + o);
+        term_simd.words[i + 15] = *(mshabal_u32 *)(term + o);
+    }
+
+    for (uint64_t i = 0; i < nonce_count; i+=16) {
+            // one group of nonces: their scoop hashes, then the hashes of their mirror scoop
+            char *u1 = data + i * SCOOP_SIZE;
+            char *u2 = u1 + HASH_SIZE * MSHABAL512_VECTOR_SIZE;
+
+            mshabal_deadline_fast_avx512f(&x, &gensig_simd, u1, u2, &term_simd, &d0, &d1, &d2, &d3, &d4, &d5, &d6, &d7,
+                                           &d8, &d9, &d10, &d11, &d12, &d13, &d14, &d15);
+
+            SET_BEST_DEADLINE(d0, i + 0);
+            SET_BEST_DEADLINE(d1, i + 1);
+            SET_BEST_DEADLINE(d2, i + 2);
+            SET_BEST_DEADLINE(d3, i + 3);
+            SET_BEST_DEADLINE(d4, i + 4);
+            SET_BEST_DEADLINE(d5, i + 5);
+            SET_BEST_DEADLINE(d6, i + 6);
+            SET_BEST_DEADLINE(d7, i + 7);
+            SET_BEST_DEADLINE(d8, i + 8);
+            SET_BEST_DEADLINE(d9, i + 9);
+            SET_BEST_DEADLINE(d10, i + 10);
+            SET_BEST_DEADLINE(d11, i + 11);
+            SET_BEST_DEADLINE(d12, i + 12);
+            SET_BEST_DEADLINE(d13, i + 13);
+            SET_BEST_DEADLINE(d14, i + 14);
+            SET_BEST_DEADLINE(d15, i + 15);        
+    }
+}
@@ -0,0 +1,319 @@
+//! Detection of cgroup (v1 and v2) resource limits.
+//!
+//! Inside containers `num_cpus` reports the cores of the host, not what the container is
+//! allowed to use. Running more hashing threads than the CPU quota allows just gets the
+//! process throttled, so we size threads, task size and buffer memory from the limits here.
+
+use crate::cpu_hasher::CPU_TASK_ALIGNMENT;
+use crate::poc_hashing::NONCE_SIZE;
+use std::fs;
+use std::path::{Path, PathBuf};
+
+const CGROUP_ROOT: &str = "/sys/fs/cgroup";
+
+// share of the memory limit hashing buffers may occupy, the rest is left for the runtime
+const BUFFER_MEMORY_SHARE: f64 = 0.75;
+
+// cgroup v1 reports "no limit" as a page aligned i64::MAX, anything above this is unlimited
+const UNLIMITED_MEMORY: u64 = 1 << 60;
+
+#[derive(Debug, Default, Clone)]
+pub struct CgroupLimits {
+    /// cpu quota in cores (quota / period)
+    pub cpu_quota: Option<f64>,
+    /// number of cpus in the cpuset
+    pub cpuset: Option<usize>,
+    /// memory limit in bytes
+    pub memory_limit: Option<u64>,
+}
+
+impl CgroupLimits {
+    #[cfg(target_os = "linux")]
+    pub fn detect() -> Self {
+        let paths = CgroupPaths::new();
+        if Path::new(CGROUP_ROOT).join("cgroup.controllers").exists() {
+            CgroupLimits {
+                cpu_quota: paths
+                    .read_v2("cpu.max")
+                    .and_then(|s| parse_cpu_max(&s)),
+                cpuset: paths
+                    .read_v2("cpuset.cpus.effective")
+                    .and_then(|s| parse_cpu_list(&s)),
+                memory_limit: paths
+                    .read_v2("memory.max")
+                    .and_then(|s| parse_memory_limit(&s)),
+            }
+        } else {
+            let quota = paths.read_v1("cpu", "cpu.cfs_quota_us");
+            let period = paths.read_v1("cpu", "cpu.cfs_period_us");
+            CgroupLimits {
+                cpu_quota: match (quota, period) {
+                    (Some(quota), Some(period)) => parse_cfs(&quota, &period),
+                    _ => None,
+                },
+                cpuset: paths
+                    .read_v1("cpuset", "cpuset.effective_cpus")
+                    .or_else(|| paths.read_v1("cpuset", "cpuset.cpus"))
+                    .and_then(|s| parse_cpu_list(&s)),
+                memory_limit: paths
+                    .read_v1("memory", "memory.limit_in_bytes")
+                    .and_then(|s| parse_memory_limit(&s)),
+            }
+        }
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    pub fn detect() -> Self {
+        CgroupLimits::default()
+    }
+
+    pub fn is_constrained(&self) -> bool {
+        self.cpu_quota.is_some() || self.cpuset.is_some()
+    }
+
+    /// Number of cpus we can actually keep busy, never more than the host has.
+    pub fn cpus(&self, host_cpus: usize) -> usize {
+        let mut cpus = host_cpus;
+        if let Some(cpuset) = self.cpuset {
+            cpus = cpus.min(cpuset);
+        }
+        if let Some(quota) = self.cpu_quota {
+            // a quota of 1.5 cores still keeps 2 threads busy most of the time
+            cpus = cpus.min(quota.ceil() as usize);
+        }
+        cpus.max(1)
+    }
+}
+
+/// Memory hashing buffers may use if `max_memory` isn't configured, 0 = unlimited.
+pub fn default_memory_budget(memory_limit: Option<u64>) -> u64 {
+    memory_limit.map_or(0, |x| (x as f64 * BUFFER_MEMORY_SHARE) as u64)
+}
+
+/// The size of the hashing buffer pool in bytes, `max_memory` is configured in MiB and capped
+/// at the share of the memory limit the default leaves for buffers, 0 = unlimited.
+pub fn memory_budget(max_memory: u64, memory_limit: Option<u64>) -> u64 {
+    let default = default_memory_budget(memory_limit);
+    match max_memory * 1024 * 1024 {
+        0 => default,
+        configured if default > 0 => configured.min(default),
+        configured => configured,
+    }
+}
+
+/// Shrinks the cpu task size so that one buffer per thread fits into the memory budget, down
+/// to one aligned task, `None` if not even that fits.
+pub fn fit_task_size(task_size: u64, cpu_threads: usize, memory_budget: u64) -> Option<u64> {
+    if memory_budget == 0 || cpu_threads == 0 {
+        return Some(task_size);
+    }
+    if memory_budget < CPU_TASK_ALIGNMENT * NONCE_SIZE as u64 {
+        return None;
+    }
+    // below one aligned task per thread the budget admits fewer workers at a time
+    let max_task_size = memory_budget / (cpu_threads as u64 * NONCE_SIZE as u64);
+    let max_task_size = max_task_size / CPU_TASK_ALIGNMENT * CPU_TASK_ALIGNMENT;
+    Some(task_size.min(max_task_size).max(CPU_TASK_ALIGNMENT))
+}
+
+struct CgroupPaths {
+    // (controllers, path) pairs from /proc/self/cgroup
+    entries: Vec<(String, String)>,
+}
+
+impl CgroupPaths {
+    fn new() -> Self {
+        let entries = fs::read_to_string("/proc/self/cgroup")
+            .map(|s| parse_proc_cgroup(&s))
+            .unwrap_or_default();
+        CgroupPaths { entries }
+    }
+
+    fn read_v2(&self, file: &str) -> Option<String> {
+        let path = self
+            .entries
+            .iter()
+            .find(|(controllers, _)| controllers.is_empty())
+            .map(|(_, path)| path.as_str());
+        read_candidates(&[PathBuf::from(CGROUP_ROOT)], path, file)
+    }
+
+    fn read_v1(&self, controller: &str, file: &str) -> Option<String> {
+        let path = self
+            .entries
+            .iter()
+            .find(|(controllers, _)| controllers.split(',').any(|c| c == controller))
+            .map(|(_, path)| path.as_str());
+        let root = Path::new(CGROUP_ROOT);
+        let mounts = match controller {
+            "cpu" => vec![root.join("cpu,cpuacct"), root.join("cpu")],
+            _ => vec![root.join(controller)],
+        };
+        read_candidates(&mounts, path, file)
+    }
+}
+
+// Containers usually see their own cgroup at the mount root, hosts see it below the path
+// listed in /proc/self/cgroup. Try the nested path first and fall back to the root.
+fn read_candidates(mounts: &[PathBuf], path: Option<&str>, file: &str) -> Option<String> {
+    for mount in mounts {
+        if let Some(path) = path {
+            let nested = mount.join(path.trim_start_matches('/')).join(file);
+            if let Ok(s) = fs::read_to_string(nested) {
+                return Some(s);
+            }
+        }
+        if let Ok(s) = fs::read_to_string(mount.join(file)) {
+            return Some(s);
+        }
+    }
+    None
+}
+
+fn parse_proc_cgroup(s: &str) -> Vec<(String, String)> {
+    s.lines()
+        .filter_map(|line| {
+            let mut parts = line.splitn(3, ':');
+            let _id = parts.next()?;
+            let controllers = parts.next()?;
+            let path = parts.next()?;
+            Some((controllers.to_owned(), path.to_owned()))
+        })
+        .collect()
+}
+
+/// Parses cgroup v2 `cpu.max`, e.g. "150000 100000" or "max 100000".
+pub fn parse_cpu_max(s: &str) -> Option<f64> {
+    let mut parts = s.split_whitespace();
+    let quota = parts.next()?;
+    let period = parts.next().unwrap_or("100000");
+    if quota == "max" {
+        return None;
+    }
+    parse_cfs(quota, period)
+}
+
+/// Parses cgroup v1 `cpu.cfs_quota_us` and `cpu.cfs_period_us`, a quota of -1 is unlimited.
+pub fn parse_cfs(quota: &str, period: &str) -> Option<f64> {
+    let quota = quota.trim().parse::<i64>().ok()?;
+    let period = period.trim().parse::<i64>().ok()?;
+    if quota <= 0 || period <= 0 {
+        None
+    } else {
+        Some(quota as f64 / period as f64)
+    }
+}
+
+/// Counts the cpus of a cpu list, e.g. "0-3,8,10-11" => 7.
+pub fn parse_cpu_list(s: &str) -> Option<usize> {
+    let s = s.trim();
+    if s.is_empty() {
+        return None;
+    }
+    let mut count = 0;
+    for range in s.split(',') {
+        let mut bounds = range.splitn(2, '-');
+        let start = bounds.next()?.trim().parse::<usize>().ok()?;
+        let end = match bounds.next() {
+            Some(end) => end.trim().parse::<usize>().ok()?,
+            None => start,
+        };
+        if end < start {
+            return None;
+        }
+        count += end - start + 1;
+    }
+    Some(count)
+}
+
+/// Parses `memory.max` (v2) or `memory.limit_in_bytes` (v1).
+pub fn parse_memory_limit(s: &str) -> Option<u64> {
+    let s = s.trim();
+    if s == "max" {
+        return None;
+    }
+    match s.parse::<u64>() {
+        Ok(limit) if limit < UNLIMITED_MEMORY => Some(limit),
+        _ => None,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_cpu_max() {
+        assert_eq!(parse_cpu_max("150000 100000\n"), Some(1.5));
+        assert_eq!(parse_cpu_max("max 100000\n"), None);
+        assert_eq!(parse_cpu_max("200000"), Some(2.0));
+    }
+
+    #[test]
+    fn test_parse_cfs() {
+        assert_eq!(parse_cfs("-1\n", "100000\n"), None);
+        assert_eq!(parse_cfs("400000\n", "100000\n"), Some(4.0));
+    }
+
+    #[test]
+    fn test_parse_cpu_list() {
+        assert_eq!(parse_cpu_list("0-3,8,10-11\n"), Some(7));
+        assert_eq!(parse_cpu_list("5"), Some(1));
+        assert_eq!(parse_cpu_list(""), None);
+        assert_eq!(parse_cpu_list("3-1"), None);
+    }
+
+    #[test]
+    fn test_parse_memory_limit() {
+        assert_eq!(parse_memory_limit("max\n"), None);
+        assert_eq!(parse_memory_limit("9223372036854771712\n"), None);
+        assert_eq!(parse_memory_limit("1073741824\n"), Some(1 << 30));
+    }
+
+    #[test]
+    fn test_cpus() {
+        let limits = CgroupLimits {
+            cpu_quota: Some(2.5),
+            cpuset: Some(8),
+            memory_limit: None,
+        };
+        assert_eq!(limits.cpus(32), 3);
+        assert_eq!(limits.cpus(2), 2);
+        assert_eq!(CgroupLimits::default().cpus(16), 16);
+    }
+
+    #[test]
+    fn test_fit_task_size() {
+        // 4 threads * 64 nonces * 256KiB = 64MiB
+        assert_eq!(fit_task_size(64, 4, 0), Some(64));
+        assert_eq!(fit_task_size(64, 4, 1 << 30), Some(64));
+        assert_eq!(
+            fit_task_size(64, 4, default_memory_budget(Some(64 << 20))),
+            Some(48)
+        );
+        // one aligned task is 4MiB, only one of the threads gets a buffer at a time
+        assert_eq!(fit_task_size(64, 4, 4 << 20), Some(CPU_TASK_ALIGNMENT));
+        assert_eq!(fit_task_size(64, 4, (4 << 20) - 1), None);
+        assert_eq!(fit_task_size(64, 0, 1 << 20), Some(64));
+        assert_eq!(default_memory_budget(None), 0);
+    }
+
+    #[test]
+    fn test_memory_budget() {
+        assert_eq!(memory_budget(0, None), 0);
+        assert_eq!(memory_budget(100, None), 100 << 20);
+        assert_eq!(memory_budget(0, Some(400 << 20)), 300 << 20);
+        assert_eq!(memory_budget(100, Some(400 << 20)), 100 << 20);
+        // a pool above the container's limit gets the process oom killed
+        assert_eq!(memory_budget(1000, Some(400 << 20)), 300 << 20);
+    }
+
+    #[test]
+    fn test_parse_proc_cgroup() {
+        let entries = parse_proc_cgroup("12:cpu,cpuacct:/kubepods/pod1\n0::/kubepods/pod1\n");
+        assert_eq!(entries.len(), 2);
+        assert_eq!(entries[0].0, "cpu,cpuacct");
+        assert_eq!(entries[1].0, "");
+        assert_eq!(entries[1].1, "/kubepods/pod1");
+    }
+}
@@ -15,6 +15,8 @@ use url::Url;
 #[derive(Clone, Debug)]
 pub struct Client {
     inner: InnerClient,
+    // own connection pool for hedged requests, so they don't queue behind a stuck connection
+    hedge_inner: InnerClient,
     secret_phrase: Arc<String>,
     base_uri: Url,
     headers: Arc<HeaderMap>,
@@ -127,9 +129,14 @@ impl Client {
             .timeout(Duration::from_millis(timeout))
             .build()
             .unwrap();
+        let hedge_client = ClientBuilder::new()
+            .timeout(Duration::from_millis(timeout))
+            .build()
+            .unwrap();
 
         Self {
             inner: client,
+            hedge_inner: hedge_client,
             secret_phrase: Arc::new(secret_phrase_encoded),
             base_uri,
             headers: Arc::new(headers),
@@ -138,6 +145,15 @@ impl Client {
 
     /// Get current mining info.
     pub fn get_mining_info(&self, capacity: u64, additional_headers: Arc<HashMap<String, String>>, xpu_string : Arc<String>) -> impl Future<Item = MiningInfoResponse, Error = FetchError> {
+        self.mining_info_request(&self.inner, capacity, additional_headers, xpu_string)
+    }
+
+    /// Get current mining info on a connection of the hedge pool.
+    pub fn get_mining_info_hedge(&self, capacity: u64, additional_headers: Arc<HashMap<String, String>>, xpu_string : Arc<String>) -> impl Future<Item = MiningInfoResponse, Error = FetchError> {
+        self.mining_info_request(&self.hedge_inner, capacity, additional_headers, xpu_string)
+    }
+
+    fn mining_info_request(&self, inner: &InnerClient, capacity: u64, additional_headers: Arc<HashMap<String, String>>, xpu_string : Arc<String>) -> impl Future<Item = MiningInfoResponse, Error = FetchError> {
         let mut headers = (*self.headers).clone();
         headers.insert(
             "X-Capacity",
@@ -151,7 +167,7 @@ impl Client {
             let header_name = HeaderName::from_bytes(&key.clone().into_bytes()).unwrap();
             headers.insert(header_name, value.parse().unwrap());
         }
-        self.inner
+        inner
             .get(self.uri_for("burst"))
             .headers(headers)          
             .query(&GetMiningInfoRequest {
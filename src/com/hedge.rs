@@ -0,0 +1,147 @@
+//! Hedged mining info requests.
+//!
+//! A getMiningInfo that hasn't returned by the p90 of the recent latencies is likely stuck
+//! on a slow connection. A second request is fired on a fresh one and whichever answers
+//! first is taken. The hedges are paid from a budget that refills by a percentage of the
+//! requests, so a slow pool gets at most that much extra load.
+
+use std::collections::VecDeque;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+use std::time::Duration;
+
+const SAMPLES: usize = 64;
+// no hedging before the latency is known
+const MIN_SAMPLES: usize = 10;
+const MIN_DELAY_MS: u64 = 10;
+// hedges that can be saved up while the pool answers quickly
+const MAX_TOKENS: f64 = 5.0;
+
+#[derive(Default)]
+pub struct HedgeStats {
+    pub requests: AtomicU64,
+    pub hedged: AtomicU64,
+    // the hedge answered first
+    pub won: AtomicU64,
+}
+
+struct Latencies {
+    samples: VecDeque<u64>,
+    tokens: f64,
+}
+
+pub struct Hedge {
+    // tokens per request
+    refill: f64,
+    latencies: Mutex<Latencies>,
+    pub stats: HedgeStats,
+}
+
+impl Hedge {
+    /// Hedges up to `budget_pct` percent of the requests, 0 turns hedging off.
+    pub fn new(budget_pct: u64) -> Hedge {
+        Hedge {
+            refill: budget_pct.min(100) as f64 / 100.0,
+            latencies: Mutex::new(Latencies {
+                samples: VecDeque::with_capacity(SAMPLES),
+                tokens: 0.0,
+            }),
+            stats: HedgeStats::default(),
+        }
+    }
+
+    /// Counts a request, returns when to hedge it if hedging is on and the latency known.
+    pub fn delay(&self) -> Option<Duration> {
+        self.stats.requests.fetch_add(1, Ordering::Relaxed);
+        if self.refill == 0.0 {
+            return None;
+        }
+        let mut latencies = self.latencies.lock().unwrap();
+        latencies.tokens = (latencies.tokens + self.refill).min(MAX_TOKENS);
+        if latencies.samples.len() < MIN_SAMPLES {
+            return None;
+        }
+        let mut sorted: Vec<u64> = latencies.samples.iter().cloned().collect();
+        sorted.sort_unstable();
+        let p90 = sorted[(sorted.len() * 9 + 9) / 10 - 1];
+        Some(Duration::from_millis(p90.max(MIN_DELAY_MS)))
+    }
+
+    /// Takes a hedge from the budget, false if it's used up.
+    pub fn fire(&self) -> bool {
+        let mut latencies = self.latencies.lock().unwrap();
+        if latencies.tokens < 1.0 {
+            return false;
+        }
+        latencies.tokens -= 1.0;
+        self.stats.hedged.fetch_add(1, Ordering::Relaxed);
+        true
+    }
+
+    pub fn observe(&self, latency: Duration) {
+        let ms = latency.as_secs() * 1000 + u64::from(latency.subsec_millis());
+        let mut latencies = self.latencies.lock().unwrap();
+        if latencies.samples.len() == SAMPLES {
+            latencies.samples.pop_front();
+        }
+        latencies.samples.push_back(ms);
+    }
+
+    pub fn won(&self) {
+        self.stats.won.fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_delay_is_p90() {
+        let hedge = Hedge::new(10);
+        for ms in 1..=9 {
+            hedge.observe(Duration::from_millis(ms * 100));
+            assert_eq!(hedge.delay(), None);
+        }
+        hedge.observe(Duration::from_millis(5000));
+        assert_eq!(hedge.delay(), Some(Duration::from_millis(900)));
+        for _ in 0..SAMPLES {
+            hedge.observe(Duration::from_millis(1));
+        }
+        assert_eq!(hedge.delay(), Some(Duration::from_millis(MIN_DELAY_MS)));
+    }
+
+    #[test]
+    fn test_budget() {
+        let off = Hedge::new(0);
+        for _ in 0..SAMPLES {
+            off.observe(Duration::from_millis(100));
+        }
+        assert_eq!(off.delay(), None);
+
+        let hedge = Hedge::new(10);
+        for _ in 0..SAMPLES {
+            hedge.observe(Duration::from_millis(100));
+        }
+        let mut fired = 0;
+        for _ in 0..1000 {
+            if hedge.delay().is_some() && hedge.fire() {
+                fired += 1;
+            }
+        }
+        assert!(fired >= 99 && fired <= 100, "{} hedges", fired);
+
+        // savings are capped
+        let hedge = Hedge::new(100);
+        for _ in 0..SAMPLES {
+            hedge.observe(Duration::from_millis(100));
+            hedge.delay();
+        }
+        let mut fired = 0;
+        while hedge.fire() {
+            fired += 1;
+        }
+        assert_eq!(fired, MAX_TOKENS as u64);
+        assert_eq!(hedge.stats.hedged.load(Ordering::Relaxed), fired);
+    }
+}
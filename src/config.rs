@@ -13,6 +13,9 @@ pub struct Cfg {
     #[serde(default = "default_start_nonce")]
     pub start_nonce: u64,
 
+    #[serde(default = "default_accounts")]
+    pub accounts: Vec<Account>,
+
     #[serde(default = "default_secret_phrase")]
     pub secret_phrase: String,
 
@@ -34,15 +37,45 @@ pub struct Cfg {
     #[serde(default = "default_cpu_thread_pinning")]
     pub cpu_thread_pinning: bool,
 
+    #[serde(default = "default_max_memory")]
+    pub max_memory: u64,
+
+    #[serde(default = "default_nonce_cache_size")]
+    pub nonce_cache_size: u64,
+
+    #[serde(default = "default_nonce_cache_shm")]
+    pub nonce_cache_shm: String,
+
+    #[serde(default = "default_cache_build_deadline")]
+    pub cache_build_deadline: u64,
+
+    #[serde(default = "default_nonce_cache_gpu")]
+    pub nonce_cache_gpu: bool,
+
+    #[serde(default = "default_cpu_governor")]
+    pub cpu_governor: u64,
+
+    #[serde(default = "default_cpu_governor_window")]
+    pub cpu_governor_window: u64,
+
     #[serde(default = "default_target_deadline")]
     pub target_deadline: u64,
 
     #[serde(default = "default_get_mining_info_interval")]
     pub get_mining_info_interval: u64,
 
+    #[serde(default = "default_block_time_shape")]
+    pub block_time_shape: u32,
+
+    #[serde(default = "default_get_mining_info_hedge")]
+    pub get_mining_info_hedge: u64,
+
     #[serde(default = "default_timeout")]
     pub timeout: u64,
 
+    #[serde(default = "default_submission_debounce")]
+    pub submission_debounce: u64,
+
     #[serde(default = "default_send_proxy_details")]
     pub send_proxy_details: bool,
 
@@ -66,6 +99,45 @@ pub struct Cfg {
 
     #[serde(default = "default_logfile_log_pattern")]
     pub logfile_log_pattern: String,
+
+    #[serde(default = "default_trace_file")]
+    pub trace_file: String,
+
+    #[serde(default = "default_perf_counters")]
+    pub perf_counters: bool,
+
+    #[serde(default = "default_round_log")]
+    pub round_log: String,
+
+    #[serde(default = "default_control_socket")]
+    pub control_socket: String,
+}
+
+/// An account mined next to the others, devices are shared according to `weight`.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct Account {
+    pub numeric_id: u64,
+
+    #[serde(default = "default_start_nonce")]
+    pub start_nonce: u64,
+
+    #[serde(default = "default_weight")]
+    pub weight: u64,
+}
+
+impl Cfg {
+    /// The configured accounts, or the single `numeric_id` if none are configured.
+    pub fn accounts(&self) -> Vec<Account> {
+        if self.accounts.is_empty() {
+            vec![Account {
+                numeric_id: self.numeric_id,
+                start_nonce: self.start_nonce,
+                weight: default_weight(),
+            }]
+        } else {
+            self.accounts.clone()
+        }
+    }
 }
 
 fn default_numeric_id() -> u64 {
@@ -78,6 +150,14 @@ fn default_start_nonce() -> u64 {
     u64::from(rng.gen::<u32>())
 }
 
+fn default_accounts() -> Vec<Account> {
+    Vec::new()
+}
+
+fn default_weight() -> u64 {
+    1
+}
+
 fn default_secret_phrase() -> String {
     "".to_owned()
 }
@@ -98,6 +178,34 @@ fn default_cpu_thread_pinning() -> bool {
     false
 }
 
+fn default_max_memory() -> u64 {
+    0
+}
+
+fn default_nonce_cache_size() -> u64 {
+    0
+}
+
+fn default_nonce_cache_shm() -> String {
+    "".to_owned()
+}
+
+fn default_cache_build_deadline() -> u64 {
+    0
+}
+
+fn default_nonce_cache_gpu() -> bool {
+    false
+}
+
+fn default_cpu_governor() -> u64 {
+    0
+}
+
+fn default_cpu_governor_window() -> u64 {
+    20000
+}
+
 fn default_gpus() -> Vec<GpuConfig> {
     Vec::new()
 }
@@ -110,10 +218,22 @@ fn default_get_mining_info_interval() -> u64 {
     3000
 }
 
+fn default_block_time_shape() -> u32 {
+    1
+}
+
+fn default_get_mining_info_hedge() -> u64 {
+    0
+}
+
 fn default_timeout() -> u64 {
     5000
 }
 
+fn default_submission_debounce() -> u64 {
+    0
+}
+
 fn default_send_proxy_details() -> bool {
     false
 }
@@ -146,6 +266,22 @@ fn default_logfile_log_pattern() -> String {
     "\r{d(%Y-%m-%dT%H:%M:%S.%3f%z)} [{h({l}):<5}] [{T}] [{f}:{L}] [{t}] - {M}:{m}{n}".to_owned()
 }
 
+fn default_trace_file() -> String {
+    "".to_owned()
+}
+
+fn default_perf_counters() -> bool {
+    false
+}
+
+fn default_round_log() -> String {
+    "".to_owned()
+}
+
+fn default_control_socket() -> String {
+    "".to_owned()
+}
+
 pub fn load_cfg(config: &str) -> Cfg {
     let cfg_str =
         fs::read_to_string(config).expect(&format!("failed to open config, config={}", config));
@@ -162,4 +298,27 @@ mod tests {
         let cfg = load_cfg("config.yaml");
         assert_eq!(cfg.timeout, 3000);
     }
+
+    #[test]
+    fn test_accounts() {
+        let cfg: Cfg = serde_yaml::from_str(
+            "url: 'http://localhost:8125'\n\
+             numeric_id: 7\n\
+             start_nonce: 3\n",
+        )
+        .unwrap();
+        let accounts = cfg.accounts();
+        assert_eq!(accounts.len(), 1);
+        assert_eq!((accounts[0].numeric_id, accounts[0].start_nonce), (7, 3));
+
+        let cfg: Cfg = serde_yaml::from_str(
+            "url: 'http://localhost:8125'\n\
+             accounts:\n  - numeric_id: 1\n    weight: 3\n  - numeric_id: 2\n",
+        )
+        .unwrap();
+        let accounts = cfg.accounts();
+        assert_eq!(accounts.len(), 2);
+        assert_eq!(accounts[0].weight, 3);
+        assert_eq!(accounts[1].weight, 1);
+    }
 }
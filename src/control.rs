@@ -0,0 +1,163 @@
+//! Local control socket for changing a running miner without a restart.
+//!
+//! Every connection to `control_socket` takes one command per line and gets one reply line:
+//!
+//!   status                        current configuration and work in flight
+//!   pause / resume                stop / restart handing out tasks, running tasks finish
+//!   cpu_threads <n>               resize the cpu worker pool, old workers drain, at least 1
+//!                                 and capped like the configured cpu_threads
+//!   cpu_task_size <nonces>        change the size of the next cpu tasks
+//!   engine <avx512f|avx2|...>     switch the cpu engine next round, once the cpu tasks drained
+//!   gpu add <platform> <device> <cores>
+//!   gpu remove <id>               the gpu finishes its current task first
+//!
+//! Commands are executed by the scheduler between two tasks, so nonce ranges, best deadlines
+//! and the capacity estimate survive every change.
+
+use crate::cpu_hasher::SimdExtension;
+use crate::scheduler::HasherMessage;
+use crossbeam_channel::{unbounded, Sender};
+use std::time::Duration;
+
+// the scheduler only executes commands once the first round arrived
+const REPLY_TIMEOUT: Duration = Duration::from_secs(10);
+
+#[derive(Debug)]
+pub enum ControlCommand {
+    Status,
+    Pause,
+    Resume,
+    CpuThreads(usize),
+    CpuTaskSize(u64),
+    Engine(SimdExtension),
+    GpuAdd(usize, usize, usize), //(platform, device, cores)
+    GpuRemove(usize),
+}
+
+pub fn parse_command(line: &str) -> Result<ControlCommand, String> {
+    let args: Vec<&str> = line.split_whitespace().collect();
+    let number = |i: usize| -> Result<u64, String> {
+        args.get(i)
+            .ok_or_else(|| "missing argument".to_owned())?
+            .parse::<u64>()
+            .map_err(|e| format!("invalid argument {}: {}", args[i], e))
+    };
+    match args.as_slice() {
+        ["status"] => Ok(ControlCommand::Status),
+        ["pause"] => Ok(ControlCommand::Pause),
+        ["resume"] => Ok(ControlCommand::Resume),
+        ["cpu_threads", _] => Ok(ControlCommand::CpuThreads(number(1)? as usize)),
+        ["cpu_task_size", _] => Ok(ControlCommand::CpuTaskSize(number(1)?)),
+        ["engine", name] => SimdExtension::from_name(name)
+            .map(ControlCommand::Engine)
+            .ok_or_else(|| format!("unknown engine {}", name)),
+        ["gpu", "add", _, _, _] => Ok(ControlCommand::GpuAdd(
+            number(2)? as usize,
+            number(3)? as usize,
+            number(4)? as usize,
+        )),
+        ["gpu", "remove", _] => Ok(ControlCommand::GpuRemove(number(2)? as usize)),
+        _ => Err(format!("unknown command: {}", line.trim())),
+    }
+}
+
+// hands the command to the scheduler and waits for its reply
+fn execute(tx: &Sender<HasherMessage>, line: &str) -> String {
+    let command = match parse_command(line) {
+        Ok(x) => x,
+        Err(e) => return format!("error: {}", e),
+    };
+    let (tx_reply, rx_reply) = unbounded();
+    if tx.send(HasherMessage::Control(command, tx_reply)).is_err() {
+        return "error: scheduler stopped".to_owned();
+    }
+    rx_reply
+        .recv_timeout(REPLY_TIMEOUT)
+        .unwrap_or_else(|_| "error: scheduler didn't reply, waiting for the first round?".to_owned())
+}
+
+/// Listens on the unix socket at `path`, an empty path disables the control socket.
+#[cfg(unix)]
+pub fn start(path: &str, tx: Sender<HasherMessage>) {
+    use std::io::{BufRead, BufReader, Write};
+    use std::os::unix::net::UnixListener;
+    use std::thread;
+
+    if path.is_empty() {
+        return;
+    }
+    // a socket left behind by a previous run
+    let _ = std::fs::remove_file(path);
+    let listener = match UnixListener::bind(path) {
+        Ok(x) => x,
+        Err(e) => {
+            error!("can't bind control socket {}: {}", path, e);
+            return;
+        }
+    };
+    info!("control socket: {}", path);
+    thread::spawn(move || {
+        for stream in listener.incoming() {
+            let stream = match stream {
+                Ok(x) => x,
+                Err(e) => {
+                    warn!("control socket: {}", e);
+                    continue;
+                }
+            };
+            let tx = tx.clone();
+            thread::spawn(move || {
+                let mut writer = match stream.try_clone() {
+                    Ok(x) => x,
+                    Err(_) => return,
+                };
+                for line in BufReader::new(stream).lines() {
+                    let line = match line {
+                        Ok(x) => x,
+                        Err(_) => break,
+                    };
+                    if line.trim().is_empty() {
+                        continue;
+                    }
+                    let reply = execute(&tx, &line);
+                    info!("{: <80}", format!("control: {} => {}", line.trim(), reply));
+                    if writeln!(writer, "{}", reply).is_err() {
+                        break;
+                    }
+                }
+            });
+        }
+    });
+}
+
+#[cfg(not(unix))]
+pub fn start(path: &str, _tx: Sender<HasherMessage>) {
+    if !path.is_empty() {
+        warn!("control socket is only supported on unix");
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_command() {
+        assert!(match parse_command("cpu_threads 4") {
+            Ok(ControlCommand::CpuThreads(4)) => true,
+            _ => false,
+        });
+        assert!(match parse_command(" gpu add 0 1 0 ") {
+            Ok(ControlCommand::GpuAdd(0, 1, 0)) => true,
+            _ => false,
+        });
+        assert!(match parse_command("engine AVX2") {
+            Ok(ControlCommand::Engine(SimdExtension::AVX2)) => true,
+            _ => false,
+        });
+        assert!(parse_command("cpu_threads x").is_err());
+        assert!(parse_command("engine neon").is_err());
+        assert!(parse_command("gpu remove").is_err());
+        assert!(parse_command("reboot").is_err());
+    }
+}
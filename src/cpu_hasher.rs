@@ -1,14 +1,24 @@
-use crate::buffer::PageAlignedByteBuffer;
+use crate::buffer::{MemoryReservation, PageAlignedByteBuffer};
 use crate::miner::NonceData;
+use crate::nonce_cache::{NonceCache, TransposeJob};
+use crate::perf::{self, Phase};
 use crate::poc_hashing::find_best_deadline_rust;
+use crate::poc_hashing::find_best_deadline_sm_rust;
 use crate::poc_hashing::noncegen_rust;
-use crate::poc_hashing::NONCE_SIZE;
+use crate::poc_hashing::{NONCE_SIZE, SCOOP_SIZE};
 use crate::scheduler::{HasherMessage, RoundInfo};
+use crate::supervisor::CpuTaskState;
+use crate::trace;
 use crossbeam_channel::Sender;
 use futures::sync::mpsc;
 use libc::{c_void, uint64_t};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Arc;
 use std::u64;
 
+// the C kernels hash up to 16 nonces at once, tasks need to be a multiple of that
+pub const CPU_TASK_ALIGNMENT: u64 = 16;
+
 #[derive(Debug, Clone)]
 pub enum SimdExtension {
     AVX512f,
@@ -79,13 +89,287 @@ extern "C" {
         best_deadline: *mut uint64_t,
         best_offset: *mut uint64_t,
     ) -> ();
+    pub fn find_best_deadline_sm_avx512f(
+        data: *const c_void,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+    pub fn find_best_deadline_sm_avx2(
+        data: *const c_void,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+    pub fn find_best_deadline_sm_avx(
+        data: *const c_void,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+    pub fn find_best_deadline_sm_sse2(
+        data: *const c_void,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+}
+
+// tuned builds of the avx2 and avx512f kernels, see build.rs
+#[cfg(tuned_kernels)]
+extern "C" {
+    fn zen_init_shabal_avx2();
+    fn zen_noncegen_avx2(
+        cache: *mut c_void,
+        numeric_ID: uint64_t,
+        local_startnonce: uint64_t,
+        local_nonces: uint64_t,
+    );
+    fn zen_find_best_deadline_avx2(
+        data: *const c_void,
+        scoop: uint64_t,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+    fn zen_find_best_deadline_sm_avx2(
+        data: *const c_void,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+    fn skylake_init_shabal_avx2();
+    fn skylake_noncegen_avx2(
+        cache: *mut c_void,
+        numeric_ID: uint64_t,
+        local_startnonce: uint64_t,
+        local_nonces: uint64_t,
+    );
+    fn skylake_find_best_deadline_avx2(
+        data: *const c_void,
+        scoop: uint64_t,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+    fn skylake_find_best_deadline_sm_avx2(
+        data: *const c_void,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+    fn skylake_init_shabal_avx512f();
+    fn skylake_noncegen_avx512f(
+        cache: *mut c_void,
+        numeric_ID: uint64_t,
+        local_startnonce: uint64_t,
+        local_nonces: uint64_t,
+    );
+    fn skylake_find_best_deadline_avx512f(
+        data: *const c_void,
+        scoop: uint64_t,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+    fn skylake_find_best_deadline_sm_avx512f(
+        data: *const c_void,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+    fn icelake_init_shabal_avx512f();
+    fn icelake_noncegen_avx512f(
+        cache: *mut c_void,
+        numeric_ID: uint64_t,
+        local_startnonce: uint64_t,
+        local_nonces: uint64_t,
+    );
+    fn icelake_find_best_deadline_avx512f(
+        data: *const c_void,
+        scoop: uint64_t,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+    fn icelake_find_best_deadline_sm_avx512f(
+        data: *const c_void,
+        nonce_count: uint64_t,
+        gensig: *const c_void,
+        best_deadline: *mut uint64_t,
+        best_offset: *mut uint64_t,
+    ) -> ();
+}
+
+/// Microarchitecture the avx2 and avx512f kernels are tuned for.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Tune {
+    Generic,
+    Zen,
+    Skylake,
+    IceLake,
+}
+
+// Tune as usize, picked once at startup
+static TUNE: AtomicUsize = AtomicUsize::new(0);
+
+impl Tune {
+    #[cfg(tuned_kernels)]
+    const ALL: [Tune; 4] = [Tune::Generic, Tune::Zen, Tune::Skylake, Tune::IceLake];
+
+    /// Classifies a cpu by vendor and display family and model.
+    pub fn classify(vendor: &str, family: u32, model: u32) -> Tune {
+        match vendor {
+            "AuthenticAMD" | "HygonGenuine" if family >= 0x17 => Tune::Zen,
+            "GenuineIntel" if family == 6 => match model {
+                // Ice Lake, Tiger Lake, Rocket Lake, Sapphire, Emerald and Granite Rapids
+                0x6a | 0x6c | 0x7d | 0x7e | 0x8c | 0x8d | 0xa7 | 0x8f | 0xcf | 0xad | 0xae => {
+                    Tune::IceLake
+                }
+                // Skylake, Skylake-SP, Cascade and Cooper Lake, Kaby, Coffee and Comet Lake
+                0x4e | 0x5e | 0x55 | 0x8e | 0x9e | 0xa5 | 0xa6 => Tune::Skylake,
+                // older cores and hybrid ones, whose efficiency cores aren't Skylake-like
+                _ => Tune::Generic,
+            },
+            _ => Tune::Generic,
+        }
+    }
+
+    pub fn detect() -> Tune {
+        let cpuid = raw_cpuid::CpuId::new();
+        let vendor = match cpuid.get_vendor_info() {
+            Some(x) => x.as_string().to_owned(),
+            None => return Tune::Generic,
+        };
+        let features = match cpuid.get_feature_info() {
+            Some(x) => x,
+            None => return Tune::Generic,
+        };
+        let mut family = u32::from(features.family_id());
+        let mut model = u32::from(features.model_id());
+        if family == 0xf {
+            family += u32::from(features.extended_family_id());
+        }
+        if family == 0x6 || family >= 0xf {
+            model += u32::from(features.extended_model_id()) << 4;
+        }
+        Tune::classify(&vendor, family, model)
+    }
+
+    #[cfg(tuned_kernels)]
+    fn get() -> Tune {
+        Tune::ALL[TUNE.load(Ordering::Relaxed)]
+    }
+
+    fn set(self) {
+        TUNE.store(self as usize, Ordering::Relaxed);
+    }
+}
+
+type Noncegen = unsafe extern "C" fn(*mut c_void, uint64_t, uint64_t, uint64_t);
+type FindBestDeadline = unsafe extern "C" fn(
+    *const c_void,
+    uint64_t,
+    uint64_t,
+    *const c_void,
+    *mut uint64_t,
+    *mut uint64_t,
+);
+type FindBestDeadlineSm =
+    unsafe extern "C" fn(*const c_void, uint64_t, *const c_void, *mut uint64_t, *mut uint64_t);
+
+// one build of the kernels of an extension
+struct Kernels {
+    name: &'static str,
+    init: unsafe extern "C" fn(),
+    noncegen: Noncegen,
+    find_best_deadline: FindBestDeadline,
+    find_best_deadline_sm: FindBestDeadlineSm,
+}
+
+// The avx2 or avx512f build tuned for this cpu, the generic one if there's none. Avx512f
+// cpus of AMD run the generic build.
+fn kernels(simd_ext: &SimdExtension) -> Kernels {
+    #[cfg(tuned_kernels)]
+    match (simd_ext, Tune::get()) {
+        (SimdExtension::AVX2, Tune::Zen) => {
+            return Kernels {
+                name: "zen",
+                init: zen_init_shabal_avx2,
+                noncegen: zen_noncegen_avx2,
+                find_best_deadline: zen_find_best_deadline_avx2,
+                find_best_deadline_sm: zen_find_best_deadline_sm_avx2,
+            }
+        }
+        (SimdExtension::AVX2, Tune::Skylake) | (SimdExtension::AVX2, Tune::IceLake) => {
+            return Kernels {
+                name: "skylake",
+                init: skylake_init_shabal_avx2,
+                noncegen: skylake_noncegen_avx2,
+                find_best_deadline: skylake_find_best_deadline_avx2,
+                find_best_deadline_sm: skylake_find_best_deadline_sm_avx2,
+            }
+        }
+        (SimdExtension::AVX512f, Tune::Skylake) => {
+            return Kernels {
+                name: "skylake",
+                init: skylake_init_shabal_avx512f,
+                noncegen: skylake_noncegen_avx512f,
+                find_best_deadline: skylake_find_best_deadline_avx512f,
+                find_best_deadline_sm: skylake_find_best_deadline_sm_avx512f,
+            }
+        }
+        (SimdExtension::AVX512f, Tune::IceLake) => {
+            return Kernels {
+                name: "icelake",
+                init: icelake_init_shabal_avx512f,
+                noncegen: icelake_noncegen_avx512f,
+                find_best_deadline: icelake_find_best_deadline_avx512f,
+                find_best_deadline_sm: icelake_find_best_deadline_sm_avx512f,
+            }
+        }
+        _ => {}
+    }
+    match simd_ext {
+        SimdExtension::AVX512f => Kernels {
+            name: "generic",
+            init: init_shabal_avx512f,
+            noncegen: noncegen_avx512f,
+            find_best_deadline: find_best_deadline_avx512f,
+            find_best_deadline_sm: find_best_deadline_sm_avx512f,
+        },
+        SimdExtension::AVX2 => Kernels {
+            name: "generic",
+            init: init_shabal_avx2,
+            noncegen: noncegen_avx2,
+            find_best_deadline: find_best_deadline_avx2,
+            find_best_deadline_sm: find_best_deadline_sm_avx2,
+        },
+        _ => unreachable!("only the avx2 and avx512f kernels have tuned builds"),
+    }
 }
 
 pub struct CpuTask {
+    pub account: usize,
     pub numeric_id: u64,
     pub local_startnonce: u64,
     pub local_nonces: u64,
     pub round: RoundInfo,
+    pub memory: MemoryReservation,
+    // false only generates the nonces for the nonce cache
+    pub scan: bool,
+    pub state: CpuTaskState,
 }
 
 #[derive(Clone)]
@@ -101,14 +385,19 @@ pub struct DeadlineHashingTask {
 }
 
 pub fn init_cpu_extensions() -> SimdExtension {
+    Tune::detect().set();
     if is_x86_feature_detected!("avx512f") {
+        let kernels = kernels(&SimdExtension::AVX512f);
+        info!("cpu kernels: avx512f, tuned for {}", kernels.name);
         unsafe {
-            init_shabal_avx512f();
+            (kernels.init)();
         }
         SimdExtension::AVX512f
     } else if is_x86_feature_detected!("avx2") {
+        let kernels = kernels(&SimdExtension::AVX2);
+        info!("cpu kernels: avx2, tuned for {}", kernels.name);
         unsafe {
-            init_shabal_avx2();
+            (kernels.init)();
         }
         SimdExtension::AVX2
     } else if is_x86_feature_detected!("avx") {
@@ -126,117 +415,299 @@ pub fn init_cpu_extensions() -> SimdExtension {
     }
 }
 
+impl SimdExtension {
+    /// Number of nonces the kernels hash in parallel. Their buffers interleave the hashes
+    /// of that many nonces word by word.
+    pub fn lanes(&self) -> usize {
+        match self {
+            SimdExtension::AVX512f => 16,
+            SimdExtension::AVX2 => 8,
+            SimdExtension::AVX | SimdExtension::SSE2 => 4,
+            SimdExtension::None => 1,
+        }
+    }
+
+    /// Parses an engine name like the ones `init_cpu_extensions` logs, e.g. "avx2".
+    pub fn from_name(name: &str) -> Option<SimdExtension> {
+        match name.to_lowercase().as_str() {
+            "avx512f" => Some(SimdExtension::AVX512f),
+            "avx2" => Some(SimdExtension::AVX2),
+            "avx" => Some(SimdExtension::AVX),
+            "sse2" => Some(SimdExtension::SSE2),
+            "none" => Some(SimdExtension::None),
+            _ => None,
+        }
+    }
+
+    /// True if the cpu supports the engine.
+    pub fn supported(&self) -> bool {
+        match self {
+            SimdExtension::AVX512f => is_x86_feature_detected!("avx512f"),
+            SimdExtension::AVX2 => is_x86_feature_detected!("avx2"),
+            SimdExtension::AVX => is_x86_feature_detected!("avx"),
+            SimdExtension::SSE2 => is_x86_feature_detected!("sse2"),
+            SimdExtension::None => true,
+        }
+    }
+
+    /// Initializes the engine, false if the cpu doesn't support it.
+    pub fn init(&self) -> bool {
+        if !self.supported() {
+            return false;
+        }
+        match self {
+            SimdExtension::AVX512f | SimdExtension::AVX2 => unsafe {
+                (kernels(self).init)();
+            },
+            SimdExtension::AVX => unsafe {
+                init_shabal_avx();
+            },
+            SimdExtension::SSE2 => unsafe {
+                init_shabal_sse2();
+            },
+            SimdExtension::None => {}
+        }
+        true
+    }
+}
+
+// cache:		    cache to save to, local_nonces * NONCE_SIZE bytes
+// numeric_id:		numeric account id
+// loc_startnonce	nonce to start generation at
+// local_nonces: 	number of nonces to generate, a multiple of CPU_TASK_ALIGNMENT
+pub fn noncegen(
+    simd_ext: &SimdExtension,
+    cache: &mut [u8],
+    numeric_id: u64,
+    local_startnonce: u64,
+    local_nonces: u64,
+) {
+    assert!(cache.len() >= local_nonces as usize * NONCE_SIZE);
+    unsafe {
+        match simd_ext {
+            SimdExtension::AVX512f | SimdExtension::AVX2 => (kernels(simd_ext).noncegen)(
+                cache.as_mut_ptr() as *mut c_void,
+                numeric_id,
+                local_startnonce,
+                local_nonces,
+            ),
+            SimdExtension::AVX => noncegen_avx(
+                cache.as_mut_ptr() as *mut c_void,
+                numeric_id,
+                local_startnonce,
+                local_nonces,
+            ),
+            SimdExtension::SSE2 => noncegen_sse2(
+                cache.as_mut_ptr() as *mut c_void,
+                numeric_id,
+                local_startnonce,
+                local_nonces,
+            ),
+            _ => noncegen_rust(cache, numeric_id, local_startnonce, local_nonces),
+        }
+    }
+}
+
+/// Returns (deadline, offset) of the best nonce in a noncegen buffer.
+pub fn find_best_deadline(
+    simd_ext: &SimdExtension,
+    data: &[u8],
+    scoop: u64,
+    nonce_count: u64,
+    gensig: &[u8; 32],
+) -> (u64, u64) {
+    assert!(data.len() >= nonce_count as usize * NONCE_SIZE);
+    let mut deadline: u64 = u64::MAX;
+    let mut offset: u64 = 0;
+    unsafe {
+        match simd_ext {
+            SimdExtension::AVX512f | SimdExtension::AVX2 => {
+                (kernels(simd_ext).find_best_deadline)(
+                    data.as_ptr() as *const c_void,
+                    scoop,
+                    nonce_count,
+                    gensig.as_ptr() as *const c_void,
+                    &mut deadline,
+                    &mut offset,
+                )
+            }
+            SimdExtension::AVX => find_best_deadline_avx(
+                data.as_ptr() as *const c_void,
+                scoop,
+                nonce_count,
+                gensig.as_ptr() as *const c_void,
+                &mut deadline,
+                &mut offset,
+            ),
+            SimdExtension::SSE2 => find_best_deadline_sse2(
+                data.as_ptr() as *const c_void,
+                scoop,
+                nonce_count,
+                gensig.as_ptr() as *const c_void,
+                &mut deadline,
+                &mut offset,
+            ),
+            _ => {
+                let result = find_best_deadline_rust(data, scoop, nonce_count, gensig);
+                deadline = result.0;
+                offset = result.1;
+            }
+        }
+    }
+    (deadline, offset)
+}
+
+/// Returns (deadline, offset) of the best nonce in one scoop of a scoop-major nonce cache,
+/// see `nonce_cache`.
+pub fn find_best_deadline_sm(
+    simd_ext: &SimdExtension,
+    data: &[u8],
+    nonce_count: u64,
+    gensig: &[u8; 32],
+) -> (u64, u64) {
+    assert!(data.len() >= nonce_count as usize * SCOOP_SIZE);
+    assert_eq!(nonce_count % simd_ext.lanes() as u64, 0);
+    let mut deadline: u64 = u64::MAX;
+    let mut offset: u64 = 0;
+    unsafe {
+        match simd_ext {
+            SimdExtension::AVX512f | SimdExtension::AVX2 => {
+                (kernels(simd_ext).find_best_deadline_sm)(
+                    data.as_ptr() as *const c_void,
+                    nonce_count,
+                    gensig.as_ptr() as *const c_void,
+                    &mut deadline,
+                    &mut offset,
+                )
+            }
+            SimdExtension::AVX => find_best_deadline_sm_avx(
+                data.as_ptr() as *const c_void,
+                nonce_count,
+                gensig.as_ptr() as *const c_void,
+                &mut deadline,
+                &mut offset,
+            ),
+            SimdExtension::SSE2 => find_best_deadline_sm_sse2(
+                data.as_ptr() as *const c_void,
+                nonce_count,
+                gensig.as_ptr() as *const c_void,
+                &mut deadline,
+                &mut offset,
+            ),
+            _ => {
+                let result = find_best_deadline_sm_rust(data, nonce_count, gensig);
+                deadline = result.0;
+                offset = result.1;
+            }
+        }
+    }
+    (deadline, offset)
+}
+
 pub fn hash_cpu(
     tx: Sender<HasherMessage>,
     hasher_task: CpuTask,
     simd_ext: SimdExtension,
+    cache: Option<Arc<NonceCache>>,
 ) -> impl FnOnce() {
     move || {
         // alloc
         let buffer = PageAlignedByteBuffer::new(hasher_task.local_nonces as usize * NONCE_SIZE);
-        let bs = buffer.get_buffer();
-        let mut bs = bs.lock().unwrap();
-        unsafe {
-            match simd_ext {
-                SimdExtension::AVX512f => noncegen_avx512f(
-                    bs.as_mut_ptr() as *mut c_void,
-                    hasher_task.numeric_id,
-                    hasher_task.local_startnonce,
-                    hasher_task.local_nonces,
-                ),
-                SimdExtension::AVX2 => noncegen_avx2(
-                    bs.as_mut_ptr() as *mut c_void,
-                    hasher_task.numeric_id,
-                    hasher_task.local_startnonce,
-                    hasher_task.local_nonces,
-                ),
-                SimdExtension::AVX => noncegen_avx(
-                    bs.as_mut_ptr() as *mut c_void,
-                    hasher_task.numeric_id,
-                    hasher_task.local_startnonce,
-                    hasher_task.local_nonces,
-                ),
-                SimdExtension::SSE2 => noncegen_sse2(
-                    bs.as_mut_ptr() as *mut c_void,
-                    hasher_task.numeric_id,
-                    hasher_task.local_startnonce,
-                    hasher_task.local_nonces,
-                ),
-                _ => noncegen_rust(
-                    &mut bs[..],
-                    hasher_task.numeric_id,
-                    hasher_task.local_startnonce,
-                    hasher_task.local_nonces,
-                ),
-            }
-        }
+        let data = buffer.get_buffer();
+        let mut bs = data.lock().unwrap();
+        let span = trace::span_with("noncegen", "cpu", "nonces", hasher_task.local_nonces);
+        perf::measure(Phase::Noncegen, hasher_task.local_nonces, || {
+            noncegen(
+                &simd_ext,
+                &mut bs,
+                hasher_task.numeric_id,
+                hasher_task.local_startnonce,
+                hasher_task.local_nonces,
+            )
+        });
 
-        // calc best deadline
-        #[allow(unused_assignments)]
-        let mut deadline: u64 = u64::MAX;
-        #[allow(unused_assignments)]
-        let mut offset: u64 = 0;
+        drop(span);
 
-        unsafe {
-            match simd_ext {
-                SimdExtension::AVX512f => find_best_deadline_avx512f(
-                    bs.as_ptr() as *const c_void,
-                    hasher_task.round.scoop,
-                    hasher_task.local_nonces,
-                    hasher_task.round.gensig.as_ptr() as *const c_void,
-                    &mut deadline,
-                    &mut offset,
-                ),
-                SimdExtension::AVX2 => find_best_deadline_avx2(
-                    bs.as_ptr() as *const c_void,
-                    hasher_task.round.scoop,
-                    hasher_task.local_nonces,
-                    hasher_task.round.gensig.as_ptr() as *const c_void,
-                    &mut deadline,
-                    &mut offset,
-                ),
-                SimdExtension::AVX => find_best_deadline_avx(
-                    bs.as_ptr() as *const c_void,
-                    hasher_task.round.scoop,
-                    hasher_task.local_nonces,
-                    hasher_task.round.gensig.as_ptr() as *const c_void,
-                    &mut deadline,
-                    &mut offset,
-                ),
-                SimdExtension::SSE2 => find_best_deadline_sse2(
-                    bs.as_ptr() as *const c_void,
+        // calc best deadline
+        let best = if hasher_task.scan {
+            let _span =
+                trace::span_with("find_best_deadline", "cpu", "nonces", hasher_task.local_nonces);
+            Some(perf::measure(Phase::Deadline, hasher_task.local_nonces, || {
+                find_best_deadline(
+                    &simd_ext,
+                    &bs,
                     hasher_task.round.scoop,
                     hasher_task.local_nonces,
-                    hasher_task.round.gensig.as_ptr() as *const c_void,
-                    &mut deadline,
-                    &mut offset,
-                ),
-                _ => {
-                    let result = find_best_deadline_rust(
-                        &bs,
-                        hasher_task.round.scoop,
-                        hasher_task.local_nonces,
-                        &hasher_task.round.gensig,
-                    );
-                    deadline = result.0;
-                    offset = result.1;
-                }
-            }
+                    &hasher_task.round.gensig,
+                )
+            }))
+        } else {
+            None
+        };
+
+        // free the buffer before requesting new work, so the scheduler can reuse its memory,
+        // unless the nonce cache takes it over
+        drop(bs);
+        drop(data);
+        // the scheduler gave up on this task and handed out its range again
+        if !hasher_task.state.report() {
+            return;
         }
 
         // report hashing done
-        tx.send(HasherMessage::NoncesProcessed(hasher_task.local_nonces))
-            .expect("CPU task can't communicate with scheduler thread.");
-
-        tx.send(HasherMessage::SubmitDeadline((
-            hasher_task.round.height,
-            hasher_task.local_startnonce + offset,
-            deadline,
+        tx.send(HasherMessage::NoncesProcessed(
+            hasher_task.account,
+            hasher_task.local_nonces,
             hasher_task.round.block,
-        )))
+        ))
         .expect("CPU task can't communicate with scheduler thread.");
 
-        tx.send(HasherMessage::CpuRequestForWork)
+        match cache {
+            Some(cache) => cache.offer(TransposeJob {
+                account: hasher_task.account,
+                start_nonce: hasher_task.local_startnonce,
+                nonces: hasher_task.local_nonces,
+                lanes: simd_ext.lanes(),
+                buffer,
+                memory: hasher_task.memory,
+            }),
+            None => {
+                drop(buffer);
+                drop(hasher_task.memory);
+            }
+        }
+
+        if let Some((deadline, offset)) = best {
+            tx.send(HasherMessage::SubmitDeadline((
+                hasher_task.account,
+                hasher_task.round.height,
+                hasher_task.local_startnonce + offset,
+                deadline,
+                hasher_task.round.block,
+            )))
+            .expect("CPU task can't communicate with scheduler thread.");
+        }
+
+        hasher_task.state.finish();
+        tx.send(HasherMessage::CpuRequestForWork(hasher_task.local_nonces))
             .expect("CPU task can't communicate with scheduler thread.");
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_classify_tune() {
+        assert_eq!(Tune::classify("AuthenticAMD", 0x19, 0x21), Tune::Zen);
+        assert_eq!(Tune::classify("AuthenticAMD", 0x15, 0x02), Tune::Generic);
+        // Cascade Lake, Coffee Lake, Sapphire Rapids, Haswell, Alder Lake
+        assert_eq!(Tune::classify("GenuineIntel", 6, 0x55), Tune::Skylake);
+        assert_eq!(Tune::classify("GenuineIntel", 6, 0x9e), Tune::Skylake);
+        assert_eq!(Tune::classify("GenuineIntel", 6, 0x8f), Tune::IceLake);
+        assert_eq!(Tune::classify("GenuineIntel", 6, 0x3c), Tune::Generic);
+        assert_eq!(Tune::classify("GenuineIntel", 6, 0x97), Tune::Generic);
+        assert_eq!(Tune::classify("CentaurHauls", 6, 0x0f), Tune::Generic);
+    }
+}
@@ -0,0 +1,203 @@
+//! Debounce coalesces the improvements of a stream.
+//!
+//! The first element of a group, e.g. the first deadline of a block, is yielded instantly.
+//! Later elements of the same group start a window, at its end only the best element seen
+//! during the window is yielded. Elements of an earlier group are dropped.
+//! The window length is shared and may change at any time, 0 yields everything instantly.
+
+use futures::stream::{Fuse, Stream};
+use futures::{Async, Future, Poll};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+use tokio::timer::{self, Delay};
+
+/// Window length in ms that follows the latency of the receiver and backs off when it
+/// reports being overloaded.
+pub struct Window {
+    ms: AtomicU64,
+    max_ms: u64,
+}
+
+impl Window {
+    pub fn new(max_ms: u64) -> Arc<Window> {
+        Arc::new(Window {
+            ms: AtomicU64::new(max_ms / 2),
+            max_ms,
+        })
+    }
+
+    pub fn ms(&self) -> u64 {
+        self.ms.load(Ordering::Relaxed)
+    }
+
+    /// Moves towards the latency of a request, an improvement found during one round trip
+    /// would have waited for it anyway.
+    pub fn observe_latency(&self, latency_ms: u64) {
+        let ms = (self.ms() * 7 + latency_ms) / 8;
+        self.ms.store(ms.min(self.max_ms), Ordering::Relaxed);
+    }
+
+    pub fn rate_limited(&self) {
+        let ms = (self.ms() * 2).max(100);
+        self.ms.store(ms.min(self.max_ms), Ordering::Relaxed);
+    }
+}
+
+pub struct Debounce<S, F>
+where
+    S: Stream,
+    S::Item: Ord,
+{
+    stream: Fuse<S>,
+    group: F,
+    window: Arc<Window>,
+    last_group: Option<u64>,
+    held: Option<S::Item>,
+    delay: Option<Delay>,
+}
+
+impl<S, F> Debounce<S, F>
+where
+    S: Stream,
+    S::Item: Ord,
+    F: Fn(&S::Item) -> u64,
+{
+    pub fn new(stream: S, group: F, window: Arc<Window>) -> Self {
+        Self {
+            stream: stream.fuse(),
+            group,
+            window,
+            last_group: None,
+            held: None,
+            delay: None,
+        }
+    }
+}
+
+/// Error returned by `Debounce`.
+#[derive(Debug)]
+pub struct Error<T>(Kind<T>);
+
+/// Debounce error variants
+#[derive(Debug)]
+enum Kind<T> {
+    /// Inner value returned an error
+    Inner(T),
+
+    /// Timer returned an error.
+    Timer(timer::Error),
+}
+
+impl<S, F> Stream for Debounce<S, F>
+where
+    S: Stream,
+    S::Item: Ord,
+    F: Fn(&S::Item) -> u64,
+{
+    type Item = S::Item;
+    type Error = Error<S::Error>;
+
+    fn poll(&mut self) -> Poll<Option<Self::Item>, Self::Error> {
+        loop {
+            match self.stream.poll() {
+                Ok(Async::NotReady) => {
+                    break;
+                }
+                Ok(Async::Ready(Some(item))) => {
+                    let group = (self.group)(&item);
+                    match self.last_group {
+                        Some(last) if group < last => {}
+                        Some(last) if group == last && self.window.ms() > 0 => {
+                            if self.held.as_ref().map_or(true, |held| *held < item) {
+                                self.held = Some(item);
+                            }
+                            if self.delay.is_none() {
+                                let window = Duration::from_millis(self.window.ms());
+                                self.delay = Some(Delay::new(Instant::now() + window));
+                            }
+                        }
+                        _ => {
+                            // first of a new group, what's held for the old one is stale
+                            if self.last_group != Some(group) {
+                                self.held = None;
+                                self.delay = None;
+                            }
+                            self.last_group = Some(group);
+                            return Ok(Async::Ready(Some(item)));
+                        }
+                    }
+                }
+                Ok(Async::Ready(None)) => {
+                    return Ok(Async::Ready(self.held.take()));
+                }
+                Err(e) => {
+                    return Err(Error(Kind::Inner(e)));
+                }
+            }
+        }
+
+        if let Some(ref mut delay) = self.delay {
+            match delay.poll() {
+                Ok(Async::NotReady) => {}
+                Ok(Async::Ready(())) => {
+                    self.delay = None;
+                    if let Some(item) = self.held.take() {
+                        return Ok(Async::Ready(Some(item)));
+                    }
+                }
+                Err(e) => {
+                    return Err(Error(Kind::Timer(e)));
+                }
+            }
+        }
+
+        Ok(Async::NotReady)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tokio;
+    use tokio::timer::Interval;
+
+    #[test]
+    fn test_debounce() {
+        // groups of hundreds, bigger is better
+        let mut items = vec![101, 105, 103, 110, 202, 150, 204, 209].into_iter();
+        let len = items.len();
+        let items = Interval::new(Instant::now(), Duration::from_millis(100))
+            .take(len as u64)
+            .map(move |_| items.next().unwrap())
+            .map_err(|e| error!("can't consume interval: {:?}", e));
+        let exp: Vec<i64> = vec![101, 110, 202, 209];
+        // 250ms
+        let window = Window::new(500);
+        let stream = Debounce::new(items, |x: &i64| (*x / 100) as u64, window);
+        let res = stream.collect();
+        tokio::run(res.then(move |res| {
+            match res {
+                Err(_) => assert!(false),
+                Ok(items) => assert_eq!(items, exp, "can't get expected items from debounce"),
+            };
+            Ok(())
+        }));
+    }
+
+    #[test]
+    fn test_window_adapts() {
+        let window = Window::new(2000);
+        assert_eq!(window.ms(), 1000);
+        for _ in 0..100 {
+            window.observe_latency(200);
+        }
+        assert!(window.ms() <= 210);
+        window.rate_limited();
+        assert!(window.ms() >= 400);
+        for _ in 0..10 {
+            window.rate_limited();
+        }
+        assert_eq!(window.ms(), 2000);
+    }
+}
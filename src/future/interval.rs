@@ -81,3 +81,39 @@ impl Stream for Interval {
         Ok(Some(now).into())
     }
 }
+
+/// An `Interval` whose delay after each value comes from `schedule`.
+pub struct ScheduledInterval<F> {
+    delay: Delay,
+    schedule: F,
+}
+
+impl<F> ScheduledInterval<F>
+where
+    F: FnMut() -> Duration,
+{
+    /// Produces the first value right away.
+    pub fn new(schedule: F) -> ScheduledInterval<F> {
+        ScheduledInterval {
+            delay: Delay::new(clock::now()),
+            schedule,
+        }
+    }
+}
+
+impl<F> Stream for ScheduledInterval<F>
+where
+    F: FnMut() -> Duration,
+{
+    type Item = Instant;
+    type Error = Error;
+
+    fn poll(&mut self) -> Poll<Option<Self::Item>, Self::Error> {
+        let _ = try_ready!(self.delay.poll());
+
+        let duration = (self.schedule)();
+        self.delay.reset(Instant::now() + duration);
+
+        Ok(Some(self.delay.deadline()).into())
+    }
+}
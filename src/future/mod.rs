@@ -1,2 +1,3 @@
+pub(crate) mod debounce;
 pub(crate) mod interval;
 pub(crate) mod prio_retry;
@@ -0,0 +1,248 @@
+//! Adaptive number of busy cpu workers.
+//!
+//! The cpu engines are bound by memory bandwidth, on many hosts a part of the cores hashes as
+//! many nonces as all of them. The governor measures the nonces per minute of finished cpu
+//! tasks in windows. It starts with all workers and climbs down as long as the rate stays
+//! within `tolerance` percent of the peak, halving its step when it overshoots. It keeps the
+//! smallest such count, idle workers are left to other workloads, and probes again when the
+//! rate moves by more than the tolerance or every REPROBE_WINDOWS windows.
+
+// windows between two probes while the rate is steady
+const REPROBE_WINDOWS: u32 = 30;
+
+pub struct Governor {
+    max_workers: u64,
+    // fraction of the peak rate
+    tolerance: f64,
+    window_ms: u64,
+    workers: u64,
+    window_start: u64,
+    window_nonces: u64,
+    // no cpu task in flight since, idle time doesn't count towards the window
+    paused_at: Option<u64>,
+    // the first window after a change still has tasks of the old count in flight
+    warmup: bool,
+    phase: Phase,
+}
+
+enum Phase {
+    // peak is measured with all workers, good is the smallest count within the tolerance so far
+    // and bad the largest one below it
+    Probing {
+        peak: Option<f64>,
+        good: u64,
+        good_rate: f64,
+        bad: u64,
+        step: u64,
+    },
+    Settled {
+        rate: f64,
+        windows: u32,
+    },
+}
+
+impl Governor {
+    /// A governor for up to `max_workers`, `None` if `tolerance` (in percent) is 0.
+    pub fn new(max_workers: u64, tolerance: u64, window_ms: u64) -> Option<Governor> {
+        if tolerance == 0 || max_workers == 0 {
+            return None;
+        }
+        Some(Governor {
+            max_workers,
+            tolerance: tolerance.min(100) as f64 / 100.0,
+            window_ms: window_ms.max(1),
+            workers: max_workers,
+            window_start: 0,
+            window_nonces: 0,
+            paused_at: None,
+            warmup: true,
+            phase: Governor::probe(max_workers),
+        })
+    }
+
+    fn probe(max_workers: u64) -> Phase {
+        Phase::Probing {
+            peak: None,
+            good: max_workers,
+            good_rate: 0.0,
+            bad: 0,
+            step: (max_workers / 4).max(1),
+        }
+    }
+
+    pub fn workers(&self) -> u64 {
+        self.workers
+    }
+
+    /// Starts over with a new maximum, e.g. after the pool was resized.
+    pub fn reset(&mut self, max_workers: u64, now_ms: u64) {
+        self.max_workers = max_workers.max(1);
+        self.set_workers(self.max_workers, now_ms);
+        self.phase = Governor::probe(self.max_workers);
+    }
+
+    fn set_workers(&mut self, workers: u64, now_ms: u64) {
+        self.workers = workers;
+        self.window_start = now_ms;
+        self.window_nonces = 0;
+        self.paused_at = None;
+        self.warmup = true;
+    }
+
+    /// Stops the window clock, e.g. while the miner idles between rounds.
+    pub fn pause(&mut self, now_ms: u64) {
+        if self.paused_at.is_none() {
+            self.paused_at = Some(now_ms);
+        }
+    }
+
+    /// Restarts the window clock, the paused time is left out of the rate.
+    pub fn resume(&mut self, now_ms: u64) {
+        if let Some(at) = self.paused_at.take() {
+            self.window_start += now_ms.saturating_sub(at);
+        }
+    }
+
+    /// Accounts the nonces of a finished cpu task, returns the new worker count if it changed.
+    pub fn record(&mut self, nonces: u64, now_ms: u64) -> Option<u64> {
+        self.resume(now_ms);
+        self.window_nonces += nonces;
+        if now_ms < self.window_start + self.window_ms {
+            return None;
+        }
+        let rate = self.window_nonces as f64 * 60_000.0 / (now_ms - self.window_start) as f64;
+        self.window_start = now_ms;
+        self.window_nonces = 0;
+        if self.warmup {
+            self.warmup = false;
+            return None;
+        }
+
+        let workers = match self.phase {
+            Phase::Probing {
+                peak,
+                good,
+                good_rate,
+                bad,
+                step,
+            } => match peak {
+                None => self.probe_below(rate, self.workers, rate, bad, step),
+                // fewer workers may even be faster, if they contend less
+                Some(peak) if rate >= peak * (1.0 - self.tolerance) => {
+                    self.probe_below(peak.max(rate), self.workers, rate, bad, step)
+                }
+                Some(peak) => {
+                    self.probe_below(peak, good, good_rate, self.workers, (step / 2).max(1))
+                }
+            },
+            Phase::Settled {
+                rate: settled,
+                windows,
+            } => {
+                if (rate - settled).abs() > settled * self.tolerance || windows >= REPROBE_WINDOWS {
+                    self.phase = Governor::probe(self.max_workers);
+                    self.max_workers
+                } else {
+                    self.phase = Phase::Settled {
+                        rate: settled,
+                        windows: windows + 1,
+                    };
+                    self.workers
+                }
+            }
+        };
+
+        if workers == self.workers {
+            return None;
+        }
+        self.set_workers(workers, now_ms);
+        Some(workers)
+    }
+
+    // the next count between `bad` and `good` to measure, settles on `good` once there's none
+    fn probe_below(&mut self, peak: f64, good: u64, good_rate: f64, bad: u64, step: u64) -> u64 {
+        if good > step && good - step > bad {
+            self.phase = Phase::Probing {
+                peak: Some(peak),
+                good,
+                good_rate,
+                bad,
+                step,
+            };
+            good - step
+        } else if step > 1 {
+            self.probe_below(peak, good, good_rate, bad, step / 2)
+        } else {
+            self.settle(good, good_rate)
+        }
+    }
+
+    fn settle(&mut self, workers: u64, rate: f64) -> u64 {
+        info!(
+            "{: <80}",
+            format!(
+                "cpu governor: {} of {} workers, {:.0} npm",
+                workers, self.max_workers, rate
+            )
+        );
+        self.phase = Phase::Settled { rate, windows: 0 };
+        workers
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // runs windows of a host whose bandwidth is saturated by `saturation` workers
+    fn run(governor: &mut Governor, saturation: u64, windows: u64, start: u64) -> u64 {
+        let mut now = start;
+        for _ in 0..windows {
+            now += 1000;
+            let nonces = governor.workers().min(saturation) * 100;
+            governor.record(nonces, now);
+        }
+        now
+    }
+
+    #[test]
+    fn test_settles_on_smallest_saturating_count() {
+        let mut governor = Governor::new(10, 5, 1000).unwrap();
+        let now = run(&mut governor, 6, 12, 0);
+        assert_eq!(governor.workers(), 6);
+
+        // stays while the rate is steady
+        let now = run(&mut governor, 6, 10, now);
+        assert_eq!(governor.workers(), 6);
+
+        // a co-located workload takes bandwidth, probe again and settle lower
+        run(&mut governor, 3, 14, now);
+        assert_eq!(governor.workers(), 3);
+    }
+
+    #[test]
+    fn test_linear_scaling_keeps_all_workers() {
+        let mut governor = Governor::new(8, 5, 1000).unwrap();
+        run(&mut governor, 8, 20, 0);
+        assert_eq!(governor.workers(), 8);
+        assert!(Governor::new(8, 0, 1000).is_none());
+    }
+
+    #[test]
+    fn test_idle_gap_is_not_counted() {
+        let mut governor = Governor::new(10, 5, 1000).unwrap();
+        let now = run(&mut governor, 6, 12, 0);
+        assert_eq!(governor.workers(), 6);
+
+        // half a window of work, then the round's goal is met and the miner idles for a minute
+        governor.record(300, now + 500);
+        governor.pause(now + 500);
+        governor.resume(now + 60_500);
+        assert_eq!(governor.record(300, now + 61_000), None);
+        assert_eq!(governor.workers(), 6);
+        match governor.phase {
+            Phase::Settled { windows, .. } => assert!(windows > 0),
+            Phase::Probing { .. } => panic!("idle gap triggered a probe"),
+        }
+    }
+}
@@ -1,9 +1,11 @@
 use crate::ocl::{gpu_hash, GpuContext};
 use crate::scheduler::{HasherMessage, RoundInfo};
 use crossbeam_channel::{Receiver, Sender};
+use std::panic::{self, AssertUnwindSafe};
 use std::sync::Arc;
 
 pub struct GpuTask {
+    pub account: usize,
     pub numeric_id: u64,
     pub local_startnonce: u64,
     pub local_nonces: u64,
@@ -22,14 +24,28 @@ pub fn create_gpu_hasher_thread(
             match task {
                 // new task
                 Some(task) => {
-                    // gpu generate nonces
-                    let (deadline, offset) = gpu_hash(&gpu_context, &task);
+                    // gpu generate nonces, on a device error the scheduler re-creates the
+                    // context and hands the task to another worker
+                    let (deadline, offset) = match panic::catch_unwind(AssertUnwindSafe(|| {
+                        gpu_hash(&gpu_context, &task)
+                    })) {
+                        Ok(x) => x,
+                        Err(_) => {
+                            let _ = tx.send(HasherMessage::GpuFailed(gpu_id));
+                            break;
+                        }
+                    };
 
                     // report hashing done
-                    tx.send(HasherMessage::NoncesProcessed(task.local_nonces))
-                        .expect("GPU task can't communicate with scheduler thread.");
+                    tx.send(HasherMessage::NoncesProcessed(
+                        task.account,
+                        task.local_nonces,
+                        task.round.block,
+                    ))
+                    .expect("GPU task can't communicate with scheduler thread.");
 
                     tx.send(HasherMessage::SubmitDeadline((
+                        task.account,
                         task.round.height,
                         task.local_startnonce + offset,
                         deadline,
@@ -0,0 +1,355 @@
+//! `bencher load-test`: emulates many miners against a pool without hashing.
+//!
+//! Every virtual miner polls `getMiningInfo` on its own, slightly jittered interval and on a
+//! new block samples the deadlines its capacity would find. A real miner doesn't find its best
+//! deadline at once but improves it while it scans its plots, so the scan is split into chunks
+//! and every improvement is submitted at the time the chunk would have been read. All miners
+//! share one http client, but have their own submission queue like a real miner.
+
+use crate::com::api::MiningInfoResponse as MiningInfo;
+use crate::com::client::{Client, ProxyDetails};
+use crate::config::Cfg;
+use crate::future::debounce::Window;
+use crate::future::interval::Interval;
+use crate::poc_hashing;
+use crate::request::{RequestHandler, SubmissionStats};
+use futures::future::{self, Future};
+use futures::stream::Stream;
+use rand::Rng;
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+use stopwatch::Stopwatch;
+use tokio::runtime::TaskExecutor;
+use tokio::timer::Delay;
+
+const NONCES_PER_TIB: f64 = 4_194_304.0;
+// the scan of a round is split into this many chunks, each may improve the best deadline
+const SCAN_CHUNKS: u64 = 16;
+// poll intervals of the miners vary by +-10%
+const POLL_JITTER: f64 = 0.1;
+const REPORT_INTERVAL_MS: u64 = 10_000;
+
+pub struct LoadTestConfig {
+    pub miners: usize,
+    // capacity range in TiB, every miner gets a random capacity out of it
+    pub capacity_min: f64,
+    pub capacity_max: f64,
+    pub scan_time: u64,
+    pub poll_interval: u64,
+    pub duration: u64,
+}
+
+#[derive(Default)]
+struct PollStats {
+    polls: AtomicU64,
+    errors: AtomicU64,
+    latency_ms: AtomicU64,
+    latency_max_ms: AtomicU64,
+    height: AtomicU64,
+}
+
+struct VirtualMiner {
+    account_id: u64,
+    nonces: u64,
+    target_deadline: u64,
+    request_handler: RequestHandler,
+    state: Mutex<MinerState>,
+}
+
+struct MinerState {
+    generation_signature: String,
+    block: u64,
+}
+
+/// Samples the best unadjusted deadline out of `nonces` nonces. The deadline of every nonce
+/// is uniformly distributed over the 64 bit range, the minimum of n of them is distributed as
+/// 2^64 * (1 - U^(1/n)).
+pub fn sample_best_deadline<R: Rng>(rng: &mut R, nonces: u64) -> u64 {
+    let u: f64 = rng.gen_range(std::f64::MIN_POSITIVE, 1.0);
+    // 1 - U^(1/n), expm1 keeps the precision for large n
+    let x = -(u.ln() / nonces.max(1) as f64).exp_m1();
+    (x * 18_446_744_073_709_551_616.0).min(std::u64::MAX as f64) as u64
+}
+
+/// Parses a capacity in TiB, either a single value or a range like "5-50".
+pub fn parse_capacity(s: &str) -> Result<(f64, f64), String> {
+    let parse = |x: &str| {
+        x.trim()
+            .parse::<f64>()
+            .map_err(|e| format!("invalid capacity {}: {}", x, e))
+    };
+    let (min, max) = match s.find('-') {
+        Some(i) => (parse(&s[..i])?, parse(&s[i + 1..])?),
+        None => {
+            let x = parse(s)?;
+            (x, x)
+        }
+    };
+    if min <= 0.0 || max < min {
+        return Err(format!("invalid capacity range {}", s));
+    }
+    Ok((min, max))
+}
+
+pub fn run(cfg: Cfg, load_cfg: LoadTestConfig, executor: TaskExecutor) {
+    let proxy_details = if cfg.send_proxy_details {
+        ProxyDetails::Enabled
+    } else {
+        ProxyDetails::Disabled
+    };
+    let additional_headers = Arc::new(cfg.additional_headers);
+    let client = Client::new(
+        cfg.url,
+        cfg.secret_phrase,
+        cfg.timeout,
+        proxy_details,
+        additional_headers.clone(),
+    );
+
+    info!(
+        "load-test: miners={}, capacity={}-{}TiB, scan_time={}ms, poll_interval={}ms",
+        load_cfg.miners,
+        load_cfg.capacity_min,
+        load_cfg.capacity_max,
+        load_cfg.scan_time,
+        load_cfg.poll_interval
+    );
+
+    let submission_stats = Arc::new(SubmissionStats::default());
+    let poll_stats = Arc::new(PollStats::default());
+    let xpu_string = Arc::new("load-test".to_owned());
+    let mut rng = rand::thread_rng();
+    let mut total_nonces = 0;
+
+    for i in 0..load_cfg.miners {
+        let capacity = if load_cfg.capacity_max > load_cfg.capacity_min {
+            rng.gen_range(load_cfg.capacity_min, load_cfg.capacity_max)
+        } else {
+            load_cfg.capacity_min
+        };
+        let miner = Arc::new(VirtualMiner {
+            account_id: cfg.numeric_id.wrapping_add(i as u64),
+            nonces: (capacity * NONCES_PER_TIB).max(1.0) as u64,
+            target_deadline: cfg.target_deadline,
+            request_handler: RequestHandler::with_client(
+                client.clone(),
+                submission_stats.clone(),
+                false,
+                // a virtual miner submits once per round
+                Window::new(0),
+                executor.clone(),
+            ),
+            state: Mutex::new(MinerState {
+                generation_signature: "".to_owned(),
+                block: 0,
+            }),
+        });
+        total_nonces += miner.nonces;
+
+        // spread the first polls over one interval so the miners don't poll in lockstep
+        let interval =
+            load_cfg.poll_interval as f64 * rng.gen_range(1.0 - POLL_JITTER, 1.0 + POLL_JITTER);
+        let start =
+            Instant::now() + Duration::from_millis(rng.gen_range(0, load_cfg.poll_interval.max(1)));
+        spawn_miner(
+            miner,
+            Interval::new(start, Duration::from_millis(interval.max(1.0) as u64)),
+            load_cfg.scan_time,
+            additional_headers.clone(),
+            xpu_string.clone(),
+            poll_stats.clone(),
+            executor.clone(),
+        );
+    }
+
+    info!(
+        "load-test: {} miners started, total capacity={:.2}PiB",
+        load_cfg.miners,
+        total_nonces as f64 / NONCES_PER_TIB / 1024.0
+    );
+
+    report(&load_cfg, &poll_stats, &submission_stats);
+}
+
+fn spawn_miner(
+    miner: Arc<VirtualMiner>,
+    interval: Interval,
+    scan_time: u64,
+    additional_headers: Arc<HashMap<String, String>>,
+    xpu_string: Arc<String>,
+    poll_stats: Arc<PollStats>,
+    executor: TaskExecutor,
+) {
+    let inner_executor = executor.clone();
+    // X-Capacity is reported in GiB
+    let capacity = miner.nonces / 4096;
+    executor.spawn(
+        interval
+            .for_each(move |_| {
+                let miner = miner.clone();
+                let poll_stats = poll_stats.clone();
+                let executor = inner_executor.clone();
+                let sw = Stopwatch::start_new();
+                miner
+                    .request_handler
+                    .get_mining_info(capacity, additional_headers.clone(), xpu_string.clone())
+                    .then(move |mining_info| {
+                        let latency = sw.elapsed_ms() as u64;
+                        poll_stats.polls.fetch_add(1, Ordering::Relaxed);
+                        poll_stats.latency_ms.fetch_add(latency, Ordering::Relaxed);
+                        store_max(&poll_stats.latency_max_ms, latency);
+                        match mining_info {
+                            Ok(mining_info) => {
+                                store_max(&poll_stats.height, mining_info.height);
+                                let mut state = miner.state.lock().unwrap();
+                                if mining_info.generation_signature != state.generation_signature {
+                                    state.generation_signature =
+                                        mining_info.generation_signature.clone();
+                                    state.block += 1;
+                                    let block = state.block;
+                                    drop(state);
+                                    schedule_submissions(
+                                        &miner,
+                                        &mining_info,
+                                        block,
+                                        scan_time,
+                                        &executor,
+                                    );
+                                }
+                            }
+                            Err(_) => {
+                                poll_stats.errors.fetch_add(1, Ordering::Relaxed);
+                            }
+                        }
+                        future::ok(())
+                    })
+            })
+            .map_err(|e| panic!("interval errored: err={:?}", e)),
+    );
+}
+
+// Samples the deadlines one scan of the miner finds and submits every improvement at the time
+// the miner would have found it.
+fn schedule_submissions(
+    miner: &Arc<VirtualMiner>,
+    mining_info: &MiningInfo,
+    block: u64,
+    scan_time: u64,
+    executor: &TaskExecutor,
+) {
+    let mut rng = rand::thread_rng();
+    let gen_sig = poc_hashing::decode_gensig(&mining_info.generation_signature);
+    let target_deadline = miner.target_deadline.min(mining_info.target_deadline);
+    let base_target = mining_info.base_target.max(1);
+    let height = mining_info.height;
+    let chunk_nonces = (miner.nonces / SCAN_CHUNKS).max(1);
+    let start = Instant::now();
+    let mut best = std::u64::MAX;
+    for chunk in 0..SCAN_CHUNKS {
+        let deadline_unadjusted = sample_best_deadline(&mut rng, chunk_nonces);
+        if deadline_unadjusted >= best {
+            continue;
+        }
+        best = deadline_unadjusted;
+        let deadline = deadline_unadjusted / base_target;
+        if deadline >= target_deadline {
+            continue;
+        }
+        let nonce = rng.gen::<u64>();
+        let miner = miner.clone();
+        let at = start + Duration::from_millis(scan_time * (chunk + 1) / SCAN_CHUNKS);
+        executor.spawn(Delay::new(at).then(move |_| {
+            // the miner moved on to the next block in the meantime
+            if miner.state.lock().unwrap().block == block {
+                miner.request_handler.submit_nonce(
+                    miner.account_id,
+                    nonce,
+                    height,
+                    block,
+                    deadline_unadjusted,
+                    deadline,
+                    gen_sig,
+                );
+            }
+            Ok(())
+        }));
+    }
+}
+
+fn store_max(atomic: &AtomicU64, value: u64) {
+    let mut current = atomic.load(Ordering::Relaxed);
+    while current < value {
+        match atomic.compare_exchange_weak(current, value, Ordering::Relaxed, Ordering::Relaxed) {
+            Ok(_) => return,
+            Err(x) => current = x,
+        }
+    }
+}
+
+fn report(load_cfg: &LoadTestConfig, poll_stats: &PollStats, submission_stats: &SubmissionStats) {
+    let sw = Stopwatch::start_new();
+    loop {
+        thread::sleep(Duration::from_millis(REPORT_INTERVAL_MS));
+        let secs = REPORT_INTERVAL_MS as f64 / 1000.0;
+        let polls = poll_stats.polls.swap(0, Ordering::Relaxed);
+        let poll_latency = poll_stats.latency_ms.swap(0, Ordering::Relaxed);
+        let accepted = submission_stats.accepted.swap(0, Ordering::Relaxed);
+        let rejected = submission_stats.rejected.swap(0, Ordering::Relaxed);
+        let submissions = accepted + rejected;
+        let submit_latency = submission_stats.latency_ms.swap(0, Ordering::Relaxed);
+        info!(
+            "load-test: height={}, polls={:.0}/s, poll_errors={}, poll_latency={}ms (max {}ms), \
+             submits={:.1}/s, accepted={}, rejected={}, mismatched={}, retried={}, \
+             superseded={}, submit_latency={}ms",
+            poll_stats.height.load(Ordering::Relaxed),
+            polls as f64 / secs,
+            poll_stats.errors.swap(0, Ordering::Relaxed),
+            poll_latency / polls.max(1),
+            poll_stats.latency_max_ms.swap(0, Ordering::Relaxed),
+            submissions as f64 / secs,
+            accepted,
+            rejected,
+            submission_stats.mismatched.swap(0, Ordering::Relaxed),
+            submission_stats.retried.swap(0, Ordering::Relaxed),
+            submission_stats.superseded.swap(0, Ordering::Relaxed),
+            submit_latency / submissions.max(1),
+        );
+        if load_cfg.duration > 0 && sw.elapsed_ms() as u64 >= load_cfg.duration * 1000 {
+            info!("load-test: finished after {}s", load_cfg.duration);
+            return;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_sample_best_deadline() {
+        let mut rng = rand::thread_rng();
+        // the expected minimum of n uniform values is 2^64 / (n + 1)
+        let nonces = 4096;
+        let samples = 20_000;
+        let mean = (0..samples)
+            .map(|_| sample_best_deadline(&mut rng, nonces) as f64)
+            .sum::<f64>()
+            / samples as f64;
+        let expected = 18_446_744_073_709_551_616.0 / (nonces + 1) as f64;
+        assert!((mean / expected - 1.0).abs() < 0.05);
+
+        // more capacity finds better deadlines
+        assert!(sample_best_deadline(&mut rng, 1 << 40) < 1 << 30);
+    }
+
+    #[test]
+    fn test_parse_capacity() {
+        assert_eq!(parse_capacity("10"), Ok((10.0, 10.0)));
+        assert_eq!(parse_capacity("0.5-20"), Ok((0.5, 20.0)));
+        assert!(parse_capacity("20-5").is_err());
+        assert!(parse_capacity("x").is_err());
+    }
+}
@@ -9,25 +9,43 @@ extern crate log;
 mod com;
 mod future;
 mod buffer;
+mod cgroup;
 mod config;
+mod control;
 mod cpu_hasher;
+mod governor;
 #[cfg(feature = "opencl")]
 mod gpu_hasher;
+mod load_test;
 mod logger;
 mod miner;
+mod nonce_cache;
 #[cfg(feature = "opencl")]
 mod ocl;
+mod perf;
+mod plot_check;
+#[cfg(feature = "opencl")]
+mod plotter;
 mod poc_hashing;
+mod poll_schedule;
+mod proxy;
 mod request;
 mod scheduler;
 mod shabal256;
+mod shm_cache;
+mod simulation;
+mod supervisor;
+mod trace;
 
+use crate::cgroup::{fit_task_size, memory_budget, CgroupLimits};
 use crate::config::load_cfg;
-use crate::cpu_hasher::{init_cpu_extensions, SimdExtension};
+use crate::cpu_hasher::{init_cpu_extensions, SimdExtension, CPU_TASK_ALIGNMENT};
 use crate::miner::Miner;
-use clap::{App, Arg};
+use crate::poc_hashing::NONCE_SIZE;
+use clap::{App, Arg, SubCommand};
 use futures::Future;
 use std::cmp::min;
+use std::path::PathBuf;
 use std::process;
 use tokio::runtime::Builder;
 
@@ -47,6 +65,139 @@ fn main() {
                 .help("Location of the config file")
                 .takes_value(true)
                 .default_value("config.yaml"),
+        )
+        .subcommand(
+            SubCommand::with_name("check-plot")
+                .about("Verifies PoC2 plot files against regenerated nonces")
+                .arg(
+                    Arg::with_name("files")
+                        .value_name("FILE")
+                        .help("Plot files to check")
+                        .required(true)
+                        .multiple(true),
+                )
+                .arg(
+                    Arg::with_name("nonces")
+                        .short("n")
+                        .long("nonces")
+                        .value_name("NONCES")
+                        .help("Number of randomly sampled nonces to check per file")
+                        .takes_value(true)
+                        .default_value("1024"),
+                )
+                .arg(
+                    Arg::with_name("all")
+                        .short("a")
+                        .long("all")
+                        .help("Check every nonce"),
+                )
+                .arg(
+                    Arg::with_name("threads")
+                        .short("t")
+                        .long("threads")
+                        .value_name("THREADS")
+                        .help("Number of verifier threads, defaults to all available cores")
+                        .takes_value(true),
+                ),
+        )
+        .subcommand(
+            SubCommand::with_name("load-test")
+                .about("Emulates many miners against the configured pool without hashing")
+                .arg(
+                    Arg::with_name("miners")
+                        .short("m")
+                        .long("miners")
+                        .value_name("MINERS")
+                        .help("Number of virtual miners, account ids count up from numeric_id")
+                        .takes_value(true)
+                        .default_value("1000"),
+                )
+                .arg(
+                    Arg::with_name("capacity")
+                        .short("s")
+                        .long("capacity")
+                        .value_name("TIB")
+                        .help("Capacity per miner in TiB, a range like 5-50 picks one per miner")
+                        .takes_value(true)
+                        .default_value("10"),
+                )
+                .arg(
+                    Arg::with_name("scan-time")
+                        .long("scan-time")
+                        .value_name("SECONDS")
+                        .help("Time a miner needs to scan its plots")
+                        .takes_value(true)
+                        .default_value("30"),
+                )
+                .arg(
+                    Arg::with_name("interval")
+                        .short("i")
+                        .long("interval")
+                        .value_name("MS")
+                        .help("getMiningInfo interval, defaults to get_mining_info_interval")
+                        .takes_value(true),
+                )
+                .arg(
+                    Arg::with_name("duration")
+                        .short("d")
+                        .long("duration")
+                        .value_name("SECONDS")
+                        .help("Stop after this many seconds, runs forever by default")
+                        .takes_value(true),
+                ),
+        )
+        .subcommand(
+            SubCommand::with_name("proxy")
+                .about("Serves the miners of a LAN with one connection to the configured pool")
+                .arg(
+                    Arg::with_name("listen")
+                        .short("l")
+                        .long("listen")
+                        .value_name("ADDRESS")
+                        .help("Address the miners connect to, use http://ADDRESS as their url")
+                        .takes_value(true)
+                        .default_value("0.0.0.0:8124"),
+                ),
+        )
+        .subcommand(
+            SubCommand::with_name("simulate")
+                .about("Replays a round timeline recorded with round_log through the scheduler")
+                .arg(
+                    Arg::with_name("timeline")
+                        .value_name("FILE")
+                        .help("Timeline recorded with round_log")
+                        .required(true),
+                )
+                .arg(
+                    Arg::with_name("speedup")
+                        .long("speedup")
+                        .value_name("FACTOR")
+                        .help("Replays block intervals this many times faster")
+                        .takes_value(true)
+                        .default_value("1"),
+                )
+                .arg(
+                    Arg::with_name("real")
+                        .long("real")
+                        .help("Hash with the real cpu engine instead of simulated devices"),
+                )
+                .arg(
+                    Arg::with_name("cpu-rate")
+                        .long("cpu-rate")
+                        .value_name("NONCES_PER_MIN")
+                        .help("Hash rate of every simulated cpu worker")
+                        .takes_value(true)
+                        .default_value("2000"),
+                )
+                .arg(
+                    Arg::with_name("gpu")
+                        .long("gpu")
+                        .value_name("NONCES_PER_MIN:WORKSIZE")
+                        .help("Adds a simulated gpu")
+                        .takes_value(true)
+                        .multiple(true)
+                        .number_of_values(1),
+                ),
         );
     #[cfg(feature = "opencl")]
     let arg = arg.arg(
@@ -57,17 +208,69 @@ fn main() {
             .takes_value(false),
     );
 
+    #[cfg(feature = "opencl")]
+    let arg = arg.subcommand(
+        SubCommand::with_name("plot")
+            .about("Writes a PoC2 plot file with a configured gpu")
+            .arg(
+                Arg::with_name("id")
+                    .long("id")
+                    .value_name("NUMERIC_ID")
+                    .help("Numeric id of the account")
+                    .takes_value(true)
+                    .required(true),
+            )
+            .arg(
+                Arg::with_name("start")
+                    .short("s")
+                    .long("start")
+                    .value_name("NONCE")
+                    .help("First nonce of the file")
+                    .takes_value(true)
+                    .required(true),
+            )
+            .arg(
+                Arg::with_name("nonces")
+                    .short("n")
+                    .long("nonces")
+                    .value_name("NONCES")
+                    .help("Number of nonces, rounded down to a multiple of 64")
+                    .takes_value(true)
+                    .required(true),
+            )
+            .arg(
+                Arg::with_name("path")
+                    .short("p")
+                    .long("path")
+                    .value_name("DIR")
+                    .help("Directory of the plot file")
+                    .takes_value(true)
+                    .default_value("."),
+            )
+            .arg(
+                Arg::with_name("gpu")
+                    .short("g")
+                    .long("gpu")
+                    .value_name("INDEX")
+                    .help("Index of the gpu in the gpus of the config")
+                    .takes_value(true)
+                    .default_value("0"),
+            ),
+    );
+
     let matches = &arg.get_matches();
     let config = matches.value_of("config").unwrap();
 
-    let cfg_loaded = load_cfg(config);
+    let mut cfg_loaded = load_cfg(config);
     logger::init_logger(&cfg_loaded);
+    trace::init(&cfg_loaded.trace_file);
+    perf::init(cfg_loaded.perf_counters);
 
     info!("bencher v.{}", crate_version!());
 
     if matches.is_present("opencl") {
         #[cfg(feature = "opencl")]
-        ocl::platform_info();
+        ocl::platform_info(&cfg_loaded.gpus);
         process::exit(0);
     }
 
@@ -76,11 +279,139 @@ fn main() {
     let cpu_name = cpuid.get_extended_function_info().unwrap();
     let cpu_name = cpu_name.processor_brand_string().unwrap().trim();
 
+    let cgroup_limits = CgroupLimits::detect();
+    let host_cpus = num_cpus::get();
+    let available_cpus = cgroup_limits.cpus(host_cpus);
+    let max_cpu_threads = if cgroup_limits.is_constrained() {
+        available_cpus
+    } else {
+        2 * host_cpus // 2x just in case num_cpus doesnt cope with multi cpu
+    };
+
+    if let Some(matches) = matches.subcommand_matches("check-plot") {
+        let files: Vec<PathBuf> = matches
+            .values_of("files")
+            .unwrap()
+            .map(PathBuf::from)
+            .collect();
+        let sample = if matches.is_present("all") {
+            0
+        } else {
+            value_t!(matches, "nonces", u64).unwrap_or_else(|e| e.exit())
+        };
+        let threads = value_t!(matches, "threads", usize).unwrap_or(available_cpus);
+        // the batches share the miner's memory budget, 2GiB if it's unlimited
+        let memory = match memory_budget(cfg_loaded.max_memory, cgroup_limits.memory_limit) {
+            0 => 2 << 30,
+            x => x,
+        };
+        let ok = plot_check::check_plots(&files, sample, threads.max(1), simd_extension, memory);
+        process::exit(if ok { 0 } else { 2 });
+    }
+
+    #[cfg(feature = "opencl")]
+    {
+        if let Some(matches) = matches.subcommand_matches("plot") {
+            let index = value_t!(matches, "gpu", usize).unwrap_or_else(|e| e.exit());
+            let gpu = match cfg_loaded.gpus.get(index) {
+                Some(x) => x.clone(),
+                None => {
+                    error!("plot: no gpu {} in the config", index);
+                    process::exit(1)
+                }
+            };
+            let gpu_contexts = ocl::gpu_init(&[gpu]);
+            let ok = plotter::plot(
+                &gpu_contexts[0],
+                value_t!(matches, "id", u64).unwrap_or_else(|e| e.exit()),
+                value_t!(matches, "start", u64).unwrap_or_else(|e| e.exit()),
+                value_t!(matches, "nonces", u64).unwrap_or_else(|e| e.exit()),
+                &PathBuf::from(matches.value_of("path").unwrap()),
+            );
+            process::exit(if ok { 0 } else { 1 });
+        }
+    }
+
+    if let Some(matches) = matches.subcommand_matches("simulate") {
+        let rounds = simulation::load_timeline(matches.value_of("timeline").unwrap())
+            .unwrap_or_else(|e| {
+                error!("can't load timeline: {}", e);
+                process::exit(1)
+            });
+        let speedup = value_t!(matches, "speedup", f64).unwrap_or_else(|e| e.exit());
+        let sim_devices = if matches.is_present("real") {
+            None
+        } else {
+            let mut gpus = Vec::new();
+            for gpu in matches.values_of("gpu").into_iter().flatten() {
+                let mut parts = gpu.splitn(2, ':').map(|x| x.parse::<u64>());
+                match (parts.next(), parts.next()) {
+                    (Some(Ok(rate)), Some(Ok(worksize))) if worksize > 0 => {
+                        gpus.push(simulation::SimGpu {
+                            rate: rate as f64 / 60.0,
+                            worksize,
+                        })
+                    }
+                    _ => {
+                        error!("invalid gpu {}, expected NONCES_PER_MIN:WORKSIZE", gpu);
+                        process::exit(1)
+                    }
+                }
+            }
+            Some(simulation::SimDevices {
+                cpu_rate: value_t!(matches, "cpu-rate", f64).unwrap_or_else(|e| e.exit()) / 60.0,
+                gpus,
+                speedup,
+            })
+        };
+        let cpu_threads = if cfg_loaded.cpu_threads == 0 {
+            available_cpus
+        } else {
+            min(cfg_loaded.cpu_threads, max_cpu_threads)
+        };
+        simulation::run(
+            &cfg_loaded,
+            rounds,
+            cpu_threads,
+            simd_extension,
+            sim_devices,
+            speedup,
+        );
+        process::exit(0);
+    }
+
+    if let Some(matches) = matches.subcommand_matches("proxy") {
+        let rt = Builder::new().core_threads(1).build().unwrap();
+        proxy::run(cfg_loaded, matches.value_of("listen").unwrap(), rt.executor());
+        process::exit(1);
+    }
+
+    if let Some(matches) = matches.subcommand_matches("load-test") {
+        let (capacity_min, capacity_max) =
+            load_test::parse_capacity(matches.value_of("capacity").unwrap()).unwrap_or_else(|e| {
+                error!("{}", e);
+                process::exit(1)
+            });
+        let load_cfg = load_test::LoadTestConfig {
+            miners: value_t!(matches, "miners", usize).unwrap_or_else(|e| e.exit()),
+            capacity_min,
+            capacity_max,
+            scan_time: value_t!(matches, "scan-time", u64).unwrap_or_else(|e| e.exit()) * 1000,
+            poll_interval: value_t!(matches, "interval", u64)
+                .unwrap_or(cfg_loaded.get_mining_info_interval),
+            duration: value_t!(matches, "duration", u64).unwrap_or(0),
+        };
+        // thousands of miners need more than the single core thread of the miner
+        let rt = Builder::new().core_threads(available_cpus).build().unwrap();
+        load_test::run(cfg_loaded, load_cfg, rt.executor());
+        process::exit(0);
+    }
+
     #[cfg(not(feature = "opencl"))]
     let cpu_threads = if cfg_loaded.cpu_threads == 0 {
-        num_cpus::get()
+        available_cpus
     } else {
-        min(cfg_loaded.cpu_threads, 2 * num_cpus::get()) // 2x just in case num_cpus doesnt cope with multi cpu
+        min(cfg_loaded.cpu_threads, max_cpu_threads)
     };
 
     // special case: dont use cpu if only a gpu is defined
@@ -88,14 +419,39 @@ fn main() {
     let cpu_threads = if matches.occurrences_of("gpu") > 0 && matches.occurrences_of("cpu") == 0 {
         0
     } else {
-        min(cfg_loaded.cpu_threads, 2 * num_cpus::get()) // 2x just in case num_cpus doesnt cope with multi cpu
+        min(cfg_loaded.cpu_threads, max_cpu_threads)
+    };
+
+    let memory_budget_bytes = memory_budget(cfg_loaded.max_memory, cgroup_limits.memory_limit);
+    if cfg_loaded.max_memory > 0 && memory_budget_bytes < cfg_loaded.max_memory * 1024 * 1024 {
+        warn!(
+            "max_memory of {}MiB exceeds the cgroup memory limit, using {}MiB",
+            cfg_loaded.max_memory,
+            memory_budget_bytes / 1024 / 1024
+        );
+    }
+
+    cfg_loaded.cpu_worker_task_size = match fit_task_size(
+        cfg_loaded.cpu_worker_task_size,
+        cpu_threads,
+        memory_budget_bytes,
+    ) {
+        Some(task_size) => task_size,
+        None => {
+            error!(
+                "memory budget of {}MiB too small, cpu hashing needs at least {}MiB",
+                memory_budget_bytes / 1024 / 1024,
+                CPU_TASK_ALIGNMENT * NONCE_SIZE as u64 / 1024 / 1024
+            );
+            process::exit(1)
+        }
     };
 
     info!(
         "cpu: {} [using {} of {} cores{}{:?}]",
         cpu_name,
         cpu_threads,
-        num_cpus::get(),
+        available_cpus,
         if let SimdExtension::None = &simd_extension {
             ""
         } else {
@@ -104,11 +460,38 @@ fn main() {
         &simd_extension
     );
 
+    if cgroup_limits.is_constrained() || cgroup_limits.memory_limit.is_some() {
+        info!(
+            "cgroup: host_cpus={}, cpu_quota={}, cpuset={}, memory_limit={}",
+            host_cpus,
+            cgroup_limits
+                .cpu_quota
+                .map_or("none".to_owned(), |x| format!("{:.2}", x)),
+            cgroup_limits
+                .cpuset
+                .map_or("none".to_owned(), |x| x.to_string()),
+            cgroup_limits
+                .memory_limit
+                .map_or("none".to_owned(), |x| format!("{}MiB", x / 1024 / 1024)),
+        );
+    }
+    info!(
+        "cpu sizing: threads={}, task_size={}, buffer_memory={}MiB, max_memory={}",
+        cpu_threads,
+        cfg_loaded.cpu_worker_task_size,
+        cpu_threads as u64 * cfg_loaded.cpu_worker_task_size * NONCE_SIZE as u64 / 1024 / 1024,
+        if memory_budget_bytes == 0 {
+            "unlimited".to_owned()
+        } else {
+            format!("{}MiB", memory_budget_bytes / 1024 / 1024)
+        }
+    );
+
     let mut cpu_string = format!(
         "cpu: {} [using {} of {} cores{}{:?}]",
         cpu_name,
         cpu_threads,
-        num_cpus::get(),
+        available_cpus,
         if let SimdExtension::None = &simd_extension {
             ""
         } else {
@@ -134,8 +517,12 @@ fn main() {
     #[cfg(feature = "opencl")]
     info!("gpu extensions: OpenCL");
 
-    info!("numeric_id: {}", cfg_loaded.numeric_id);
-    info!("start_nonce: {}", cfg_loaded.start_nonce);
+    for account in cfg_loaded.accounts() {
+        info!(
+            "numeric_id: {}, start_nonce: {}, weight: {}",
+            account.numeric_id, account.start_nonce, account.weight
+        );
+    }
     info!("target_deadline: {}", cfg_loaded.target_deadline);
     info!(
         "mode: {}",
@@ -147,7 +534,15 @@ fn main() {
     );
 
     let rt = Builder::new().core_threads(1).build().unwrap();
-    let m = Miner::new(cfg_loaded, simd_extension, cpu_threads, rt.executor(), cpu_string);
+    let m = Miner::new(
+        cfg_loaded,
+        simd_extension,
+        cpu_threads,
+        max_cpu_threads,
+        memory_budget_bytes,
+        rt.executor(),
+        cpu_string,
+    );
     m.run();
     rt.shutdown_on_idle().wait().unwrap();
 }
@@ -1,18 +1,24 @@
 use crate::com::api::MiningInfoResponse as MiningInfo;
-use crate::config::Cfg;
+use crate::config::{Account, Cfg};
+use crate::control;
 use crate::cpu_hasher::SimdExtension;
-use crate::future::interval::Interval;
+use crate::future::interval::ScheduledInterval;
+use crate::governor::Governor;
 #[cfg(feature = "opencl")]
 use crate::ocl::GpuConfig;
 use crate::poc_hashing;
+use crate::poll_schedule::PollSchedule;
 use crate::request::RequestHandler;
 use crate::scheduler::create_scheduler_thread;
-use crate::scheduler::RoundInfo;
+use crate::scheduler::{RoundInfo, SchedulerStats};
+use crate::simulation;
+use crate::trace;
 use crossbeam_channel::unbounded;
 use futures::sync::mpsc;
+use std::sync::atomic::Ordering;
 use std::sync::{Arc, Mutex};
 use std::thread;
-use std::time::Duration;
+use std::time::Instant;
 use std::u64;
 use tokio::prelude::*;
 use tokio::runtime::TaskExecutor;
@@ -24,17 +30,30 @@ const GENESIS_BASE_TARGET: u64 = 4_398_046_511_104;
 pub struct Miner {
     executor: TaskExecutor,
     request_handler: RequestHandler,
+    // one submission queue per account, keyed by numeric id
+    submission_queues: HashMap<u64, RequestHandler>,
     cpu_threads: usize,
+    // the limit of the cpu_threads control command
+    max_cpu_threads: usize,
     cpu_worker_task_size: u64,
+    // bytes, max_memory or the cgroup default
+    memory_budget: u64,
+    nonce_cache_size: u64,
+    nonce_cache_shm: String,
+    cache_build_deadline: u64,
+    nonce_cache_gpu: bool,
+    cpu_governor: Option<Governor>,
     simd_extensions: SimdExtension,
-    numeric_id: u64,
-    start_nonce: u64,
+    accounts: Vec<Account>,
     target_deadline: u64,
     blocktime: u64,
     gpus: Vec<GpuConfig>,
     get_mining_info_interval: u64,
+    block_time_shape: u32,
     additional_headers: Arc<HashMap<String, String>>,
     xpu_string: String,
+    round_log: String,
+    control_socket: String,
 }
 
 pub struct State {
@@ -46,9 +65,12 @@ pub struct State {
     server_target_deadline: u64,
     first: bool,
     outage: bool,
-    best_deadline: u64,
+    // per account
+    best_deadline: HashMap<u64, u64>,
     scoop: u32,
-    capacity: u64,
+    capacity: HashMap<u64, u64>,
+    // when the current block was seen
+    block_seen: Instant,
 }
 
 impl State {
@@ -62,16 +84,18 @@ impl State {
             server_target_deadline: u64::MAX,
             first: true,
             outage: false,
-            best_deadline: u64::MAX,
+            best_deadline: HashMap::new(),
             scoop: 0,
-            capacity: 0,
+            capacity: HashMap::new(),
+            block_seen: Instant::now(),
         }
     }
 
     fn update_mining_info(&mut self, mining_info: &MiningInfo) {
-        self.best_deadline= u64::MAX;
+        self.best_deadline.clear();
         self.height = mining_info.height;
         self.block += 1;
+        self.block_seen = Instant::now();
         self.base_target = mining_info.base_target;
         self.server_target_deadline = mining_info.target_deadline;
 
@@ -111,10 +135,13 @@ impl Miner {
         cfg: Cfg,
         simd_extensions: SimdExtension,
         cpu_threads: usize,
+        max_cpu_threads: usize,
+        memory_budget: u64,
         executor: TaskExecutor,
         xpu_string: String,
     ) -> Miner {
         info!("server: {}", cfg.url);
+        let accounts = cfg.accounts();
         let additional_headers = Arc::new(cfg.additional_headers);
         let request_handler = RequestHandler::new(
             cfg.url,
@@ -122,23 +149,50 @@ impl Miner {
             cfg.timeout,
             cfg.send_proxy_details,
             additional_headers.clone(),
+            cfg.submission_debounce,
+            cfg.get_mining_info_hedge,
             executor.clone(),
         );
 
+        let mut submission_queues = HashMap::new();
+        for (i, account) in accounts.iter().enumerate() {
+            let queue = if i == 0 {
+                request_handler.clone()
+            } else {
+                request_handler.new_submission_queue(executor.clone())
+            };
+            submission_queues.insert(account.numeric_id, queue);
+        }
+
         Miner {
             executor,
             request_handler,
+            submission_queues,
             cpu_threads,
+            max_cpu_threads,
             cpu_worker_task_size: cfg.cpu_worker_task_size,
+            memory_budget,
+            // configured in MiB
+            nonce_cache_size: cfg.nonce_cache_size * 1024 * 1024,
+            nonce_cache_shm: cfg.nonce_cache_shm,
+            cache_build_deadline: cfg.cache_build_deadline,
+            nonce_cache_gpu: cfg.nonce_cache_gpu,
+            cpu_governor: Governor::new(
+                cpu_threads as u64,
+                cfg.cpu_governor,
+                cfg.cpu_governor_window,
+            ),
             simd_extensions,
-            numeric_id: cfg.numeric_id,
-            start_nonce: cfg.start_nonce,
+            accounts,
             target_deadline: cfg.target_deadline,
             blocktime: cfg.blocktime,
             gpus: cfg.gpus,
             get_mining_info_interval: max(1000, cfg.get_mining_info_interval),
+            block_time_shape: cfg.block_time_shape,
             additional_headers: additional_headers.clone(),
             xpu_string,
+            round_log: cfg.round_log,
+            control_socket: cfg.control_socket,
         }
     }
 
@@ -146,18 +200,30 @@ impl Miner {
         // create channels
         let (tx_rounds, rx_rounds) = unbounded();
         let (tx_nonce_data, rx_nonce_data) = mpsc::unbounded();
+        let (tx_hasher, rx_hasher) = unbounded();
+
+        control::start(&self.control_socket, tx_hasher.clone());
 
         // create hasher thread
         thread::spawn(create_scheduler_thread(
-            self.numeric_id,
-            self.start_nonce,
+            self.accounts,
             self.cpu_threads as u8,
+            self.max_cpu_threads,
             self.cpu_worker_task_size,
+            self.memory_budget,
+            self.nonce_cache_size,
+            self.nonce_cache_shm,
+            self.cache_build_deadline,
+            self.nonce_cache_gpu,
+            self.cpu_governor,
             self.simd_extensions.clone(),
             self.gpus,
             self.blocktime,
             rx_rounds.clone(),
             tx_nonce_data.clone(),
+            (tx_hasher, rx_hasher),
+            None,
+            Arc::new(SchedulerStats::default()),
         ));
 
         let state = Arc::new(Mutex::new(State::new()));
@@ -165,20 +231,36 @@ impl Miner {
         let request_handler = self.request_handler.clone();
         let inner_state = state.clone();
         let inner_tx_rounds = tx_rounds.clone();
-        let get_mining_info_interval = self.get_mining_info_interval;
+        // sparse right after a block, faster when the next one gets likely
+        let poll_schedule = PollSchedule::new(
+            self.get_mining_info_interval,
+            self.blocktime,
+            self.block_time_shape,
+        );
+        let schedule_state = state.clone();
         let additional_headers = self.additional_headers.clone();
         let xpu_string = Arc::new(self.xpu_string);
+        let round_log = Arc::new(self.round_log);
+        let target_deadline = self.target_deadline;
         // run main mining loop on core
         self.executor.clone().spawn(
-            Interval::new_interval(Duration::from_millis(get_mining_info_interval))
+            ScheduledInterval::new(move || {
+                let since_block = schedule_state.lock().unwrap().block_seen.elapsed();
+                poll_schedule.next_interval(since_block)
+            })
                 .for_each(move |_| {
                     let state = inner_state.clone();
                     let state2 = inner_state.clone();
                     let state2 = state2.lock().unwrap();
-                    let capacity = state2.capacity;
+                    // the pool sees the capacity of all accounts of this host
+                    let capacity = state2.capacity.values().sum::<u64>();
                     drop(state2);
                     let tx_rounds = inner_tx_rounds.clone();
+                    let round_log = round_log.clone();
+                    let hedge_handler = request_handler.clone();
+                    let fetch_start = trace::now();
                     request_handler.get_mining_info(capacity, additional_headers.clone(), xpu_string.clone()).then(move |mining_info| {
+                        trace::record("get_mining_info", "miner", fetch_start, None);
                         match mining_info {
                             Ok(mining_info) => {
                                 let mut state = state.lock().unwrap();
@@ -188,9 +270,31 @@ impl Miner {
                                     state.outage = false;
                                 }
                                 if mining_info.generation_signature != state.generation_signature {
-                                    state.update_mining_info(&mining_info);
-                                   
+                                    {
+                                        let _span = trace::span_with(
+                                            "update_mining_info",
+                                            "miner",
+                                            "height",
+                                            mining_info.height,
+                                        );
+                                        state.update_mining_info(&mining_info);
+                                    }
+                                    let hedge_stats = hedge_handler.hedge_stats();
+                                    let hedged = hedge_stats.hedged.load(Ordering::Relaxed);
+                                    if hedged > 0 {
+                                        info!(
+                                            "getMiningInfo hedging: requests={}, hedged={}, won={}",
+                                            hedge_stats.requests.load(Ordering::Relaxed),
+                                            hedged,
+                                            hedge_stats.won.load(Ordering::Relaxed),
+                                        );
+                                    }
+                                    if !round_log.is_empty() {
+                                        simulation::record_round(&round_log, &mining_info);
+                                    }
+
                                     // communicate new round hasher
+                                    let _span = trace::span("send_round_info", "miner");
                                     tx_rounds
                                         .send(RoundInfo {
                                             gensig: state.generation_signature_bytes,
@@ -198,6 +302,8 @@ impl Miner {
                                             scoop: state.scoop.into(),
                                             height: state.height,
                                             block: state.block,
+                                            target_deadline: target_deadline
+                                                .min(state.server_target_deadline),
                                         })
                                         .expect("main thread can't communicate with hasher thread");
                                 }
@@ -228,21 +334,29 @@ impl Miner {
                 .map_err(|e| panic!("interval errored: err={:?}", e)),
         );
 
-        let target_deadline = self.target_deadline;
-        let request_handler = self.request_handler.clone();
+        let submission_queues = self.submission_queues;
         let state = state.clone();
         self.executor.clone().spawn(
             rx_nonce_data
                 .for_each(move |nonce_data| {
+                    let _span = trace::span_with("nonce_data", "miner", "block", nonce_data.block);
                     let mut state = state.lock().unwrap();
-                    state.capacity = nonce_data.capacity;
+                    state
+                        .capacity
+                        .insert(nonce_data.numeric_id, nonce_data.capacity);
                     let deadline = nonce_data.deadline / nonce_data.base_target;
+                    let best_deadline = *state
+                        .best_deadline
+                        .get(&nonce_data.numeric_id)
+                        .unwrap_or(&u64::MAX);
                     if state.block == nonce_data.block {
-                        if state.best_deadline > nonce_data.deadline_adjusted
+                        if best_deadline > nonce_data.deadline_adjusted
                             && nonce_data.deadline_adjusted < target_deadline
                         {
-                            state.best_deadline = nonce_data.deadline_adjusted;
-                            request_handler.submit_nonce(
+                            state
+                                .best_deadline
+                                .insert(nonce_data.numeric_id, nonce_data.deadline_adjusted);
+                            submission_queues[&nonce_data.numeric_id].submit_nonce(
                                 nonce_data.numeric_id,
                                 nonce_data.nonce,
                                 nonce_data.height,
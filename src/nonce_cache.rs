@@ -0,0 +1,595 @@
+//! Nonces kept in memory across rounds, later rounds rescan them instead of hashing them again.
+//!
+//! The kernels emit the nonces of a task interleaved by lane, scoop `s` of consecutive nonce
+//! groups is `NONCE_SIZE * lanes` bytes apart, so a rescan of task buffers would touch one
+//! cache line per page. A background transposer therefore copies finished task buffers into a
+//! scoop-major store: the scoop 0 of all cached nonces, then scoop 1, ... Every entry already
+//! pairs the first hash of the scoop with the second hash of its mirror scoop, so the rescan
+//! of a round reads one contiguous region per account.
+//!
+//! With `nonce_cache_shm` set the store lives in a shared memory file instead, see
+//! `shm_cache`, and survives the process. With `nonce_cache_gpu` the regions are streamed to
+//! a gpu, see `GpuScanner`, instead of being scanned on the cpu.
+
+use crate::buffer::{MemoryReservation, PageAlignedByteBuffer};
+use crate::cpu_hasher::{find_best_deadline_sm, SimdExtension};
+#[cfg(feature = "opencl")]
+use crate::ocl::GpuScanner;
+use crate::poc_hashing::{HASH_SIZE, NONCE_SIZE, NUM_SCOOPS, SCOOP_SIZE};
+use crate::scheduler::{HasherMessage, RoundInfo};
+use crate::shm_cache::{ShmCache, SlotInfo};
+use crate::trace;
+use crossbeam_channel::{unbounded, Sender};
+use std::collections::BTreeMap;
+use std::ptr;
+use std::slice;
+use std::sync::{Arc, Mutex};
+use std::thread;
+
+/// A finished task buffer, the memory stays reserved until it's transposed.
+pub struct TransposeJob {
+    pub account: usize,
+    pub start_nonce: u64,
+    pub nonces: u64,
+    pub lanes: usize,
+    pub buffer: PageAlignedByteBuffer,
+    pub memory: MemoryReservation,
+}
+
+pub struct NonceCache {
+    simd_ext: SimdExtension,
+    segments: Vec<Mutex<Segment>>,
+    tx_jobs: Sender<TransposeJob>,
+    shm: Option<ShmCache>,
+    #[cfg(feature = "opencl")]
+    gpu: Mutex<Option<GpuScanner>>,
+    _memory: MemoryReservation,
+}
+
+// the cached nonces of one account, [start_nonce, start_nonce + capacity)
+struct Segment {
+    numeric_id: u64,
+    start_nonce: u64,
+    capacity: u64,
+    // transposed ranges as offset -> end, only the prefix starting at 0 gets rescanned
+    filled: BTreeMap<u64, u64>,
+    // null until a shared slot is attached
+    data: *mut u8,
+    buffer: Option<PageAlignedByteBuffer>,
+    slot: Option<SlotInfo>,
+}
+
+unsafe impl Send for Segment {}
+
+impl NonceCache {
+    /// Splits `memory` among the accounts by weight and starts the transposer. Rescans use
+    /// `simd_ext`, tasks hashed with a different lane count aren't cached. An account that
+    /// already has nonces in the shared cache at `shm_path` continues at their start nonce.
+    pub fn start(
+        accounts: &[(u64, u64, u64)], //(numeric_id, start_nonce, weight)
+        memory: MemoryReservation,
+        simd_ext: SimdExtension,
+        shm_path: &str,
+    ) -> Arc<NonceCache> {
+        let lanes = simd_ext.lanes() as u64;
+        let nonces = (memory.bytes() / NONCE_SIZE) as u64;
+        let weights: u64 = accounts.iter().map(|x| x.2).sum();
+        let shm = if shm_path.is_empty() {
+            None
+        } else {
+            match ShmCache::open(shm_path, memory.bytes(), lanes as usize) {
+                Ok(x) => Some(x),
+                Err(e) => {
+                    warn!("nonce cache: {}, using a private cache", e);
+                    None
+                }
+            }
+        };
+        let segments = accounts
+            .iter()
+            .map(|&(numeric_id, start_nonce, weight)| {
+                let mut segment = Segment {
+                    numeric_id,
+                    start_nonce,
+                    // at least one group, a buffer can't be empty
+                    capacity: (nonces * weight / weights / lanes * lanes).max(lanes),
+                    filled: BTreeMap::new(),
+                    data: ptr::null_mut(),
+                    buffer: None,
+                    slot: None,
+                };
+                match &shm {
+                    Some(shm) => {
+                        if let Some(slot) = shm.find(numeric_id) {
+                            segment.start_nonce = slot.start_nonce;
+                        }
+                        segment.attach(shm, lanes);
+                    }
+                    None => {
+                        let buffer =
+                            PageAlignedByteBuffer::new(segment.capacity as usize * NONCE_SIZE);
+                        segment.data = buffer.get_buffer().lock().unwrap().as_mut_ptr();
+                        segment.buffer = Some(buffer);
+                    }
+                }
+                Mutex::new(segment)
+            })
+            .collect();
+        let (tx_jobs, rx_jobs) = unbounded::<TransposeJob>();
+        let cache = Arc::new(NonceCache {
+            simd_ext,
+            segments,
+            tx_jobs,
+            shm,
+            #[cfg(feature = "opencl")]
+            gpu: Mutex::new(None),
+            _memory: memory,
+        });
+        let transposer = cache.clone();
+        thread::spawn(move || {
+            for job in rx_jobs {
+                let _span = trace::span_with("transpose", "cache", "nonces", job.nonces);
+                transposer.insert(&job);
+            }
+        });
+        cache
+    }
+
+    /// Start nonce of the cached nonces of `account`.
+    pub fn start_nonce(&self, account: usize) -> u64 {
+        self.segments[account].lock().unwrap().start_nonce
+    }
+
+    /// Nonces the cache holds for `account`, starting at its start nonce.
+    pub fn cached(&self, account: usize) -> u64 {
+        let mut segment = self.segments[account].lock().unwrap();
+        if let Some(shm) = &self.shm {
+            segment.attach(shm, self.simd_ext.lanes() as u64);
+        }
+        segment.prefix(&self.shm)
+    }
+
+    /// Hands a finished task to the transposer if it has nonces the cache lacks, otherwise
+    /// its buffer is freed right away.
+    pub fn offer(&self, job: TransposeJob) {
+        if job.lanes == self.simd_ext.lanes() && self.wants(&job) {
+            let _ = self.tx_jobs.send(job);
+        }
+    }
+
+    /// True if the cache would keep every nonce of a task of `lanes`, only then the task
+    /// may skip scanning them.
+    pub fn keeps(&self, account: usize, start_nonce: u64, nonces: u64, lanes: usize) -> bool {
+        if lanes != self.simd_ext.lanes() {
+            return false;
+        }
+        let mut segment = self.segments[account].lock().unwrap();
+        if let Some(shm) = &self.shm {
+            if !shm.writer() {
+                return false;
+            }
+            segment.attach(shm, lanes as u64);
+        }
+        let lanes = lanes as u64;
+        !segment.data.is_null()
+            && start_nonce >= segment.start_nonce
+            && (start_nonce - segment.start_nonce) % lanes == 0
+            && nonces % lanes == 0
+            && start_nonce - segment.start_nonce + nonces <= segment.capacity
+    }
+
+    fn wants(&self, job: &TransposeJob) -> bool {
+        let mut segment = self.segments[job.account].lock().unwrap();
+        if let Some(shm) = &self.shm {
+            // only the writer appends to the shared cache
+            if !shm.writer() {
+                return false;
+            }
+            segment.attach(shm, job.lanes as u64);
+            segment.prefix(&self.shm);
+        }
+        match segment.slot(job) {
+            Some((offset, nonces)) => !segment.contains(offset, offset + nonces),
+            None => false,
+        }
+    }
+
+    fn insert(&self, job: &TransposeJob) {
+        let lanes = job.lanes;
+        let (offset, nonces, capacity) = {
+            let segment = self.segments[job.account].lock().unwrap();
+            match segment.slot(job) {
+                Some((offset, nonces)) => (offset as usize, nonces as usize, segment.capacity),
+                None => return,
+            }
+        };
+        let src = job.buffer.get_buffer();
+        let src = src.lock().unwrap();
+        let region = capacity as usize * SCOOP_SIZE;
+        let half = HASH_SIZE * lanes;
+        for group in (0..nonces).step_by(lanes) {
+            // locked per group, so that rescans don't wait for a whole task
+            let mut segment = self.segments[job.account].lock().unwrap();
+            let dst = segment.data_mut();
+            let src = &src[group * NONCE_SIZE..(group + lanes) * NONCE_SIZE];
+            for scoop in 0..NUM_SCOOPS {
+                let mirror = NUM_SCOOPS - 1 - scoop;
+                let d = scoop * region + (offset + group) * SCOOP_SIZE;
+                let s1 = 2 * scoop * half;
+                let s2 = (2 * mirror + 1) * half;
+                dst[d..d + half].clone_from_slice(&src[s1..s1 + half]);
+                dst[d + half..d + 2 * half].clone_from_slice(&src[s2..s2 + half]);
+            }
+        }
+        let mut segment = self.segments[job.account].lock().unwrap();
+        add_range(&mut segment.filled, offset as u64, (offset + nonces) as u64);
+        // the data is written, now other processes may read it
+        if let (Some(shm), Some(slot)) = (&self.shm, &segment.slot) {
+            shm.publish(slot, segment.filled.get(&0).cloned().unwrap_or(0));
+        }
+    }
+
+    /// Rescans on `scanner` from now on.
+    #[cfg(feature = "opencl")]
+    pub fn use_gpu(&self, scanner: GpuScanner) {
+        *self.gpu.lock().unwrap() = Some(scanner);
+    }
+
+    /// Returns (deadline, nonce) of the best of the first `nonces` cached nonces of `account`.
+    pub fn scan(&self, account: usize, nonces: u64, scoop: u64, gensig: &[u8; 32]) -> (u64, u64) {
+        // The transposer only appends behind the cached prefix and the data of a segment
+        // doesn't move once attached, so the prefix is scanned without holding the lock.
+        let (data, capacity, start_nonce) = {
+            let segment = self.segments[account].lock().unwrap();
+            (segment.data, segment.capacity, segment.start_nonce)
+        };
+        assert!(!data.is_null() && nonces <= capacity);
+        let region = capacity as usize * SCOOP_SIZE;
+        let scoops = unsafe {
+            slice::from_raw_parts(
+                data.add(scoop as usize * region),
+                nonces as usize * SCOOP_SIZE,
+            )
+        };
+        #[cfg(feature = "opencl")]
+        {
+            if let Some(scanner) = self.gpu.lock().unwrap().as_ref() {
+                // the first of equal deadlines, like the cpu
+                let (deadline, offset) = scanner
+                    .scan(scoops, self.simd_ext.lanes(), gensig)
+                    .into_iter()
+                    .min_by_key(|x| x.0)
+                    .unwrap_or((u64::max_value(), 0));
+                return (deadline, start_nonce + offset);
+            }
+        }
+        let (deadline, offset) = find_best_deadline_sm(&self.simd_ext, scoops, nonces, gensig);
+        (deadline, start_nonce + offset)
+    }
+}
+
+impl Segment {
+    // looks up or, as the writer, creates the shared slot of the account
+    fn attach(&mut self, shm: &ShmCache, lanes: u64) {
+        if self.slot.is_some() {
+            return;
+        }
+        let slot = match shm.find(self.numeric_id) {
+            Some(x) => x,
+            None => match shm.create(
+                self.numeric_id,
+                self.start_nonce,
+                self.capacity,
+                lanes,
+                NONCE_SIZE,
+            ) {
+                Some(x) => x,
+                None => return,
+            },
+        };
+        // cached by a process that started later with another start nonce
+        if slot.start_nonce != self.start_nonce {
+            return;
+        }
+        self.capacity = slot.capacity;
+        self.data = shm.data(&slot);
+        self.slot = Some(slot);
+    }
+
+    // the cached prefix, including what other processes published
+    fn prefix(&mut self, shm: &Option<ShmCache>) -> u64 {
+        if let (Some(shm), Some(slot)) = (shm, &self.slot) {
+            let published = shm.nonces(slot);
+            if published > 0 {
+                add_range(&mut self.filled, 0, published);
+            }
+        }
+        self.filled.get(&0).cloned().unwrap_or(0)
+    }
+
+    fn data_mut(&mut self) -> &mut [u8] {
+        unsafe { slice::from_raw_parts_mut(self.data, self.capacity as usize * NONCE_SIZE) }
+    }
+
+    // (offset, nonces) of the part of the job that fits, groups of lanes have to line up
+    fn slot(&self, job: &TransposeJob) -> Option<(u64, u64)> {
+        let lanes = job.lanes as u64;
+        if self.data.is_null() || job.start_nonce < self.start_nonce {
+            return None;
+        }
+        let offset = job.start_nonce - self.start_nonce;
+        if offset % lanes != 0 || offset >= self.capacity {
+            return None;
+        }
+        let nonces = job.nonces.min(self.capacity - offset) / lanes * lanes;
+        if nonces == 0 {
+            return None;
+        }
+        Some((offset, nonces))
+    }
+
+    fn contains(&self, start: u64, end: u64) -> bool {
+        self.filled
+            .range(..=start)
+            .next_back()
+            .map_or(false, |(_, &e)| e >= end)
+    }
+}
+
+// adds [start, end) to the ranges and merges overlapping and adjacent ones
+fn add_range(ranges: &mut BTreeMap<u64, u64>, start: u64, end: u64) {
+    let mut start = start;
+    let mut end = end;
+    let merged: Vec<(u64, u64)> = ranges
+        .range(..=end)
+        .filter(|(_, e)| **e >= start)
+        .map(|(s, e)| (*s, *e))
+        .collect();
+    for (s, e) in merged {
+        ranges.remove(&s);
+        start = start.min(s);
+        end = end.max(e);
+    }
+    ranges.insert(start, end);
+}
+
+/// Rescans the cached nonces for a new round, `cached` is the prefix per account the
+/// scheduler skips when handing out tasks.
+pub fn rescan(
+    cache: Arc<NonceCache>,
+    tx: Sender<HasherMessage>,
+    round: RoundInfo,
+    cached: Vec<u64>,
+) -> impl FnOnce() {
+    move || {
+        for (account, &nonces) in cached.iter().enumerate() {
+            if nonces == 0 {
+                continue;
+            }
+            let span = trace::span_with("rescan", "cache", "nonces", nonces);
+            let (deadline, nonce) = cache.scan(account, nonces, round.scoop, &round.gensig);
+            drop(span);
+            if tx
+                .send(HasherMessage::NoncesProcessed(account, nonces, round.block))
+                .is_err()
+            {
+                return;
+            }
+            let _ = tx.send(HasherMessage::SubmitDeadline((
+                account,
+                round.height,
+                nonce,
+                deadline,
+                round.block,
+            )));
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::buffer::MemoryBudget;
+    use crate::cpu_hasher::{find_best_deadline, noncegen};
+
+    #[test]
+    fn test_add_range() {
+        let mut ranges = BTreeMap::new();
+        add_range(&mut ranges, 32, 48);
+        add_range(&mut ranges, 0, 16);
+        assert_eq!(ranges.len(), 2);
+        add_range(&mut ranges, 16, 32);
+        assert_eq!(ranges.into_iter().collect::<Vec<_>>(), vec![(0, 48)]);
+    }
+
+    fn cache_and_expect(shm_path: &str, budget: &MemoryBudget) -> (Arc<NonceCache>, (u64, u64)) {
+        let simd_ext = SimdExtension::None;
+        let cache = NonceCache::start(
+            &[(42, 1000, 1)],
+            budget.reserve(8 * NONCE_SIZE, NONCE_SIZE).unwrap(),
+            simd_ext.clone(),
+            shm_path,
+        );
+        let mut expected = (u64::max_value(), 0);
+        // out of order, the prefix only grows once the gap is filled
+        for &start in [1004u64, 1000].iter() {
+            let buffer = PageAlignedByteBuffer::new(4 * NONCE_SIZE);
+            {
+                let data = buffer.get_buffer();
+                let mut data = data.lock().unwrap();
+                noncegen(&simd_ext, &mut data, 42, start, 4);
+                let (deadline, offset) = find_best_deadline(&simd_ext, &data, 17, 4, &GENSIG);
+                expected = expected.min((deadline, start + offset));
+            }
+            cache.insert(&TransposeJob {
+                account: 0,
+                start_nonce: start,
+                nonces: 4,
+                lanes: 1,
+                buffer,
+                memory: budget.reserve(4 * NONCE_SIZE, NONCE_SIZE).unwrap(),
+            });
+            assert_eq!(cache.cached(0), if start == 1004 { 0 } else { 8 });
+        }
+        (cache, expected)
+    }
+
+    const GENSIG: [u8; 32] = [7u8; 32];
+
+    #[test]
+    fn test_rescan_matches_task_scan() {
+        let budget = MemoryBudget::new(0);
+        let (cache, expected) = cache_and_expect("", &budget);
+        assert_eq!(cache.scan(0, 8, 17, &GENSIG), expected);
+    }
+
+    #[test]
+    fn test_shared_cache_survives_restart() {
+        let path = std::env::temp_dir().join(format!("bencher-cache-{}", std::process::id()));
+        let path = path.to_str().unwrap();
+        let _ = std::fs::remove_file(path);
+        let budget = MemoryBudget::new(0);
+        let (cache, expected) = cache_and_expect(path, &budget);
+        drop(cache);
+
+        // a restarted process continues at the cached start nonce and rescans right away
+        let restarted = NonceCache::start(
+            &[(42, 5, 1)],
+            budget.reserve(8 * NONCE_SIZE, NONCE_SIZE).unwrap(),
+            SimdExtension::None,
+            path,
+        );
+        assert_eq!(restarted.start_nonce(0), 1000);
+        assert_eq!(restarted.cached(0), 8);
+        assert_eq!(restarted.scan(0, 8, 17, &GENSIG), expected);
+        let _ = std::fs::remove_file(path);
+    }
+
+    #[test]
+    fn test_keeps_whole_tasks_only() {
+        let path = std::env::temp_dir().join(format!("bencher-keeps-{}", std::process::id()));
+        let path = path.to_str().unwrap();
+        let _ = std::fs::remove_file(path);
+        let budget = MemoryBudget::new(0);
+        let start = |shm_path: &str| {
+            NonceCache::start(
+                &[(42, 1000, 1)],
+                budget.reserve(8 * NONCE_SIZE, NONCE_SIZE).unwrap(),
+                SimdExtension::None,
+                shm_path,
+            )
+        };
+        let cache = start(path);
+        assert!(cache.keeps(0, 1000, 8, 1));
+        assert!(cache.keeps(0, 1004, 4, 1));
+        // the tail past the capacity would be neither scanned nor cached
+        assert!(!cache.keeps(0, 1004, 8, 1));
+        assert!(!cache.keeps(0, 996, 4, 1));
+        // the engine was switched to another lane count
+        assert!(!cache.keeps(0, 1000, 8, 4));
+        // only the writer appends to a shared cache
+        if cfg!(unix) {
+            let reader = start(path);
+            assert!(!reader.keeps(0, 1000, 8, 1));
+        }
+        drop(cache);
+        let _ = std::fs::remove_file(path);
+    }
+
+    // the scoop-major kernels of every engine the cpu supports agree with the task scan
+    #[test]
+    fn test_rescan_matches_task_scan_per_engine() {
+        let nonces = 32;
+        for simd_ext in &[
+            SimdExtension::AVX512f,
+            SimdExtension::AVX2,
+            SimdExtension::AVX,
+            SimdExtension::SSE2,
+            SimdExtension::None,
+        ] {
+            if !simd_ext.init() {
+                continue;
+            }
+            let budget = MemoryBudget::new(0);
+            let cache = NonceCache::start(
+                &[(42, 1000, 1)],
+                budget.reserve(nonces * NONCE_SIZE, NONCE_SIZE).unwrap(),
+                simd_ext.clone(),
+                "",
+            );
+            let buffer = PageAlignedByteBuffer::new(nonces * NONCE_SIZE);
+            let data = buffer.get_buffer();
+            let mut data = data.lock().unwrap();
+            noncegen(simd_ext, &mut data, 42, 1000, nonces as u64);
+            let expected: Vec<(u64, u64)> = [0u64, 17, 4095]
+                .iter()
+                .map(|&scoop| {
+                    let (deadline, offset) =
+                        find_best_deadline(simd_ext, &data, scoop, nonces as u64, &GENSIG);
+                    (deadline, 1000 + offset)
+                })
+                .collect();
+            drop(data);
+            cache.insert(&TransposeJob {
+                account: 0,
+                start_nonce: 1000,
+                nonces: nonces as u64,
+                lanes: simd_ext.lanes(),
+                buffer,
+                memory: budget.reserve(nonces * NONCE_SIZE, NONCE_SIZE).unwrap(),
+            });
+            for (&scoop, &expected) in [0u64, 17, 4095].iter().zip(expected.iter()) {
+                assert_eq!(
+                    cache.scan(0, nonces as u64, scoop, &GENSIG),
+                    expected,
+                    "{:?}",
+                    simd_ext
+                );
+            }
+        }
+    }
+
+    // the cache of the widest cpu engine interleaves up to 16 nonces, the gpu has to match
+    #[cfg(feature = "opencl")]
+    #[test]
+    fn test_gpu_rescan_matches_cpu() {
+        use crate::cpu_hasher::init_cpu_extensions;
+        use crate::ocl::{gpu_available, gpu_init, GpuConfig};
+        let gpu = GpuConfig::new(0, 0, 0);
+        let simd_ext = init_cpu_extensions();
+        if simd_ext.lanes() == 1 || !gpu_available(&gpu) {
+            return;
+        }
+        let nonces = 64;
+        let budget = MemoryBudget::new(0);
+        let cache = NonceCache::start(
+            &[(42, 1000, 1)],
+            budget.reserve(nonces * NONCE_SIZE, NONCE_SIZE).unwrap(),
+            simd_ext.clone(),
+            "",
+        );
+        let buffer = PageAlignedByteBuffer::new(nonces * NONCE_SIZE);
+        {
+            let data = buffer.get_buffer();
+            let mut data = data.lock().unwrap();
+            noncegen(&simd_ext, &mut data, 42, 1000, nonces as u64);
+        }
+        cache.insert(&TransposeJob {
+            account: 0,
+            start_nonce: 1000,
+            nonces: nonces as u64,
+            lanes: simd_ext.lanes(),
+            buffer,
+            memory: budget.reserve(nonces * NONCE_SIZE, NONCE_SIZE).unwrap(),
+        });
+        let scoops = [0u64, 17, 4095];
+        let cpu: Vec<(u64, u64)> = scoops
+            .iter()
+            .map(|&scoop| cache.scan(0, nonces as u64, scoop, &GENSIG))
+            .collect();
+        cache.use_gpu(gpu_init(&[gpu])[0].scanner());
+        for (&scoop, &expected) in scoops.iter().zip(cpu.iter()) {
+            assert_eq!(cache.scan(0, nonces as u64, scoop, &GENSIG), expected);
+        }
+    }
+}
@@ -2,7 +2,8 @@ use self::core::{
     ArgVal, ContextProperties, DeviceInfo, Event, KernelWorkGroupInfo, PlatformInfo, Status,
 };
 use crate::gpu_hasher::GpuTask;
-use crate::poc_hashing::NONCE_SIZE;
+use crate::poc_hashing::{NONCE_SIZE, SCOOP_SIZE};
+use crate::trace;
 use ocl_core as core;
 use std::cmp::min;
 use std::ffi::CString;
@@ -13,6 +14,10 @@ use std::u64;
 static SRC: &'static str = include_str!("ocl/kernel.cl");
 
 const GPU_HASHES_PER_RUN: usize = 32;
+// nonces per work item and task of the persistent kernel
+const PERSISTENT_NONCES_PER_ITEM: usize = 4;
+// scoops per upload of a scanner, two of these live on the device
+const SCAN_CHUNK_BYTES: usize = 32 * 1024 * 1024;
 
 // convert the info or error to a string for printing:
 macro_rules! to_string {
@@ -27,11 +32,17 @@ macro_rules! to_string {
     };
 }
 
-#[derive(Debug, Serialize, Deserialize)]
+#[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct GpuConfig {
     platform_id: usize,
     device_id: usize,
     cores: usize,
+    // one kernel launch per task, see noncegen_persistent in kernel.cl
+    #[serde(default)]
+    persistent: bool,
+    // nonces per work item in vector lanes, 1, 2 or 4
+    #[serde(default)]
+    nonces_per_item: usize,
 }
 
 //#[allow(dead_code)]
@@ -52,13 +63,31 @@ pub struct GpuContext {
     deadlines_gpu: core::Mem,
     best_deadline_gpu: core::Mem,
     best_offset_gpu: core::Mem,
+    persistent: Option<Persistent>,
+    // to build a scanner on demand
+    context: core::Context,
+    program: core::Program,
+    device_id: core::DeviceId,
+}
+
+// the kernel and buffers of the persistent mode, only created if it's configured
+struct Persistent {
+    kernel: core::Kernel,
+    next_gpu: core::Mem,
+    best_gpu: core::Mem,
 }
 
 // Ohne Gummi im Bahnhofsviertel... das wird noch Konsequenzen haben
 unsafe impl Sync for GpuContext {}
 
 impl GpuContext {
-    pub fn new(gpu_platform: usize, gpu_id: usize, cores: usize) -> GpuContext {
+    pub fn new(
+        gpu_platform: usize,
+        gpu_id: usize,
+        cores: usize,
+        persistent: bool,
+        nonces_per_item: usize,
+    ) -> GpuContext {
         let platform_ids = core::get_platform_ids().unwrap();
         let platform_id = platform_ids[gpu_platform];
         let device_ids = core::get_device_ids(&platform_id, None, None).unwrap();
@@ -71,7 +100,7 @@ impl GpuContext {
         core::build_program(
             &program,
             None::<&[()]>,
-            &CString::new("").unwrap(),
+            &build_options(nonces_per_item),
             None,
             None,
         )
@@ -81,13 +110,15 @@ impl GpuContext {
         let kernel0 = core::create_kernel(&program, "noncegen").unwrap();
         let kernel0_workgroup_size = get_kernel_work_group_size(&kernel0, device_id);
         let workgroup_count = cores;
-        let worksize = kernel0_workgroup_size * workgroup_count;
-        let gdim0 = [worksize, 1, 1];
+        // work items hash nonces_per_item nonces each, worksize counts nonces
+        let work_items = kernel0_workgroup_size * workgroup_count;
+        let worksize = work_items * nonces_per_item;
+        let gdim0 = [work_items, 1, 1];
         let ldim0 = [kernel0_workgroup_size, 1, 1];
         
         let kernel1 = core::create_kernel(&program, "calculate_deadlines").unwrap();
          
-        let gdim1 = [worksize, 1, 1];
+        let gdim1 = [work_items, 1, 1];
         let ldim1 = [kernel0_workgroup_size, 1, 1];
 
         let kernel2 = core::create_kernel(&program, "find_min").unwrap();
@@ -111,7 +142,7 @@ impl GpuContext {
         };
 
         let deadlines_gpu = unsafe {
-            core::create_buffer::<_, u64>(&context, core::MEM_READ_WRITE, gdim1[0], None).unwrap()
+            core::create_buffer::<_, u64>(&context, core::MEM_READ_WRITE, worksize, None).unwrap()
         };
 
         let best_offset_gpu = unsafe {
@@ -122,6 +153,29 @@ impl GpuContext {
             core::create_buffer::<_, u64>(&context, core::MEM_READ_WRITE, 1, None).unwrap()
         };
 
+        // the persistent kernel only gets the task specific arguments per task
+        let persistent = if persistent {
+            let kernel = core::create_kernel(&program, "noncegen_persistent").unwrap();
+            let next_gpu = unsafe {
+                core::create_buffer::<_, u32>(&context, core::MEM_READ_WRITE, 1, None).unwrap()
+            };
+            let best_gpu = unsafe {
+                core::create_buffer::<_, u64>(&context, core::MEM_READ_WRITE, 2 * work_items, None)
+                    .unwrap()
+            };
+            core::set_kernel_arg(&kernel, 0, ArgVal::mem(&buffer_gpu)).unwrap();
+            core::set_kernel_arg(&kernel, 1, ArgVal::mem(&gensig_gpu)).unwrap();
+            core::set_kernel_arg(&kernel, 6, ArgVal::mem(&next_gpu)).unwrap();
+            core::set_kernel_arg(&kernel, 7, ArgVal::mem(&best_gpu)).unwrap();
+            Some(Persistent {
+                kernel,
+                next_gpu,
+                best_gpu,
+            })
+        } else {
+            None
+        };
+
         GpuContext {
             queue,
             kernel0,
@@ -139,11 +193,233 @@ impl GpuContext {
             deadlines_gpu,
             best_deadline_gpu,
             best_offset_gpu,
+            persistent,
+            context,
+            program,
+            device_id,
         }
     }
+
+    /// Nonces per task, the persistent kernel runs several nonces per work item.
+    pub fn task_size(&self) -> usize {
+        if self.persistent.is_some() {
+            self.worksize * PERSISTENT_NONCES_PER_ITEM
+        } else {
+            self.worksize
+        }
+    }
+
+    /// A deadline engine for scoops supplied by the host. It has its own queues and buffers,
+    /// so it can run next to the hashing of this gpu.
+    pub fn scanner(&self) -> GpuScanner {
+        let upload_queue =
+            core::create_command_queue(&self.context, &self.device_id, None).unwrap();
+        let queue = core::create_command_queue(&self.context, &self.device_id, None).unwrap();
+
+        let kernel = core::create_kernel(&self.program, "calculate_deadlines_sm").unwrap();
+        let ldim = [get_kernel_work_group_size(&kernel, self.device_id), 1, 1];
+        let kernel_min = core::create_kernel(&self.program, "find_min").unwrap();
+        let min_workgroup_size = get_kernel_work_group_size(&kernel_min, self.device_id);
+        let dim_min = [min_workgroup_size, 1, 1];
+
+        // chunks are whole work groups and don't split the lane groups of up to 16 nonces
+        let nonces_per_item = self.worksize / self.gdim0[0];
+        let group = ldim[0] * nonces_per_item * 16;
+        let chunk = (SCAN_CHUNK_BYTES / SCOOP_SIZE / group).max(1) * group;
+
+        let scoops_gpu = [
+            unsafe {
+                core::create_buffer::<_, u8>(
+                    &self.context,
+                    core::MEM_READ_ONLY,
+                    chunk * SCOOP_SIZE,
+                    None,
+                )
+                .expect("can't create gpu scan buffer")
+            },
+            unsafe {
+                core::create_buffer::<_, u8>(
+                    &self.context,
+                    core::MEM_READ_ONLY,
+                    chunk * SCOOP_SIZE,
+                    None,
+                )
+                .expect("can't create gpu scan buffer")
+            },
+        ];
+        let gensig_gpu = unsafe {
+            core::create_buffer::<_, u8>(&self.context, core::MEM_READ_ONLY, 32, None).unwrap()
+        };
+        let deadlines_gpu = unsafe {
+            core::create_buffer::<_, u64>(&self.context, core::MEM_READ_WRITE, chunk, None).unwrap()
+        };
+        let best_offset_gpu = unsafe {
+            core::create_buffer::<_, u64>(&self.context, core::MEM_READ_WRITE, 1, None).unwrap()
+        };
+        let best_deadline_gpu = unsafe {
+            core::create_buffer::<_, u64>(&self.context, core::MEM_READ_WRITE, 1, None).unwrap()
+        };
+
+        core::set_kernel_arg(&kernel, 0, ArgVal::mem(&gensig_gpu)).unwrap();
+        core::set_kernel_arg(&kernel, 2, ArgVal::mem(&deadlines_gpu)).unwrap();
+        core::set_kernel_arg(&kernel_min, 0, ArgVal::mem(&deadlines_gpu)).unwrap();
+        core::set_kernel_arg(&kernel_min, 2, ArgVal::local::<u32>(&min_workgroup_size)).unwrap();
+        core::set_kernel_arg(&kernel_min, 3, ArgVal::mem(&best_offset_gpu)).unwrap();
+        core::set_kernel_arg(&kernel_min, 4, ArgVal::mem(&best_deadline_gpu)).unwrap();
+
+        GpuScanner {
+            upload_queue,
+            queue,
+            kernel,
+            ldim,
+            nonces_per_item,
+            kernel_min,
+            dim_min,
+            scoops_gpu,
+            gensig_gpu,
+            deadlines_gpu,
+            best_offset_gpu,
+            best_deadline_gpu,
+            chunk,
+        }
+    }
+}
+
+/// Deadlines of scoop-major data streamed from host memory, e.g. the nonce cache.
+///
+/// Uploads run on their own queue into two device buffers, so the next chunk crosses PCIe
+/// while the deadlines of the current one are calculated.
+pub struct GpuScanner {
+    upload_queue: core::CommandQueue,
+    queue: core::CommandQueue,
+    kernel: core::Kernel,
+    ldim: [usize; 3],
+    nonces_per_item: usize,
+    kernel_min: core::Kernel,
+    dim_min: [usize; 3],
+    scoops_gpu: [core::Mem; 2],
+    gensig_gpu: core::Mem,
+    // kept alive for the kernel arguments
+    #[allow(dead_code)]
+    deadlines_gpu: core::Mem,
+    best_offset_gpu: core::Mem,
+    best_deadline_gpu: core::Mem,
+    // nonces per upload
+    chunk: usize,
+}
+
+unsafe impl Send for GpuScanner {}
+
+impl GpuScanner {
+    /// Returns (deadline, offset) of the best nonce of every chunk of `scoops`, 64 byte
+    /// entries of the first hash of a scoop and the second hash of its mirror scoop. The
+    /// entries of `lanes` nonces are interleaved word by word, as the nonce cache stores them.
+    pub fn scan(&self, scoops: &[u8], lanes: usize, gensig: &[u8; 32]) -> Vec<(u64, u64)> {
+        let nonces = scoops.len() / SCOOP_SIZE;
+        let chunks = (nonces + self.chunk - 1) / self.chunk;
+        // deadline and offset per chunk, read back as the chunks are done
+        let mut best = vec![0u64; 2 * chunks];
+        unsafe {
+            core::enqueue_write_buffer(
+                &self.queue,
+                &self.gensig_gpu,
+                true,
+                0,
+                gensig,
+                None::<Event>,
+                None::<&mut Event>,
+            )
+            .unwrap();
+        }
+        // a buffer is only refilled once the kernel of the chunk before last is done with it
+        let mut computed: [Option<Event>; 2] = [None, None];
+        for (i, result) in best.chunks_mut(2).enumerate() {
+            let b = i % 2;
+            let first = i * self.chunk;
+            let count = self.chunk.min(nonces - first);
+            let mut uploaded = Event::null();
+            unsafe {
+                core::enqueue_write_buffer(
+                    &self.upload_queue,
+                    &self.scoops_gpu[b],
+                    false,
+                    0,
+                    &scoops[first * SCOOP_SIZE..(first + count) * SCOOP_SIZE],
+                    computed[b].as_ref(),
+                    Some(&mut uploaded),
+                )
+                .unwrap();
+            }
+            core::flush(&self.upload_queue).unwrap();
+
+            let items = (count + self.nonces_per_item - 1) / self.nonces_per_item;
+            let groups = (items + self.ldim[0] - 1) / self.ldim[0];
+            let gdim = [groups * self.ldim[0], 1, 1];
+            core::set_kernel_arg(&self.kernel, 1, ArgVal::mem(&self.scoops_gpu[b])).unwrap();
+            core::set_kernel_arg(&self.kernel, 3, ArgVal::primitive(&(count as u64))).unwrap();
+            core::set_kernel_arg(&self.kernel, 4, ArgVal::primitive(&(lanes as u64))).unwrap();
+            core::set_kernel_arg(&self.kernel_min, 1, ArgVal::primitive(&(count as u64))).unwrap();
+            let mut done = Event::null();
+            unsafe {
+                core::enqueue_kernel(
+                    &self.queue,
+                    &self.kernel,
+                    1,
+                    None,
+                    &gdim,
+                    Some(self.ldim),
+                    Some(&uploaded),
+                    Some(&mut done),
+                )
+                .unwrap();
+                core::enqueue_kernel(
+                    &self.queue,
+                    &self.kernel_min,
+                    1,
+                    None,
+                    &self.dim_min,
+                    Some(self.dim_min),
+                    None::<Event>,
+                    None::<&mut Event>,
+                )
+                .unwrap();
+                // the queue is in order, the results of this chunk are read before the next
+                // find_min overwrites them
+                let (deadline, offset) = result.split_at_mut(1);
+                core::enqueue_read_buffer(
+                    &self.queue,
+                    &self.best_deadline_gpu,
+                    false,
+                    0,
+                    deadline,
+                    None::<Event>,
+                    None::<&mut Event>,
+                )
+                .unwrap();
+                core::enqueue_read_buffer(
+                    &self.queue,
+                    &self.best_offset_gpu,
+                    false,
+                    0,
+                    offset,
+                    None::<Event>,
+                    None::<&mut Event>,
+                )
+                .unwrap();
+            }
+            core::flush(&self.queue).unwrap();
+            computed[b] = Some(done);
+        }
+        // the readbacks above write into best until here
+        core::finish(&self.queue).unwrap();
+        best.chunks(2)
+            .enumerate()
+            .map(|(i, x)| (x[0], (i * self.chunk) as u64 + x[1]))
+            .collect()
+    }
 }
 
-pub fn platform_info() {
+pub fn platform_info(gpus: &[GpuConfig]) {
     let platform_ids = core::get_platform_ids().unwrap();
     for (i, platform_id) in platform_ids.iter().enumerate() {
         info!(
@@ -166,10 +442,15 @@ pub fn platform_info() {
                 core::create_context(Some(&context_properties), &[*device_id], None, None).unwrap();
             let src_cstring = CString::new(SRC).unwrap();
             let program = core::create_program_with_source(&context, &[src_cstring]).unwrap();
+            // the workgroup size depends on the build, use a configured device's options
+            let nonces_per_item = gpus
+                .iter()
+                .find(|x| x.platform_id == i && x.device_id == j)
+                .map_or(1, |x| x.nonces_per_item());
             core::build_program(
                 &program,
                 None::<&[()]>,
-                &CString::new("").unwrap(),
+                &build_options(nonces_per_item),
                 None,
                 None,
             )
@@ -178,14 +459,19 @@ pub fn platform_info() {
             let cores = get_cores(*device_id) as usize;
             let kernel_workgroup_size = get_kernel_work_group_size(&kernel, *device_id);
             info!(
-                "OCL:     cores={},kernel_workgroupsize={}",
-                cores, kernel_workgroup_size
+                "OCL:     cores={},kernel_workgroupsize={},nonces_per_item={}",
+                cores, kernel_workgroup_size, nonces_per_item
             );
         }
         info!("OCL:");
     }
 }
 
+// the kernel's workgroup size depends on these, size buffers with the same build
+fn build_options(nonces_per_item: usize) -> CString {
+    CString::new(format!("-D NONCES_PER_ITEM={}", nonces_per_item)).unwrap()
+}
+
 fn get_cores(device: core::DeviceId) -> u32 {
     match core::get_device_info(device, DeviceInfo::MaxComputeUnits).unwrap() {
         core::DeviceInfoResult::MaxComputeUnits(mcu) => mcu,
@@ -230,7 +516,7 @@ pub fn gpu_get_info(gpus: &[GpuConfig], quiet: bool) -> (u64, String) {
         core::build_program(
             &program,
             None::<&[()]>,
-            &CString::new("").unwrap(),
+            &build_options(gpu.nonces_per_item()),
             None,
             None,
         )
@@ -243,7 +529,7 @@ pub fn gpu_get_info(gpus: &[GpuConfig], quiet: bool) -> (u64, String) {
         } else {
             min(gpu.cores, max_compute_units as usize)
         };
-        let mem_needed = gpu_cores * kernel_workgroup_size * 256 * 1024;
+        let mem_needed = gpu_cores * kernel_workgroup_size * gpu.nonces_per_item() * 256 * 1024;
 
         if mem_needed > mem as usize {
             println!("Error: Not enough GPU-memory. Please reduce number of cores.");
@@ -277,6 +563,49 @@ pub fn gpu_get_info(gpus: &[GpuConfig], quiet: bool) -> (u64, String) {
     (total_mem_needed, gpu_string)
 }
 
+impl GpuConfig {
+    pub fn new(platform_id: usize, device_id: usize, cores: usize) -> Self {
+        GpuConfig {
+            platform_id,
+            device_id,
+            cores,
+            persistent: false,
+            nonces_per_item: 1,
+        }
+    }
+
+    /// Work sizes per task, a persistent task hashes several in one kernel launch.
+    pub fn worksizes_per_task(&self) -> u32 {
+        if self.persistent {
+            PERSISTENT_NONCES_PER_ITEM as u32
+        } else {
+            1
+        }
+    }
+
+    // unset or unsupported values hash one nonce per work item
+    fn nonces_per_item(&self) -> usize {
+        match self.nonces_per_item {
+            2 | 4 => self.nonces_per_item,
+            _ => 1,
+        }
+    }
+}
+
+/// Checks that the platform and device exist, gpu_init shuts down otherwise.
+pub fn gpu_available(gpu: &GpuConfig) -> bool {
+    let platform_ids = match core::get_platform_ids() {
+        Ok(x) => x,
+        Err(_) => return false,
+    };
+    match platform_ids.get(gpu.platform_id) {
+        Some(platform) => core::get_device_ids(platform, None, None)
+            .map(|x| gpu.device_id < x.len())
+            .unwrap_or(false),
+        None => false,
+    }
+}
+
 pub fn gpu_init(gpus: &[GpuConfig]) -> Vec<Arc<GpuContext>> {
     let mut result = Vec::new();
     for gpu in gpus.iter() {
@@ -308,6 +637,8 @@ pub fn gpu_init(gpus: &[GpuConfig]) -> Vec<Arc<GpuContext>> {
             gpu.platform_id,
             gpu.device_id,
             gpu_cores,
+            gpu.persistent,
+            gpu.nonces_per_item(),
         )));
     }
     result
@@ -326,54 +657,20 @@ fn get_kernel_work_group_size(x: &core::Kernel, y: core::DeviceId) -> usize {
 }
 
 pub fn gpu_hash(gpu_context: &Arc<GpuContext>, task: &GpuTask) -> (u64, u64) {
-    let numeric_id_be: u64 = task.numeric_id.to_be();
-
-    let mut start;
-    let mut end;
-
-    core::set_kernel_arg(&gpu_context.kernel0, 0, ArgVal::mem(&gpu_context.buffer_gpu)).unwrap();
-    core::set_kernel_arg(
-        &gpu_context.kernel0,
-        1,
-        ArgVal::primitive(&task.local_startnonce),
-    )
-    .unwrap();
-    core::set_kernel_arg(
-        &gpu_context.kernel0,
-        5,
-        ArgVal::primitive(&task.local_nonces),
-    )
-    .unwrap();
-    core::set_kernel_arg(&gpu_context.kernel0, 2, ArgVal::primitive(&numeric_id_be)).unwrap();
-
-    for i in (0..8192).step_by(GPU_HASHES_PER_RUN) {
-        if i + GPU_HASHES_PER_RUN < 8192 {
-            start = i;
-            end = i + GPU_HASHES_PER_RUN - 1;
-        } else {
-            start = i;
-            end = i + GPU_HASHES_PER_RUN;
-        }
-
-        core::set_kernel_arg(&gpu_context.kernel0, 3, ArgVal::primitive(&(start as i32))).unwrap();
-        core::set_kernel_arg(&gpu_context.kernel0, 4, ArgVal::primitive(&(end as i32))).unwrap();
-
-        unsafe {
-            core::enqueue_kernel(
-                &gpu_context.queue,
-                &gpu_context.kernel0,
-                1,
-                None,
-                &gpu_context.gdim0,
-                Some(gpu_context.ldim0),
-                None::<Event>,
-                None::<&mut Event>,
-            )
-            .unwrap();
-        }
+    if let Some(persistent) = &gpu_context.persistent {
+        return gpu_hash_persistent(gpu_context, persistent, task);
     }
+    let noncegen_span = trace::span_with("gpu_noncegen", "gpu", "nonces", task.local_nonces);
+    enqueue_noncegen(
+        gpu_context,
+        task.numeric_id,
+        task.local_startnonce,
+        task.local_nonces,
+    );
     core::finish(&gpu_context.queue).unwrap();
+    drop(noncegen_span);
 
+    let _deadline_span = trace::span("gpu_deadline", "gpu");
     upload_gensig(&gpu_context, task.round.gensig, true);
 
     // calc deadline
@@ -462,6 +759,159 @@ pub fn gpu_hash(gpu_context: &Arc<GpuContext>, task: &GpuTask) -> (u64, u64) {
 
 }
 
+// Enqueues the noncegen slices of `nonces` nonces into buffer_gpu, doesn't wait for them.
+fn enqueue_noncegen(gpu_context: &GpuContext, numeric_id: u64, startnonce: u64, nonces: u64) {
+    let numeric_id_be: u64 = numeric_id.to_be();
+
+    let mut start;
+    let mut end;
+
+    core::set_kernel_arg(&gpu_context.kernel0, 0, ArgVal::mem(&gpu_context.buffer_gpu)).unwrap();
+    core::set_kernel_arg(&gpu_context.kernel0, 1, ArgVal::primitive(&startnonce)).unwrap();
+    core::set_kernel_arg(&gpu_context.kernel0, 5, ArgVal::primitive(&nonces)).unwrap();
+    core::set_kernel_arg(&gpu_context.kernel0, 2, ArgVal::primitive(&numeric_id_be)).unwrap();
+
+    for i in (0..8192).step_by(GPU_HASHES_PER_RUN) {
+        let slice_start = trace::now();
+        if i + GPU_HASHES_PER_RUN < 8192 {
+            start = i;
+            end = i + GPU_HASHES_PER_RUN - 1;
+        } else {
+            start = i;
+            end = i + GPU_HASHES_PER_RUN;
+        }
+
+        core::set_kernel_arg(&gpu_context.kernel0, 3, ArgVal::primitive(&(start as i32))).unwrap();
+        core::set_kernel_arg(&gpu_context.kernel0, 4, ArgVal::primitive(&(end as i32))).unwrap();
+
+        unsafe {
+            core::enqueue_kernel(
+                &gpu_context.queue,
+                &gpu_context.kernel0,
+                1,
+                None,
+                &gpu_context.gdim0,
+                Some(gpu_context.ldim0),
+                None::<Event>,
+                None::<&mut Event>,
+            )
+            .unwrap();
+        }
+
+        // slices are only timed while tracing, waiting for each one costs a little throughput
+        if trace::enabled() {
+            core::finish(&gpu_context.queue).unwrap();
+            trace::record("gpu_noncegen_slice", "gpu", slice_start, Some(("start", start as u64)));
+        }
+    }
+}
+
+/// Enqueues the generation of `nonces` complete nonces followed by a non-blocking readback
+/// of the buffer into `out`, in the interleaved layout of `Address()` in kernel.cl.
+///
+/// The queue is in order, so the next batch can be enqueued right away and only starts
+/// overwriting the buffer once the readback is done. `out` must stay untouched until the
+/// returned event has completed, see `gpu_wait`.
+pub unsafe fn gpu_noncegen_read(
+    gpu_context: &GpuContext,
+    numeric_id: u64,
+    startnonce: u64,
+    nonces: u64,
+    out: &mut [u8],
+) -> Event {
+    enqueue_noncegen(gpu_context, numeric_id, startnonce, nonces);
+    let mut event = Event::null();
+    core::enqueue_read_buffer(
+        &gpu_context.queue,
+        &gpu_context.buffer_gpu,
+        false,
+        0,
+        out,
+        None::<Event>,
+        Some(&mut event),
+    )
+    .unwrap();
+    // flush so that the device starts while the host waits for an earlier batch
+    core::flush(&gpu_context.queue).unwrap();
+    event
+}
+
+pub fn gpu_wait(event: &Event) {
+    core::wait_for_event(event).unwrap();
+}
+
+// One launch and one readback per task instead of 256 noncegen slices, calculate_deadlines,
+// find_min and two readbacks. The kernel hands out the nonces through a counter in device
+// memory and every work item keeps its best deadline, the host reduces them.
+fn gpu_hash_persistent(
+    gpu_context: &Arc<GpuContext>,
+    persistent: &Persistent,
+    task: &GpuTask,
+) -> (u64, u64) {
+    let numeric_id_be: u64 = task.numeric_id.to_be();
+    let _span = trace::span_with("gpu_persistent", "gpu", "nonces", task.local_nonces);
+
+    upload_gensig(&gpu_context, task.round.gensig, true);
+    unsafe {
+        core::enqueue_write_buffer(
+            &gpu_context.queue,
+            &persistent.next_gpu,
+            true,
+            0,
+            &[0u32],
+            None::<Event>,
+            None::<&mut Event>,
+        )
+        .unwrap();
+    }
+
+    let kernel = &persistent.kernel;
+    core::set_kernel_arg(kernel, 2, ArgVal::primitive(&task.local_startnonce)).unwrap();
+    core::set_kernel_arg(kernel, 3, ArgVal::primitive(&numeric_id_be)).unwrap();
+    core::set_kernel_arg(kernel, 4, ArgVal::primitive(&task.local_nonces)).unwrap();
+    core::set_kernel_arg(kernel, 5, ArgVal::primitive(&task.round.scoop)).unwrap();
+    unsafe {
+        core::enqueue_kernel(
+            &gpu_context.queue,
+            kernel,
+            1,
+            None,
+            &gpu_context.gdim0,
+            Some(gpu_context.ldim0),
+            None::<Event>,
+            None::<&mut Event>,
+        )
+        .unwrap();
+    }
+
+    let mut best = vec![0u64; 2 * gpu_context.gdim0[0]];
+    unsafe {
+        core::enqueue_read_buffer(
+            &gpu_context.queue,
+            &persistent.best_gpu,
+            true,
+            0,
+            &mut best,
+            None::<Event>,
+            None::<&mut Event>,
+        )
+        .unwrap();
+    }
+    best_of(&best)
+}
+
+// (deadline, offset) of the best work item, deadlines first and offsets second
+fn best_of(best: &[u64]) -> (u64, u64) {
+    let (deadlines, offsets) = best.split_at(best.len() / 2);
+    let mut result = (u64::MAX, 0);
+    for (&deadline, &offset) in deadlines.iter().zip(offsets.iter()) {
+        if deadline < result.0 {
+            result = (deadline, offset);
+        }
+    }
+    result
+}
+
 pub fn get_result(gpu_context: &Arc<GpuContext>) -> (u64, u64) {
     let mut best_offset = vec![0u64; 1];
     let mut best_deadline = vec![0u64; 1];
@@ -507,4 +957,16 @@ fn upload_gensig(gpu_context: &Arc<GpuContext>, gensig: [u8; 32], blocking: bool
         )
         .unwrap();
     }
-}
\ No newline at end of file
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_best_of() {
+        // work items that got no nonce report u64::MAX
+        assert_eq!(best_of(&[7, u64::MAX, 3, 10, 0, 42]), (3, 42));
+        assert_eq!(best_of(&[u64::MAX, 0]), (u64::MAX, 0));
+    }
+}
@@ -1,5 +1,34 @@
 typedef unsigned int sph_u32;
 
+// nonces per work item, set per device by the host: the shabal state of 2 or 4 nonces is
+// kept in vector registers, one lane per nonce
+#ifndef NONCES_PER_ITEM
+#define NONCES_PER_ITEM 1
+#endif
+
+#if NONCES_PER_ITEM == 4
+typedef uint4 state_t;
+#define STATE_AS(x) as_uint4(x)
+#define LOAD(p) vload4(0, p)
+#define STORE(v, p) vstore4(v, 0, p)
+#define LOAD_SCOOPS(p, b, w, l) ((uint4)((p)[(b)[0] + (w) * (l)], (p)[(b)[1] + (w) * (l)], (p)[(b)[2] + (w) * (l)], (p)[(b)[3] + (w) * (l)]))
+#elif NONCES_PER_ITEM == 2
+typedef uint2 state_t;
+#define STATE_AS(x) as_uint2(x)
+#define LOAD(p) vload2(0, p)
+#define STORE(v, p) vstore2(v, 0, p)
+#define LOAD_SCOOPS(p, b, w, l) ((uint2)((p)[(b)[0] + (w) * (l)], (p)[(b)[1] + (w) * (l)]))
+#else
+typedef sph_u32 state_t;
+#define STATE_AS(x) as_uint(x)
+#define LOAD(p) (*(p))
+#define STORE(v, p) (*(p) = (v))
+#define LOAD_SCOOPS(p, b, w, l) ((p)[(b)[0] + (w) * (l)])
+#endif
+// LOAD_SCOOPS(p, b, w, l) gathers word w of the scoops of NONCES_PER_ITEM nonces, b holds the
+// offset of every nonce's first word and l the distance between its words
+#define XOR_STORE(v, p) STORE(LOAD(p) ^ (v), p)
+
 #define SPH_C32(x)    ((sph_u32)(x ## U))
 #define SPH_T32(x) (as_uint(x))
 #define SPH_ROTL32(x, n) rotate(as_uint(x), as_uint(n))
@@ -50,7 +79,7 @@ typedef unsigned int sph_u32;
 #define sM    16
 
 #define C32   SPH_C32
-#define T32   SPH_T32
+#define T32(x) STATE_AS(x)
 
 #define O1   13
 #define O2    9
@@ -107,7 +136,7 @@ typedef unsigned int sph_u32;
 	} while (0)
 
 #define SWAP(v1, v2)   do { \
-		sph_u32 tmp = (v1); \
+		state_t tmp = (v1); \
 		(v1) = (v2); \
 		(v2) = tmp; \
 	} while (0)
@@ -255,8 +284,8 @@ typedef unsigned int sph_u32;
 	} while (0)
 
 #define INCR_W   do { \
-		if ((Wlow = T32(Wlow + 1)) == 0) \
-			Whigh = T32(Whigh + 1); \
+		if ((Wlow = SPH_T32(Wlow + 1)) == 0) \
+			Whigh = SPH_T32(Whigh + 1); \
 	} while (0)
 
 __constant static const sph_u32 A_init_192[] = {
@@ -383,18 +412,22 @@ __constant static const sph_u32 C_init_512[] = {
 /* Johnny's optimised nonce calculation kernel 
  * based on the implementation found in BRS
  */
-__kernel void noncegen(__global unsigned char* buffer, unsigned long startnonce, unsigned long numeric_id_be, int start, int end, unsigned long nonces) {
-	//if (gid==0) {printf("\n\nOCL 2 %lu\n\n",startnonce);} DEBUG
-	int gid = get_global_id(0);
-
-	if (gid >= nonces)
-		return;
+// hashes [start, end] of the 8192 hashes of the nonces nonce.. of work item gid
+inline void generate(__global unsigned char* buffer, int gid, unsigned long nonce, unsigned long numeric_id_be, int start, int end) {
+	__global sph_u32* words = (__global sph_u32*)buffer;
+	// the nonces of a work item are neighbours in the interleaved buffer
+	int slot = gid * NONCES_PER_ITEM;
 	// number of shabal message round
 	int num; 
 	// buffer for final hash
-	sph_u32 B8,B9,BA,BB,BC,BD,BE,BF;
-	// init
-	unsigned long nonce_be = EndianSwap64(startnonce + gid);
+	state_t B8,B9,BA,BB,BC,BD,BE,BF;
+	// init, big endian nonce of every lane
+	state_t nonce_lo, nonce_hi;
+	for (int k = 0; k < NONCES_PER_ITEM; k++) {
+		unsigned long nonce_be = EndianSwap64(nonce + k);
+		((sph_u32*)&nonce_lo)[k] = ((unsigned int*)&nonce_be)[0];
+		((sph_u32*)&nonce_hi)[k] = ((unsigned int*)&nonce_be)[1];
+	}
 	// run 8192 rounds + final round 
 	for (int hash = NUM_HASHES - start; hash > -1 + NUM_HASHES - end; hash -= 1) {
 		// calculate number of shabal messages excl. final message
@@ -404,40 +437,40 @@ __kernel void noncegen(__global unsigned char* buffer, unsigned long startnonce,
 		} 
 
 		// init shabal
-        sph_u32
+        state_t
             A00 = A_init_256[0], A01 = A_init_256[1], A02 = A_init_256[2], A03 = A_init_256[3],
             A04 = A_init_256[4], A05 = A_init_256[5], A06 = A_init_256[6], A07 = A_init_256[7],
             A08 = A_init_256[8], A09 = A_init_256[9], A0A = A_init_256[10], A0B = A_init_256[11];
-        sph_u32
+        state_t
             B0 = B_init_256[0], B1 = B_init_256[1], B2 = B_init_256[2], B3 = B_init_256[3],
             B4 = B_init_256[4], B5 = B_init_256[5], B6 = B_init_256[6], B7 = B_init_256[7];
             B8 = B_init_256[8]; B9 = B_init_256[9]; BA = B_init_256[10]; BB = B_init_256[11];
             BC = B_init_256[12]; BD = B_init_256[13]; BE = B_init_256[14]; BF = B_init_256[15];
-        sph_u32
+        state_t
             C0 = C_init_256[0], C1 = C_init_256[1], C2 = C_init_256[2], C3 = C_init_256[3],
             C4 = C_init_256[4], C5 = C_init_256[5], C6 = C_init_256[6], C7 = C_init_256[7],
             C8 = C_init_256[8], C9 = C_init_256[9], CA = C_init_256[10], CB = C_init_256[11],
             CC = C_init_256[12], CD = C_init_256[13], CE = C_init_256[14], CF = C_init_256[15];
-        sph_u32 M0, M1, M2, M3, M4, M5, M6, M7, M8, M9, MA, MB, MC, MD, ME, MF;
+        state_t M0, M1, M2, M3, M4, M5, M6, M7, M8, M9, MA, MB, MC, MD, ME, MF;
         sph_u32 Wlow = 1, Whigh = 0;
 	
 		for (int i = 0; i < 2 * num; i+=2){
-			M0 = ((__global unsigned int*)buffer)[Address(gid, hash + i, 0)];
-			M1 = ((__global unsigned int*)buffer)[Address(gid, hash + i, 1)];
-			M2 = ((__global unsigned int*)buffer)[Address(gid, hash + i, 2)];
-			M3 = ((__global unsigned int*)buffer)[Address(gid, hash + i, 3)];
-			M4 = ((__global unsigned int*)buffer)[Address(gid, hash + i, 4)];
-			M5 = ((__global unsigned int*)buffer)[Address(gid, hash + i, 5)];
-			M6 = ((__global unsigned int*)buffer)[Address(gid, hash + i, 6)];
-			M7 = ((__global unsigned int*)buffer)[Address(gid, hash + i, 7)];
-			M8 = ((__global unsigned int*)buffer)[Address(gid, hash + i + 1, 0)];
-			M9 = ((__global unsigned int*)buffer)[Address(gid, hash + i + 1, 1)];
-			MA = ((__global unsigned int*)buffer)[Address(gid, hash + i + 1, 2)];
-			MB = ((__global unsigned int*)buffer)[Address(gid, hash + i + 1, 3)];
-			MC = ((__global unsigned int*)buffer)[Address(gid, hash + i + 1, 4)];
-			MD = ((__global unsigned int*)buffer)[Address(gid, hash + i + 1, 5)];
-			ME = ((__global unsigned int*)buffer)[Address(gid, hash + i + 1, 6)];
-			MF = ((__global unsigned int*)buffer)[Address(gid, hash + i + 1, 7)];
+			M0 = LOAD(words + Address(slot, hash + i, 0));
+			M1 = LOAD(words + Address(slot, hash + i, 1));
+			M2 = LOAD(words + Address(slot, hash + i, 2));
+			M3 = LOAD(words + Address(slot, hash + i, 3));
+			M4 = LOAD(words + Address(slot, hash + i, 4));
+			M5 = LOAD(words + Address(slot, hash + i, 5));
+			M6 = LOAD(words + Address(slot, hash + i, 6));
+			M7 = LOAD(words + Address(slot, hash + i, 7));
+			M8 = LOAD(words + Address(slot, hash + i + 1, 0));
+			M9 = LOAD(words + Address(slot, hash + i + 1, 1));
+			MA = LOAD(words + Address(slot, hash + i + 1, 2));
+			MB = LOAD(words + Address(slot, hash + i + 1, 3));
+			MC = LOAD(words + Address(slot, hash + i + 1, 4));
+			MD = LOAD(words + Address(slot, hash + i + 1, 5));
+			ME = LOAD(words + Address(slot, hash + i + 1, 6));
+			MF = LOAD(words + Address(slot, hash + i + 1, 7));
 
     		INPUT_BLOCK_ADD;
     		XOR_W;
@@ -455,24 +488,24 @@ __kernel void noncegen(__global unsigned char* buffer, unsigned long startnonce,
         else if((hash & 1) == 0) {
             M0 = ((unsigned int*)&numeric_id_be)[0];
             M1 = ((unsigned int*)&numeric_id_be)[1];
-            M2 = ((unsigned int*)&nonce_be)[0];
-            M3 = ((unsigned int*)&nonce_be)[1];
+            M2 = nonce_lo;
+            M3 = nonce_hi;
             M4 = 0x80;
             M5 = M6 = M7 = M8 = M9 = MA = MB = MC = MD = ME = MF = 0;
         }
         else if((hash & 1) == 1) {
-            M0 = ((__global unsigned int*)buffer)[Address(gid, NUM_HASHES-1, 0)];
-            M1 = ((__global unsigned int*)buffer)[Address(gid, NUM_HASHES-1, 1)];
-            M2 = ((__global unsigned int*)buffer)[Address(gid, NUM_HASHES-1, 2)];
-            M3 = ((__global unsigned int*)buffer)[Address(gid, NUM_HASHES-1, 3)];
-            M4 = ((__global unsigned int*)buffer)[Address(gid, NUM_HASHES-1, 4)];
-            M5 = ((__global unsigned int*)buffer)[Address(gid, NUM_HASHES-1, 5)];
-            M6 = ((__global unsigned int*)buffer)[Address(gid, NUM_HASHES-1, 6)];
-            M7 = ((__global unsigned int*)buffer)[Address(gid, NUM_HASHES-1, 7)];
+            M0 = LOAD(words + Address(slot, NUM_HASHES-1, 0));
+            M1 = LOAD(words + Address(slot, NUM_HASHES-1, 1));
+            M2 = LOAD(words + Address(slot, NUM_HASHES-1, 2));
+            M3 = LOAD(words + Address(slot, NUM_HASHES-1, 3));
+            M4 = LOAD(words + Address(slot, NUM_HASHES-1, 4));
+            M5 = LOAD(words + Address(slot, NUM_HASHES-1, 5));
+            M6 = LOAD(words + Address(slot, NUM_HASHES-1, 6));
+            M7 = LOAD(words + Address(slot, NUM_HASHES-1, 7));
             M8 = ((unsigned int*)&numeric_id_be)[0];
             M9 = ((unsigned int*)&numeric_id_be)[1];
-            MA = ((unsigned int*)&nonce_be)[0];
-            MB = ((unsigned int*)&nonce_be)[1];
+            MA = nonce_lo;
+            MB = nonce_hi;
             MC = 0x80;
             MD = ME = MF = 0;
 		}
@@ -487,50 +520,61 @@ __kernel void noncegen(__global unsigned char* buffer, unsigned long startnonce,
     	}
 
 		if (hash > 0){
-			((__global unsigned int*)buffer)[Address(gid, hash-1, 0)] = B8;		
-			((__global unsigned int*)buffer)[Address(gid, hash-1, 1)] = B9;
-			((__global unsigned int*)buffer)[Address(gid, hash-1, 2)] = BA;
-			((__global unsigned int*)buffer)[Address(gid, hash-1, 3)] = BB;
-			((__global unsigned int*)buffer)[Address(gid, hash-1, 4)] = BC;
-			((__global unsigned int*)buffer)[Address(gid, hash-1, 5)] = BD;
-			((__global unsigned int*)buffer)[Address(gid, hash-1, 6)] = BE;
-			((__global unsigned int*)buffer)[Address(gid, hash-1, 7)] = BF;	
+			STORE(B8, words + Address(slot, hash-1, 0));		
+			STORE(B9, words + Address(slot, hash-1, 1));
+			STORE(BA, words + Address(slot, hash-1, 2));
+			STORE(BB, words + Address(slot, hash-1, 3));
+			STORE(BC, words + Address(slot, hash-1, 4));
+			STORE(BD, words + Address(slot, hash-1, 5));
+			STORE(BE, words + Address(slot, hash-1, 6));
+			STORE(BF, words + Address(slot, hash-1, 7));	
 		}
 	}
 
 	// final xor 
 	if(end==8192){
 		for (size_t i = 0; i < NUM_HASHES; i++){ 
-			((__global unsigned int*)buffer)[Address(gid, i, 0)] ^= B8;
-			((__global unsigned int*)buffer)[Address(gid, i, 1)] ^= B9;
-			((__global unsigned int*)buffer)[Address(gid, i, 2)] ^= BA;
-			((__global unsigned int*)buffer)[Address(gid, i, 3)] ^= BB;
-			((__global unsigned int*)buffer)[Address(gid, i, 4)] ^= BC;
-			((__global unsigned int*)buffer)[Address(gid, i, 5)] ^= BD;
-			((__global unsigned int*)buffer)[Address(gid, i, 6)] ^= BE;
-			((__global unsigned int*)buffer)[Address(gid, i, 7)] ^= BF;
+			XOR_STORE(B8, words + Address(slot, i, 0));
+			XOR_STORE(B9, words + Address(slot, i, 1));
+			XOR_STORE(BA, words + Address(slot, i, 2));
+			XOR_STORE(BB, words + Address(slot, i, 3));
+			XOR_STORE(BC, words + Address(slot, i, 4));
+			XOR_STORE(BD, words + Address(slot, i, 5));
+			XOR_STORE(BE, words + Address(slot, i, 6));
+			XOR_STORE(BF, words + Address(slot, i, 7));
 		}
 	}
 }
 
-__kernel void calculate_deadlines(__global unsigned char* gen_sig, __global unsigned char* scoop_data, __global unsigned long* deadlines, unsigned long scoop) {
-    int gid = get_global_id(0);
+__kernel void noncegen(__global unsigned char* buffer, unsigned long startnonce, unsigned long numeric_id_be, int start, int end, unsigned long nonces) {
+	//if (gid==0) {printf("\n\nOCL 2 %lu\n\n",startnonce);} DEBUG
+	int gid = get_global_id(0);
+
+	if (gid * NONCES_PER_ITEM >= nonces)
+		return;
+	generate(buffer, gid, startnonce + gid * NONCES_PER_ITEM, numeric_id_be, start, end);
+}
 
-        sph_u32
+// deadlines of the nonces of work item gid
+inline void deadline(__global unsigned char* gen_sig, __global unsigned char* scoop_data, int gid, unsigned long scoop, unsigned long* deadlines) {
+    __global sph_u32* words = (__global sph_u32*)scoop_data;
+    int slot = gid * NONCES_PER_ITEM;
+
+        state_t
             A00 = A_init_256[0], A01 = A_init_256[1], A02 = A_init_256[2], A03 = A_init_256[3],
             A04 = A_init_256[4], A05 = A_init_256[5], A06 = A_init_256[6], A07 = A_init_256[7],
             A08 = A_init_256[8], A09 = A_init_256[9], A0A = A_init_256[10], A0B = A_init_256[11];
-        sph_u32
+        state_t
             B0 = B_init_256[0], B1 = B_init_256[1], B2 = B_init_256[2], B3 = B_init_256[3],
             B4 = B_init_256[4], B5 = B_init_256[5], B6 = B_init_256[6], B7 = B_init_256[7],
             B8 = B_init_256[8], B9 = B_init_256[9], BA = B_init_256[10], BB = B_init_256[11],
             BC = B_init_256[12], BD = B_init_256[13], BE = B_init_256[14], BF = B_init_256[15];
-        sph_u32
+        state_t
             C0 = C_init_256[0], C1 = C_init_256[1], C2 = C_init_256[2], C3 = C_init_256[3],
             C4 = C_init_256[4], C5 = C_init_256[5], C6 = C_init_256[6], C7 = C_init_256[7],
             C8 = C_init_256[8], C9 = C_init_256[9], CA = C_init_256[10], CB = C_init_256[11],
             CC = C_init_256[12], CD = C_init_256[13], CE = C_init_256[14], CF = C_init_256[15];
-        sph_u32 M0, M1, M2, M3, M4, M5, M6, M7, M8, M9, MA, MB, MC, MD, ME, MF;
+        state_t M0, M1, M2, M3, M4, M5, M6, M7, M8, M9, MA, MB, MC, MD, ME, MF;
         sph_u32 Wlow = 1, Whigh = 0;
 
 	M0 = ((__global unsigned int*)gen_sig)[0];
@@ -542,14 +586,14 @@ __kernel void calculate_deadlines(__global unsigned char* gen_sig, __global unsi
 	M6 = ((__global unsigned int*)gen_sig)[6];
 	M7 = ((__global unsigned int*)gen_sig)[7];
 
-	M8 = ((__global unsigned int*)scoop_data)[Address(gid, 2*scoop, 0)];
-	M9 = ((__global unsigned int*)scoop_data)[Address(gid, 2*scoop, 1)];
-	MA = ((__global unsigned int*)scoop_data)[Address(gid, 2*scoop, 2)];
-	MB = ((__global unsigned int*)scoop_data)[Address(gid, 2*scoop, 3)];
-	MC = ((__global unsigned int*)scoop_data)[Address(gid, 2*scoop, 4)];
-	MD = ((__global unsigned int*)scoop_data)[Address(gid, 2*scoop, 5)];
-	ME = ((__global unsigned int*)scoop_data)[Address(gid, 2*scoop, 6)];
-	MF = ((__global unsigned int*)scoop_data)[Address(gid, 2*scoop, 7)];
+	M8 = LOAD(words + Address(slot, 2*scoop, 0));
+	M9 = LOAD(words + Address(slot, 2*scoop, 1));
+	MA = LOAD(words + Address(slot, 2*scoop, 2));
+	MB = LOAD(words + Address(slot, 2*scoop, 3));
+	MC = LOAD(words + Address(slot, 2*scoop, 4));
+	MD = LOAD(words + Address(slot, 2*scoop, 5));
+	ME = LOAD(words + Address(slot, 2*scoop, 6));
+	MF = LOAD(words + Address(slot, 2*scoop, 7));
 
     INPUT_BLOCK_ADD;
     XOR_W;
@@ -558,14 +602,14 @@ __kernel void calculate_deadlines(__global unsigned char* gen_sig, __global unsi
     SWAP_BC;
     INCR_W;
 
-    M0 = ((__global unsigned int*)scoop_data)[Address(gid, 2 * (4095-scoop) + 1, 0)];
-	M1 = ((__global unsigned int*)scoop_data)[Address(gid, 2 * (4095-scoop) + 1, 1)];
-	M2 = ((__global unsigned int*)scoop_data)[Address(gid, 2 * (4095-scoop) + 1, 2)];
-	M3 = ((__global unsigned int*)scoop_data)[Address(gid, 2 * (4095-scoop) + 1, 3)];
-	M4 = ((__global unsigned int*)scoop_data)[Address(gid, 2 * (4095-scoop) + 1, 4)];
-	M5 = ((__global unsigned int*)scoop_data)[Address(gid, 2 * (4095-scoop) + 1, 5)];
-	M6 = ((__global unsigned int*)scoop_data)[Address(gid, 2 * (4095-scoop) + 1, 6)];
-	M7 = ((__global unsigned int*)scoop_data)[Address(gid, 2 * (4095-scoop) + 1, 7)];
+    M0 = LOAD(words + Address(slot, 2 * (4095-scoop) + 1, 0));
+	M1 = LOAD(words + Address(slot, 2 * (4095-scoop) + 1, 1));
+	M2 = LOAD(words + Address(slot, 2 * (4095-scoop) + 1, 2));
+	M3 = LOAD(words + Address(slot, 2 * (4095-scoop) + 1, 3));
+	M4 = LOAD(words + Address(slot, 2 * (4095-scoop) + 1, 4));
+	M5 = LOAD(words + Address(slot, 2 * (4095-scoop) + 1, 5));
+	M6 = LOAD(words + Address(slot, 2 * (4095-scoop) + 1, 6));
+	M7 = LOAD(words + Address(slot, 2 * (4095-scoop) + 1, 7));
 	
 	M8 = 0x80;
 	M9 = MA = MB = MC = MD = ME = MF = 0;
@@ -579,11 +623,134 @@ __kernel void calculate_deadlines(__global unsigned char* gen_sig, __global unsi
         APPLY_P;
     }
 
-    unsigned int deadline[2];
-	deadline[0] = B8;
-	deadline[1] = B9;
+    for (int k = 0; k < NONCES_PER_ITEM; k++) {
+        unsigned int result[2];
+        result[0] = ((sph_u32*)&B8)[k];
+        result[1] = ((sph_u32*)&B9)[k];
+        deadlines[k] = *((unsigned long*)result);
+    }
+}
+
+__kernel void calculate_deadlines(__global unsigned char* gen_sig, __global unsigned char* scoop_data, __global unsigned long* deadlines, unsigned long scoop) {
+    int gid = get_global_id(0);
+    unsigned long d[NONCES_PER_ITEM];
+    deadline(gen_sig, scoop_data, gid, scoop, d);
+    for (int k = 0; k < NONCES_PER_ITEM; k++)
+        deadlines[gid * NONCES_PER_ITEM + k] = d[k];
+}
+
+/* Deadlines of scoops supplied by the host instead of buffer_gpu, e.g. a region of the nonce
+ * cache: count 64 byte entries of the first hash of the scoop followed by the second hash of
+ * its mirror scoop, in groups of `lanes` nonces.
+ */
+__kernel void calculate_deadlines_sm(__global unsigned char* gen_sig, __global unsigned char* scoops, __global unsigned long* deadlines, unsigned long count, unsigned long lanes) {
+	unsigned long first = (unsigned long)get_global_id(0) * NONCES_PER_ITEM;
+	if (first >= count)
+		return;
+	// lanes past count read stale entries of the buffer, their deadlines aren't stored
+	__global sph_u32* words = (__global sph_u32*)scoops;
+	// the entries of `lanes` nonces are interleaved word by word like in the nonce cache,
+	// word w of nonce n is at (n / lanes) * 16 * lanes + w * lanes + n % lanes
+	unsigned long base[NONCES_PER_ITEM];
+	for (int k = 0; k < NONCES_PER_ITEM; k++)
+		base[k] = (first + k) / lanes * 16 * lanes + (first + k) % lanes;
+
+        state_t
+            A00 = A_init_256[0], A01 = A_init_256[1], A02 = A_init_256[2], A03 = A_init_256[3],
+            A04 = A_init_256[4], A05 = A_init_256[5], A06 = A_init_256[6], A07 = A_init_256[7],
+            A08 = A_init_256[8], A09 = A_init_256[9], A0A = A_init_256[10], A0B = A_init_256[11];
+        state_t
+            B0 = B_init_256[0], B1 = B_init_256[1], B2 = B_init_256[2], B3 = B_init_256[3],
+            B4 = B_init_256[4], B5 = B_init_256[5], B6 = B_init_256[6], B7 = B_init_256[7],
+            B8 = B_init_256[8], B9 = B_init_256[9], BA = B_init_256[10], BB = B_init_256[11],
+            BC = B_init_256[12], BD = B_init_256[13], BE = B_init_256[14], BF = B_init_256[15];
+        state_t
+            C0 = C_init_256[0], C1 = C_init_256[1], C2 = C_init_256[2], C3 = C_init_256[3],
+            C4 = C_init_256[4], C5 = C_init_256[5], C6 = C_init_256[6], C7 = C_init_256[7],
+            C8 = C_init_256[8], C9 = C_init_256[9], CA = C_init_256[10], CB = C_init_256[11],
+            CC = C_init_256[12], CD = C_init_256[13], CE = C_init_256[14], CF = C_init_256[15];
+        state_t M0, M1, M2, M3, M4, M5, M6, M7, M8, M9, MA, MB, MC, MD, ME, MF;
+        sph_u32 Wlow = 1, Whigh = 0;
+
+	M0 = ((__global unsigned int*)gen_sig)[0];
+	M1 = ((__global unsigned int*)gen_sig)[1];
+	M2 = ((__global unsigned int*)gen_sig)[2];
+	M3 = ((__global unsigned int*)gen_sig)[3];
+	M4 = ((__global unsigned int*)gen_sig)[4];
+	M5 = ((__global unsigned int*)gen_sig)[5];
+	M6 = ((__global unsigned int*)gen_sig)[6];
+	M7 = ((__global unsigned int*)gen_sig)[7];
+
+	M8 = LOAD_SCOOPS(words, base, 0, lanes);
+	M9 = LOAD_SCOOPS(words, base, 1, lanes);
+	MA = LOAD_SCOOPS(words, base, 2, lanes);
+	MB = LOAD_SCOOPS(words, base, 3, lanes);
+	MC = LOAD_SCOOPS(words, base, 4, lanes);
+	MD = LOAD_SCOOPS(words, base, 5, lanes);
+	ME = LOAD_SCOOPS(words, base, 6, lanes);
+	MF = LOAD_SCOOPS(words, base, 7, lanes);
+
+    INPUT_BLOCK_ADD;
+    XOR_W;
+    APPLY_P;
+    INPUT_BLOCK_SUB;
+    SWAP_BC;
+    INCR_W;
+
+	M0 = LOAD_SCOOPS(words, base, 8, lanes);
+	M1 = LOAD_SCOOPS(words, base, 9, lanes);
+	M2 = LOAD_SCOOPS(words, base, 10, lanes);
+	M3 = LOAD_SCOOPS(words, base, 11, lanes);
+	M4 = LOAD_SCOOPS(words, base, 12, lanes);
+	M5 = LOAD_SCOOPS(words, base, 13, lanes);
+	M6 = LOAD_SCOOPS(words, base, 14, lanes);
+	M7 = LOAD_SCOOPS(words, base, 15, lanes);
+
+	M8 = 0x80;
+	M9 = MA = MB = MC = MD = ME = MF = 0;
+
+    INPUT_BLOCK_ADD;
+    XOR_W;
+    APPLY_P;
+    for (unsigned i = 0; i < 3; i ++) {
+        SWAP_BC;
+        XOR_W;
+        APPLY_P;
+    }
+
+    for (int k = 0; k < NONCES_PER_ITEM && first + k < count; k++) {
+        unsigned int result[2];
+        result[0] = ((sph_u32*)&B8)[k];
+        result[1] = ((sph_u32*)&B9)[k];
+        deadlines[first + k] = *((unsigned long*)result);
+    }
+}
 
-    deadlines[gid] = *((unsigned long*)deadline);
+/* Persistent variant of noncegen, calculate_deadlines and find_min: launched once per task,
+ * every work item pulls groups of nonces from the shared counter until the task is done, hashes each
+ * one completely in its own buffer slot and keeps its best deadline. The host reduces the
+ * per work item results, best[gid] is the deadline and best[size + gid] its offset.
+ */
+__kernel void noncegen_persistent(__global unsigned char* buffer, __global unsigned char* gen_sig, unsigned long startnonce, unsigned long numeric_id_be, unsigned long nonces, unsigned long scoop, volatile __global unsigned int* next, __global unsigned long* best) {
+	int gid = get_global_id(0);
+	int size = get_global_size(0);
+	unsigned long best_deadline = 0xFFFFFFFFFFFFFFFFUL;
+	unsigned long best_offset = 0;
+
+	for (unsigned int i = atomic_inc(next); (unsigned long)i * NONCES_PER_ITEM < nonces; i = atomic_inc(next)) {
+		unsigned long first = (unsigned long)i * NONCES_PER_ITEM;
+		unsigned long d[NONCES_PER_ITEM];
+		generate(buffer, gid, startnonce + first, numeric_id_be, 0, NUM_HASHES);
+		deadline(gen_sig, buffer, gid, scoop, d);
+		for (int k = 0; k < NONCES_PER_ITEM && first + k < nonces; k++) {
+			if (d[k] < best_deadline) {
+				best_deadline = d[k];
+				best_offset = first + k;
+			}
+		}
+	}
+	best[gid] = best_deadline;
+	best[size + gid] = best_offset;
 }
 
 __kernel void find_min(__global unsigned long* deadlines, unsigned long count, __local unsigned int* lbest_offset, __global unsigned long* best_offset, __global unsigned long* best_deadline) {
@@ -0,0 +1,353 @@
+//! Hardware performance counters around the cpu hashing kernels.
+//!
+//! With `perf_counters` enabled every cpu worker opens a set of perf events for its own thread
+//! and samples them around noncegen and deadline search. Totals are reported per nonce at the
+//! start of every round. If the kernel doesn't allow perf events (perf_event_paranoid,
+//! containers, non-linux) bencher logs a warning and hashes without them. L2 misses have no
+//! generic perf event and are therefore not sampled.
+
+use std::cell::RefCell;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+
+#[derive(Clone, Copy)]
+pub enum Phase {
+    Noncegen = 0,
+    Deadline = 1,
+}
+
+const PHASES: [(Phase, &str); 2] = [(Phase::Noncegen, "noncegen"), (Phase::Deadline, "deadline")];
+
+// cycles, instructions, l1d read misses, llc read misses, dtlb read misses
+const COUNTERS: usize = 5;
+// counters + nonces + nanoseconds
+const SLOTS: usize = COUNTERS + 2;
+const NONCES: usize = COUNTERS;
+const NANOS: usize = COUNTERS + 1;
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+
+// per phase: counter totals, nonces and nanoseconds spent
+static TOTALS: [[AtomicU64; SLOTS]; 2] = [
+    [
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+    ],
+    [
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+        AtomicU64::new(0),
+    ],
+];
+
+// counters that could be opened, a counter missing on one thread is missing everywhere
+static AVAILABLE: [AtomicBool; COUNTERS] = [
+    AtomicBool::new(true),
+    AtomicBool::new(true),
+    AtomicBool::new(true),
+    AtomicBool::new(true),
+    AtomicBool::new(true),
+];
+
+thread_local! {
+    static THREAD_COUNTERS: RefCell<Option<sys::CounterSet>> = RefCell::new(None);
+}
+
+/// Probes perf events on the calling thread and enables sampling if they work.
+pub fn init(enable: bool) {
+    if !enable {
+        return;
+    }
+    match sys::CounterSet::open() {
+        Ok(_) => {
+            ENABLED.store(true, Ordering::Release);
+            info!("perf counters enabled");
+        }
+        Err(e) => warn!("perf counters unavailable, disabled: {}", e),
+    }
+}
+
+#[inline]
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Acquire)
+}
+
+/// Runs `f` and accounts the counters of the current thread to `phase`.
+pub fn measure<F: FnOnce() -> R, R>(phase: Phase, nonces: u64, f: F) -> R {
+    if !enabled() {
+        return f();
+    }
+    THREAD_COUNTERS.with(|counters| {
+        let mut counters = counters.borrow_mut();
+        if counters.is_none() {
+            match sys::CounterSet::open() {
+                Ok(x) => *counters = Some(x),
+                Err(e) => {
+                    warn!("perf counters unavailable on worker thread: {}", e);
+                    ENABLED.store(false, Ordering::Release);
+                    return f();
+                }
+            }
+        }
+        let set = counters.as_mut().unwrap();
+        set.start();
+        let start = std::time::Instant::now();
+        let result = f();
+        let elapsed = start.elapsed();
+        let values = set.stop();
+
+        let totals = &TOTALS[phase as usize];
+        for (i, value) in values.iter().enumerate() {
+            match value {
+                Some(x) => {
+                    totals[i].fetch_add(*x, Ordering::Relaxed);
+                }
+                None => AVAILABLE[i].store(false, Ordering::Relaxed),
+            }
+        }
+        totals[NONCES].fetch_add(nonces, Ordering::Relaxed);
+        totals[NANOS].fetch_add(
+            elapsed.as_secs() * 1_000_000_000 + u64::from(elapsed.subsec_nanos()),
+            Ordering::Relaxed,
+        );
+        result
+    })
+}
+
+/// Logs the counters per nonce since the last report and resets them.
+pub fn report(elapsed_ms: i64) {
+    if !enabled() {
+        return;
+    }
+    for (phase, name) in PHASES.iter() {
+        let totals = &TOTALS[*phase as usize];
+        let mut values = [0u64; SLOTS];
+        for (i, value) in values.iter_mut().enumerate() {
+            *value = totals[i].swap(0, Ordering::Relaxed);
+        }
+        if values[NONCES] == 0 {
+            continue;
+        }
+        info!("{: <80}", format_report(name, &values, elapsed_ms));
+    }
+}
+
+fn format_report(name: &str, values: &[u64; SLOTS], elapsed_ms: i64) -> String {
+    let nonces = values[NONCES] as f64;
+    let per_nonce = |i: usize| {
+        if AVAILABLE[i].load(Ordering::Relaxed) {
+            format!("{:.0}", values[i] as f64 / nonces)
+        } else {
+            "n/a".to_owned()
+        }
+    };
+    let ipc = if values[0] > 0 && AVAILABLE[0].load(Ordering::Relaxed) {
+        format!("{:.2}", values[1] as f64 / values[0] as f64)
+    } else {
+        "n/a".to_owned()
+    };
+    // every llc miss is a 64 byte line coming from dram
+    let bandwidth = if AVAILABLE[3].load(Ordering::Relaxed) {
+        format!(
+            "{:.2}GB/s",
+            values[3] as f64 * 64.0 / (1 + elapsed_ms) as f64 / 1_000_000.0
+        )
+    } else {
+        "n/a".to_owned()
+    };
+    format!(
+        "perf {}: nonces={}, cycles/nonce={}, instr/nonce={}, ipc={}, l1d_miss/nonce={}, \
+         llc_miss/nonce={}, dtlb_miss/nonce={}, dram={}, busy={}ms",
+        name,
+        values[NONCES],
+        per_nonce(0),
+        per_nonce(1),
+        ipc,
+        per_nonce(2),
+        per_nonce(3),
+        per_nonce(4),
+        bandwidth,
+        values[NANOS] / 1_000_000,
+    )
+}
+
+#[cfg(all(target_os = "linux", target_arch = "x86_64"))]
+mod sys {
+    use super::COUNTERS;
+    use libc::{c_int, c_long, c_ulong};
+    use std::fs::File;
+    use std::io::{self, Read};
+    use std::os::unix::io::{AsRawFd, FromRawFd};
+
+    const SYS_PERF_EVENT_OPEN: c_long = 298;
+
+    const PERF_TYPE_HARDWARE: u32 = 0;
+    const PERF_TYPE_HW_CACHE: u32 = 3;
+    const PERF_COUNT_HW_CPU_CYCLES: u64 = 0;
+    const PERF_COUNT_HW_INSTRUCTIONS: u64 = 1;
+    const PERF_COUNT_HW_CACHE_L1D: u64 = 0;
+    const PERF_COUNT_HW_CACHE_LL: u64 = 2;
+    const PERF_COUNT_HW_CACHE_DTLB: u64 = 3;
+    const PERF_COUNT_HW_CACHE_OP_READ: u64 = 0;
+    const PERF_COUNT_HW_CACHE_RESULT_MISS: u64 = 1;
+
+    const PERF_EVENT_IOC_ENABLE: c_ulong = 0x2400;
+    const PERF_EVENT_IOC_DISABLE: c_ulong = 0x2401;
+    const PERF_EVENT_IOC_RESET: c_ulong = 0x2403;
+
+    // attr.flags: disabled, exclude_kernel, exclude_hv
+    const FLAGS: u64 = 1 | 1 << 5 | 1 << 6;
+
+    extern "C" {
+        fn syscall(num: c_long, ...) -> c_long;
+        fn ioctl(fd: c_int, request: c_ulong, ...) -> c_int;
+    }
+
+    // perf_event_attr up to config2 (PERF_ATTR_SIZE_VER1)
+    #[repr(C)]
+    #[derive(Default)]
+    struct PerfEventAttr {
+        type_: u32,
+        size: u32,
+        config: u64,
+        sample_period: u64,
+        sample_type: u64,
+        read_format: u64,
+        flags: u64,
+        wakeup_events: u32,
+        bp_type: u32,
+        config1: u64,
+        config2: u64,
+    }
+
+    fn cache_event(cache: u64) -> u64 {
+        cache | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16
+    }
+
+    const EVENTS: [(u32, u64); COUNTERS] = [
+        (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+        (PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS),
+        (PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D),
+        (PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL),
+        (PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB),
+    ];
+
+    fn open_event(type_: u32, config: u64) -> io::Result<File> {
+        let attr = PerfEventAttr {
+            type_,
+            size: std::mem::size_of::<PerfEventAttr>() as u32,
+            config: if type_ == PERF_TYPE_HW_CACHE {
+                cache_event(config)
+            } else {
+                config
+            },
+            flags: FLAGS,
+            ..Default::default()
+        };
+        // this thread, any cpu, no group, no flags
+        let fd = unsafe {
+            syscall(
+                SYS_PERF_EVENT_OPEN,
+                &attr as *const PerfEventAttr,
+                0 as c_int,
+                -1 as c_int,
+                -1 as c_int,
+                0 as c_ulong,
+            )
+        };
+        if fd < 0 {
+            Err(io::Error::last_os_error())
+        } else {
+            Ok(unsafe { File::from_raw_fd(fd as c_int) })
+        }
+    }
+
+    pub struct CounterSet {
+        events: Vec<Option<File>>,
+    }
+
+    impl CounterSet {
+        /// Fails if not even the cycle counter can be opened.
+        pub fn open() -> io::Result<Self> {
+            let mut events = Vec::with_capacity(COUNTERS);
+            for (i, (type_, config)) in EVENTS.iter().enumerate() {
+                match open_event(*type_, *config) {
+                    Ok(x) => events.push(Some(x)),
+                    Err(e) if i == 0 => return Err(e),
+                    Err(_) => events.push(None),
+                }
+            }
+            Ok(CounterSet { events })
+        }
+
+        pub fn start(&mut self) {
+            for event in self.events.iter().flatten() {
+                unsafe {
+                    ioctl(event.as_raw_fd(), PERF_EVENT_IOC_RESET, 0);
+                    ioctl(event.as_raw_fd(), PERF_EVENT_IOC_ENABLE, 0);
+                }
+            }
+        }
+
+        pub fn stop(&mut self) -> [Option<u64>; COUNTERS] {
+            let mut values = [None; COUNTERS];
+            for (i, event) in self.events.iter_mut().enumerate() {
+                if let Some(event) = event {
+                    unsafe {
+                        ioctl(event.as_raw_fd(), PERF_EVENT_IOC_DISABLE, 0);
+                    }
+                    let mut buf = [0u8; 8];
+                    if event.read_exact(&mut buf).is_ok() {
+                        values[i] = Some(u64::from_ne_bytes(buf));
+                    }
+                }
+            }
+            values
+        }
+    }
+}
+
+#[cfg(not(all(target_os = "linux", target_arch = "x86_64")))]
+mod sys {
+    use super::COUNTERS;
+    use std::io;
+
+    pub struct CounterSet;
+
+    impl CounterSet {
+        pub fn open() -> io::Result<Self> {
+            Err(io::Error::new(
+                io::ErrorKind::Other,
+                "perf events are only supported on x86_64 linux",
+            ))
+        }
+
+        pub fn start(&mut self) {}
+
+        pub fn stop(&mut self) -> [Option<u64>; COUNTERS] {
+            [None; COUNTERS]
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_format_report() {
+        let values = [1000, 2000, 10, 4, 2, 2, 5_000_000];
+        let report = format_report("noncegen", &values, 999);
+        assert!(report.contains("cycles/nonce=500"));
+        assert!(report.contains("ipc=2.00"));
+        assert!(report.contains("busy=5ms"));
+    }
+}
@@ -0,0 +1,638 @@
+//! `bencher check-plot`: verifies PoC2 plot files against freshly generated nonces.
+//!
+//! Each disk gets its own reader thread, batches of nonces are read scoop by scoop (direct I/O
+//! where the OS supports it) and handed to verifier threads, which regenerate the nonces with
+//! the fastest available noncegen engine and compare every scoop. A batch costs one seek per
+//! scoop, full checks read batches as large as the memory allows to keep disks streaming.
+
+use crate::buffer::PageAlignedByteBuffer;
+use crate::cpu_hasher::{noncegen, SimdExtension, CPU_TASK_ALIGNMENT};
+use crate::poc_hashing::{poc2_scoop, NONCE_SIZE, NUM_SCOOPS, SCOOP_SIZE};
+use crossbeam_channel::{bounded, unbounded, Sender};
+use rand::Rng;
+use std::collections::HashMap;
+use std::fs::{self, File};
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::thread;
+use stopwatch::Stopwatch;
+
+// nonces per sampled batch, 64 * 64 bytes keeps reads of a scoop row 4KiB aligned
+const BATCH_NONCES: u64 = 64;
+// largest batch, its scoop rows are 512KiB
+const MAX_BATCH_NONCES: u64 = 8192;
+// a sample is spread over at least this many batches
+const SAMPLE_BATCHES: u64 = 64;
+const ALIGNMENT: u64 = 4096;
+// width of the printed corruption map
+const MAP_WIDTH: u64 = 64;
+
+pub struct PlotFile {
+    path: PathBuf,
+    numeric_id: u64,
+    start_nonce: u64,
+    nonces: u64,
+}
+
+impl PlotFile {
+    /// Parses a PoC2 file name: `<numeric_id>_<start_nonce>_<nonces>`.
+    pub fn new(path: &Path) -> Result<PlotFile, String> {
+        let name = path
+            .file_name()
+            .and_then(|x| x.to_str())
+            .ok_or_else(|| "invalid file name".to_owned())?;
+        let parts: Vec<&str> = name.split('_').collect();
+        if parts.len() != 3 {
+            return Err("not a PoC2 plot file (expected <id>_<start>_<nonces>)".to_owned());
+        }
+        let parse = |x: &str| x.parse::<u64>().map_err(|e| e.to_string());
+        let plot = PlotFile {
+            path: path.to_owned(),
+            numeric_id: parse(parts[0])?,
+            start_nonce: parse(parts[1])?,
+            nonces: parse(parts[2])?,
+        };
+        let size = fs::metadata(path).map_err(|e| e.to_string())?.len();
+        if size != plot.nonces * NONCE_SIZE as u64 {
+            return Err(format!(
+                "file size {} doesn't match {} nonces",
+                size, plot.nonces
+            ));
+        }
+        Ok(plot)
+    }
+}
+
+struct Batch {
+    file: usize,
+    first_nonce: u64,
+    nonces: u64,
+    // scoop major: scoop * nonces * 64 + nonce * 64
+    data: PageAlignedByteBuffer,
+}
+
+enum Report {
+    // (file, nonce offset in file, nonces)
+    Checked(usize, u64, u64),
+    // (file, nonce offset in file, corrupt scoops, first corrupt scoop)
+    Corrupt(usize, u64, u32, u32),
+    ReadError(usize, u64, String),
+}
+
+struct FileResult {
+    checked: u64,
+    // (nonce offset, number of corrupt scoops, first corrupt scoop)
+    corrupt: Vec<(u64, u32, u32)>,
+    checked_segments: Vec<bool>,
+    read_errors: u64,
+}
+
+/// Verifies all `files`. Checks `sample` random nonces per file or every nonce if `sample`
+/// is 0, with batch buffers of up to `memory` bytes. Returns true if no corruption was found.
+pub fn check_plots(
+    files: &[PathBuf],
+    sample: u64,
+    threads: usize,
+    simd_ext: SimdExtension,
+    memory: u64,
+) -> bool {
+    let mut plots = Vec::new();
+    for path in files {
+        match PlotFile::new(path) {
+            Ok(x) => plots.push(x),
+            Err(e) => error!("skipping {}: {}", path.display(), e),
+        }
+    }
+    if plots.is_empty() {
+        return false;
+    }
+
+    let sw = Stopwatch::start_new();
+    let plots = Arc::new(plots);
+    let mut results = check(&plots, sample, threads, &simd_ext, memory, &sw);
+
+    let mut ok = true;
+    for (plot, result) in plots.iter().zip(results.iter_mut()) {
+        ok &= print_result(plot, result);
+    }
+    let checked: u64 = results.iter().map(|x| x.checked).sum();
+    info!(
+        "{: <80}",
+        format!(
+            "check-plot done: nonces={}, {:.0} nonces/min, {}",
+            checked,
+            checked as f64 * 60_000.0 / (1 + sw.elapsed_ms()) as f64,
+            if ok {
+                "no corruption found"
+            } else {
+                "CORRUPTION FOUND"
+            }
+        )
+    );
+    ok
+}
+
+fn check(
+    plots: &Arc<Vec<PlotFile>>,
+    sample: u64,
+    threads: usize,
+    simd_ext: &SimdExtension,
+    memory: u64,
+    sw: &Stopwatch,
+) -> Vec<FileResult> {
+    // one reader per disk
+    let mut disks: HashMap<u64, Vec<(usize, u64, Vec<u64>)>> = HashMap::new();
+    for (i, plot) in plots.iter().enumerate() {
+        disks
+            .entry(device_id(&plot.path))
+            .or_insert_with(Vec::new)
+            .push((i, 0, Vec::new()));
+    }
+    let max_batch = max_batch_nonces(memory, threads, disks.len());
+    let mut total_nonces = 0;
+    let mut largest_batch = BATCH_NONCES;
+    for (i, batch, batches) in disks.values_mut().flat_map(|x| x.iter_mut()) {
+        let plot = &plots[*i];
+        let size = batch_nonces(sample, max_batch);
+        *batch = size;
+        *batches = select_batches(plot.nonces, sample, size);
+        total_nonces += batches
+            .iter()
+            .map(|&x| size.min(plot.nonces - x))
+            .sum::<u64>();
+        largest_batch = largest_batch.max(size);
+    }
+
+    info!(
+        "check-plot: files={}, disks={}, nonces={}, threads={}, batch={}, engine={:?}",
+        plots.len(),
+        disks.len(),
+        total_nonces,
+        threads,
+        largest_batch,
+        simd_ext
+    );
+
+    // one batch queued per verifier, max_batch_nonces accounts for it
+    let (tx_batch, rx_batch) = bounded::<Batch>(threads);
+    let (tx_report, rx_report) = unbounded::<Report>();
+
+    for (_, disk_files) in disks {
+        let plots = plots.clone();
+        let tx_batch = tx_batch.clone();
+        let tx_report = tx_report.clone();
+        thread::spawn(move || read_disk(&plots, disk_files, tx_batch, tx_report));
+    }
+    drop(tx_batch);
+
+    for _ in 0..threads {
+        let plots = plots.clone();
+        let rx_batch = rx_batch.clone();
+        let tx_report = tx_report.clone();
+        let simd_ext = simd_ext.clone();
+        thread::spawn(move || {
+            let buffer = PageAlignedByteBuffer::new(
+                round_up(largest_batch, CPU_TASK_ALIGNMENT) as usize * NONCE_SIZE,
+            );
+            let data = buffer.get_buffer();
+            let mut generated = data.lock().unwrap();
+            for batch in rx_batch {
+                verify_batch(&plots, &batch, &simd_ext, &mut generated, &tx_report);
+            }
+        });
+    }
+    drop(tx_report);
+
+    let mut results: Vec<FileResult> = plots
+        .iter()
+        .map(|_| FileResult {
+            checked: 0,
+            corrupt: Vec::new(),
+            checked_segments: vec![false; MAP_WIDTH as usize],
+            read_errors: 0,
+        })
+        .collect();
+    let mut checked = 0u64;
+    for report in rx_report {
+        match report {
+            Report::Checked(file, first_nonce, nonces) => {
+                let first = first_nonce * MAP_WIDTH / plots[file].nonces;
+                let last = (first_nonce + nonces - 1) * MAP_WIDTH / plots[file].nonces;
+                for segment in first..=last {
+                    results[file].checked_segments[segment as usize] = true;
+                }
+                results[file].checked += nonces;
+                checked += nonces;
+                print_progress(checked, total_nonces, sw);
+            }
+            Report::Corrupt(file, nonce, scoops, first_scoop) => {
+                results[file].corrupt.push((nonce, scoops, first_scoop))
+            }
+            Report::ReadError(file, first_nonce, e) => {
+                error!(
+                    "{: <80}",
+                    format!(
+                        "read error: file={}, nonce={}, err={}",
+                        plots[file].path.display(),
+                        plots[file].start_nonce + first_nonce,
+                        e
+                    )
+                );
+                results[file].read_errors += 1;
+            }
+        }
+    }
+    results
+}
+
+// The largest batch that fits into `memory`. Each verifier holds a queued batch, the one it
+// checks and the regenerated nonces, each reader the batch it reads.
+fn max_batch_nonces(memory: u64, threads: usize, disks: usize) -> u64 {
+    let buffers = 3 * threads as u64 + disks as u64;
+    let nonces = memory / buffers / NONCE_SIZE as u64 / BATCH_NONCES * BATCH_NONCES;
+    nonces.min(MAX_BATCH_NONCES).max(BATCH_NONCES)
+}
+
+// Nonces per batch, a sample is spread over SAMPLE_BATCHES batches, a full check reads the
+// largest ones.
+fn batch_nonces(sample: u64, max_batch: u64) -> u64 {
+    let nonces = if sample == 0 {
+        max_batch
+    } else {
+        round_up(sample / SAMPLE_BATCHES, BATCH_NONCES)
+    };
+    nonces.min(max_batch).max(BATCH_NONCES)
+}
+
+// offsets of the batches to check, sorted so that reads move forward on the disk
+fn select_batches(nonces: u64, sample: u64, batch: u64) -> Vec<u64> {
+    let batch_count = (nonces + batch - 1) / batch;
+    let wanted = if sample == 0 {
+        batch_count
+    } else {
+        ((sample + batch - 1) / batch).min(batch_count)
+    };
+    let mut batches: Vec<u64> = if wanted == batch_count {
+        (0..batch_count).collect()
+    } else {
+        let mut rng = rand::thread_rng();
+        let mut selected = std::collections::BTreeSet::new();
+        while (selected.len() as u64) < wanted {
+            selected.insert(rng.gen_range(0, batch_count));
+        }
+        selected.into_iter().collect()
+    };
+    for x in batches.iter_mut() {
+        *x *= batch;
+    }
+    batches
+}
+
+fn read_disk(
+    plots: &[PlotFile],
+    disk_files: Vec<(usize, u64, Vec<u64>)>,
+    tx_batch: Sender<Batch>,
+    tx_report: Sender<Report>,
+) {
+    // a scoop row of the largest batch plus alignment slack on both sides
+    let largest_batch = disk_files.iter().map(|x| x.1).max().unwrap_or(BATCH_NONCES);
+    let scratch =
+        PageAlignedByteBuffer::new((largest_batch * SCOOP_SIZE as u64 + 2 * ALIGNMENT) as usize);
+    let scratch = scratch.get_buffer();
+    let mut scratch = scratch.lock().unwrap();
+    for (file, batch, batches) in disk_files {
+        let plot = &plots[file];
+        let (handle, direct) = match open(&plot.path) {
+            Ok(x) => x,
+            Err(e) => {
+                for first_nonce in batches {
+                    let _ = tx_report.send(Report::ReadError(file, first_nonce, e.to_string()));
+                }
+                continue;
+            }
+        };
+        for first_nonce in batches {
+            let nonces = batch.min(plot.nonces - first_nonce);
+            let data = PageAlignedByteBuffer::new(nonces as usize * NONCE_SIZE);
+            let result = {
+                let buffer = data.get_buffer();
+                let mut buffer = buffer.lock().unwrap();
+                read_batch(
+                    &handle,
+                    direct,
+                    plot,
+                    first_nonce,
+                    nonces,
+                    &mut scratch,
+                    &mut buffer,
+                )
+            };
+            let res = match result {
+                Ok(()) => tx_batch
+                    .send(Batch {
+                        file,
+                        first_nonce,
+                        nonces,
+                        data,
+                    })
+                    .is_ok(),
+                Err(e) => tx_report
+                    .send(Report::ReadError(file, first_nonce, e.to_string()))
+                    .is_ok(),
+            };
+            if !res {
+                return;
+            }
+        }
+    }
+}
+
+fn read_batch(
+    handle: &File,
+    direct: bool,
+    plot: &PlotFile,
+    first_nonce: u64,
+    nonces: u64,
+    scratch: &mut [u8],
+    out: &mut [u8],
+) -> io::Result<()> {
+    let row = (nonces * SCOOP_SIZE as u64) as usize;
+    for scoop in 0..NUM_SCOOPS as u64 {
+        let offset = (scoop * plot.nonces + first_nonce) * SCOOP_SIZE as u64;
+        let dst = &mut out[scoop as usize * row..(scoop as usize + 1) * row];
+        if direct {
+            // direct I/O needs aligned offsets and lengths
+            let aligned_offset = offset / ALIGNMENT * ALIGNMENT;
+            let skip = (offset - aligned_offset) as usize;
+            let len = round_up((skip + row) as u64, ALIGNMENT) as usize;
+            let read = read_at(handle, &mut scratch[..len], aligned_offset)?;
+            if read < skip + row {
+                return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "short read"));
+            }
+            dst.clone_from_slice(&scratch[skip..skip + row]);
+        } else {
+            let read = read_at(handle, dst, offset)?;
+            if read < row {
+                return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "short read"));
+            }
+        }
+    }
+    Ok(())
+}
+
+fn verify_batch(
+    plots: &[PlotFile],
+    batch: &Batch,
+    simd_ext: &SimdExtension,
+    generated: &mut [u8],
+    tx_report: &Sender<Report>,
+) {
+    let plot = &plots[batch.file];
+    noncegen(
+        simd_ext,
+        generated,
+        plot.numeric_id,
+        plot.start_nonce + batch.first_nonce,
+        round_up(batch.nonces, CPU_TASK_ALIGNMENT),
+    );
+    let data = batch.data.get_buffer();
+    let data = data.lock().unwrap();
+    let row = batch.nonces as usize * SCOOP_SIZE;
+    let mut expected = [0u8; SCOOP_SIZE];
+    for nonce in 0..batch.nonces as usize {
+        let mut corrupt_scoops = 0;
+        let mut first_scoop = 0;
+        for scoop in 0..NUM_SCOOPS {
+            poc2_scoop(generated, simd_ext.lanes(), nonce, scoop, &mut expected);
+            let offset = scoop * row + nonce * SCOOP_SIZE;
+            if data[offset..offset + SCOOP_SIZE] != expected[..] {
+                if corrupt_scoops == 0 {
+                    first_scoop = scoop as u32;
+                }
+                corrupt_scoops += 1;
+            }
+        }
+        if corrupt_scoops > 0 {
+            let _ = tx_report.send(Report::Corrupt(
+                batch.file,
+                batch.first_nonce + nonce as u64,
+                corrupt_scoops,
+                first_scoop,
+            ));
+        }
+    }
+    let _ = tx_report.send(Report::Checked(batch.file, batch.first_nonce, batch.nonces));
+}
+
+fn print_progress(checked: u64, total: u64, sw: &Stopwatch) {
+    print!(
+        "{: <80}",
+        format!(
+            "\rchecked {}/{} nonces ({:.1}%), {:.0} nonces/min",
+            checked,
+            total,
+            checked as f64 * 100.0 / total.max(1) as f64,
+            checked as f64 * 60_000.0 / (1 + sw.elapsed_ms()) as f64
+        )
+    );
+}
+
+// prints the corruption map of a file: '.' ok, 'X' corrupt, ' ' not checked
+fn print_result(plot: &PlotFile, result: &mut FileResult) -> bool {
+    result.corrupt.sort();
+    let mut map: Vec<char> = result
+        .checked_segments
+        .iter()
+        .map(|&x| if x { '.' } else { ' ' })
+        .collect();
+    for (nonce, ..) in result.corrupt.iter() {
+        map[(nonce * MAP_WIDTH / plot.nonces) as usize] = 'X';
+    }
+    let map: String = map.into_iter().collect();
+    let corrupt_scoops: u64 = result.corrupt.iter().map(|x| u64::from(x.1)).sum();
+    info!(
+        "{: <80}",
+        format!(
+            "{}: checked={}, corrupt_nonces={}, corrupt_scoops={}, read_errors={}",
+            plot.path.display(),
+            result.checked,
+            result.corrupt.len(),
+            corrupt_scoops,
+            result.read_errors
+        )
+    );
+    info!("[{}]", map);
+
+    // merge consecutive corrupt nonces into ranges
+    let mut ranges: Vec<(u64, u64, u64, u32)> = Vec::new();
+    for &(nonce, scoops, first_scoop) in result.corrupt.iter() {
+        match ranges.last_mut() {
+            Some(last) if last.1 + 1 == nonce => {
+                last.1 = nonce;
+                last.2 += u64::from(scoops);
+            }
+            _ => ranges.push((nonce, nonce, u64::from(scoops), first_scoop)),
+        }
+    }
+    for (first, last, scoops, first_scoop) in ranges {
+        warn!(
+            "corrupt: nonces {}-{} (offset {}-{}), {} scoops, first at scoop {}",
+            plot.start_nonce + first,
+            plot.start_nonce + last,
+            first,
+            last,
+            scoops,
+            first_scoop
+        );
+    }
+    result.corrupt.is_empty() && result.read_errors == 0
+}
+
+fn round_up(x: u64, multiple: u64) -> u64 {
+    (x + multiple - 1) / multiple * multiple
+}
+
+#[cfg(unix)]
+fn device_id(path: &Path) -> u64 {
+    use std::os::unix::fs::MetadataExt;
+    fs::metadata(path).map(|x| x.dev()).unwrap_or(0)
+}
+
+#[cfg(not(unix))]
+fn device_id(path: &Path) -> u64 {
+    // group by drive letter
+    path.components().next().map_or(0, |x| {
+        u64::from(x.as_os_str().to_string_lossy().as_bytes()[0])
+    })
+}
+
+// returns the file and whether it was opened for direct I/O
+#[cfg(target_os = "linux")]
+fn open(path: &Path) -> io::Result<(File, bool)> {
+    use std::fs::OpenOptions;
+    use std::os::unix::fs::OpenOptionsExt;
+    const O_DIRECT: i32 = 0o40000;
+    match OpenOptions::new()
+        .read(true)
+        .custom_flags(O_DIRECT)
+        .open(path)
+    {
+        Ok(x) => Ok((x, true)),
+        // e.g. tmpfs doesn't support direct I/O
+        Err(_) => File::open(path).map(|x| (x, false)),
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn open(path: &Path) -> io::Result<(File, bool)> {
+    File::open(path).map(|x| (x, false))
+}
+
+#[cfg(unix)]
+fn read_at(file: &File, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+    use std::os::unix::fs::FileExt;
+    let mut read = 0;
+    while read < buf.len() {
+        match file.read_at(&mut buf[read..], offset + read as u64)? {
+            0 => break,
+            n => read += n,
+        }
+    }
+    Ok(read)
+}
+
+#[cfg(windows)]
+fn read_at(file: &File, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+    use std::os::windows::fs::FileExt;
+    let mut read = 0;
+    while read < buf.len() {
+        match file.seek_read(&mut buf[read..], offset + read as u64)? {
+            0 => break,
+            n => read += n,
+        }
+    }
+    Ok(read)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::fs::OpenOptions;
+    use std::io::{Seek, SeekFrom, Write};
+
+    #[test]
+    fn test_select_batches() {
+        assert_eq!(select_batches(130, 0, BATCH_NONCES), vec![0, 64, 128]);
+        let batches = select_batches(64 * 100, 128, BATCH_NONCES);
+        assert_eq!(batches.len(), 2);
+        assert!(batches
+            .iter()
+            .all(|x| x % BATCH_NONCES == 0 && *x < 64 * 100));
+        assert_eq!(select_batches(100, 1_000_000, BATCH_NONCES).len(), 2);
+        assert_eq!(select_batches(10_000, 0, 4096), vec![0, 4096, 8192]);
+    }
+
+    #[test]
+    fn test_batch_size() {
+        // 8 threads and 2 disks hold 26 batches, 4GiB fit 576 nonces each
+        assert_eq!(max_batch_nonces(4 << 30, 8, 2), 576);
+        assert_eq!(max_batch_nonces(1 << 40, 8, 2), MAX_BATCH_NONCES);
+        assert_eq!(max_batch_nonces(1 << 20, 8, 2), BATCH_NONCES);
+        // full checks read the largest batches, samples only for large ones
+        assert_eq!(batch_nonces(0, 512), 512);
+        assert_eq!(batch_nonces(1024, 512), BATCH_NONCES);
+        assert_eq!(batch_nonces(1 << 20, 512), 512);
+    }
+
+    #[test]
+    fn test_plot_file_name() {
+        assert!(PlotFile::new(Path::new("/nonexistent/1_2_3_4")).is_err());
+        assert!(PlotFile::new(Path::new("/nonexistent/1_x_3")).is_err());
+    }
+
+    #[test]
+    fn test_detects_corrupt_scoop() {
+        let nonces = 32u64;
+        let dir = std::env::temp_dir().join(format!("bencher-check-{}", std::process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        let path = dir.join(format!("1337_1000_{}", nonces));
+
+        // a plot in scoop order: scoop * nonces * 64 + nonce * 64
+        let simd_ext = SimdExtension::None;
+        let mut generated = vec![0u8; nonces as usize * NONCE_SIZE];
+        noncegen(&simd_ext, &mut generated, 1337, 1000, nonces);
+        let mut plot = vec![0u8; nonces as usize * NONCE_SIZE];
+        for nonce in 0..nonces as usize {
+            for scoop in 0..NUM_SCOOPS {
+                let offset = (scoop * nonces as usize + nonce) * SCOOP_SIZE;
+                poc2_scoop(
+                    &generated,
+                    1,
+                    nonce,
+                    scoop,
+                    &mut plot[offset..offset + SCOOP_SIZE],
+                );
+            }
+        }
+        fs::write(&path, &plot).unwrap();
+        let plots = Arc::new(vec![PlotFile::new(&path).unwrap()]);
+        let sw = Stopwatch::start_new();
+        let results = check(&plots, 0, 2, &simd_ext, 1 << 30, &sw);
+        assert_eq!(results[0].checked, nonces);
+        assert!(results[0].corrupt.is_empty());
+
+        // flip a byte of scoop 100 of nonce 5
+        let offset = (100 * nonces + 5) * SCOOP_SIZE as u64 + 17;
+        let mut file = OpenOptions::new().write(true).open(&path).unwrap();
+        file.seek(SeekFrom::Start(offset)).unwrap();
+        file.write_all(&[plot[offset as usize] ^ 1]).unwrap();
+        drop(file);
+
+        let results = check(&plots, 0, 2, &simd_ext, 1 << 30, &sw);
+        fs::remove_dir_all(&dir).unwrap();
+        assert_eq!(results[0].checked, nonces);
+        assert_eq!(results[0].corrupt, vec![(5, 1, 100)]);
+        assert_eq!(results[0].read_errors, 0);
+    }
+}
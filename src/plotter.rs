@@ -0,0 +1,356 @@
+//! `bencher plot`: writes PoC2 plot files with the OpenCL noncegen kernel.
+//!
+//! A batch runs through three stages connected by bounded channels, so that the next batch
+//! is generated while the previous one is reordered and the one before is written:
+//! 1. the gpu generates complete nonces and they're read back into page aligned host buffers,
+//! 2. a thread de-interleaves them from the `Address()` layout into PoC2 scoop order,
+//! 3. a writer puts every scoop row of the batch in place, with direct I/O where supported.
+//!
+//! The buffers go back to the previous stage through return channels, so memory is bounded
+//! by `HOST_BUFFERS + SCOOP_BUFFERS` batches.
+
+use crate::buffer::PageAlignedByteBuffer;
+use crate::ocl::{gpu_noncegen_read, gpu_wait, GpuContext};
+use crate::poc_hashing::{poc2_scoop, NONCE_SIZE, NUM_SCOOPS, SCOOP_SIZE};
+use crossbeam_channel::{bounded, Receiver, Sender};
+use std::fs::File;
+use std::io;
+use std::path::Path;
+use std::thread;
+use stopwatch::Stopwatch;
+
+// the gpu fills one while the previous one waits for the de-interleaver, a third is reordered
+const HOST_BUFFERS: usize = 3;
+// one is filled while the other is written
+const SCOOP_BUFFERS: usize = 2;
+// lanes of the interleaved gpu buffer, NONCES_VECTOR in kernel.cl
+const GPU_LANES: usize = 16;
+// 64 nonces make a scoop row of 4KiB, which keeps every direct write aligned
+const NONCE_ALIGNMENT: u64 = 64;
+
+struct Batch {
+    // offset in the file
+    first_nonce: u64,
+    nonces: u64,
+    data: PageAlignedByteBuffer,
+}
+
+/// Plots `nonces` nonces of `numeric_id` from `start_nonce` on into `dir`, the count is
+/// rounded down to a multiple of 64. Returns false on errors.
+pub fn plot(
+    gpu_context: &GpuContext,
+    numeric_id: u64,
+    start_nonce: u64,
+    nonces: u64,
+    dir: &Path,
+) -> bool {
+    let nonces = nonces / NONCE_ALIGNMENT * NONCE_ALIGNMENT;
+    let batch_nonces =
+        (gpu_context.worksize as u64 / NONCE_ALIGNMENT * NONCE_ALIGNMENT).min(nonces);
+    if batch_nonces == 0 {
+        error!(
+            "plot: need at least {} nonces and a gpu worksize of at least {}",
+            NONCE_ALIGNMENT, NONCE_ALIGNMENT
+        );
+        return false;
+    }
+    let path = dir.join(format!("{}_{}_{}", numeric_id, start_nonce, nonces));
+    let (file, direct) = match create(&path, nonces * NONCE_SIZE as u64) {
+        Ok(x) => x,
+        Err(e) => {
+            error!("plot: can't create {}: {}", path.display(), e);
+            return false;
+        }
+    };
+    info!(
+        "plot: file={}, nonces={}, batch={}, direct_io={}, buffers={}MiB",
+        path.display(),
+        nonces,
+        batch_nonces,
+        direct,
+        (HOST_BUFFERS + SCOOP_BUFFERS) as u64 * batch_nonces * NONCE_SIZE as u64 / 1024 / 1024
+    );
+
+    let batch_size = batch_nonces as usize * NONCE_SIZE;
+    let (tx_host_free, rx_host_free) = bounded(HOST_BUFFERS);
+    for _ in 0..HOST_BUFFERS {
+        tx_host_free
+            .send(PageAlignedByteBuffer::new(batch_size))
+            .unwrap();
+    }
+    let (tx_scoop_free, rx_scoop_free) = bounded(SCOOP_BUFFERS);
+    for _ in 0..SCOOP_BUFFERS {
+        tx_scoop_free
+            .send(PageAlignedByteBuffer::new(batch_size))
+            .unwrap();
+    }
+    let (tx_generated, rx_generated) = bounded::<Batch>(1);
+    let (tx_reordered, rx_reordered) = bounded::<Batch>(1);
+
+    let deinterleaver = thread::spawn(move || {
+        deinterleave(rx_generated, tx_host_free, rx_scoop_free, tx_reordered)
+    });
+    let writer =
+        thread::spawn(move || write_batches(&file, direct, nonces, rx_reordered, tx_scoop_free));
+
+    let sw = Stopwatch::start_new();
+    let mut pending: Option<(Batch, _)> = None;
+    let mut first_nonce = 0;
+    loop {
+        let next = if first_nonce < nonces {
+            let data = match rx_host_free.recv() {
+                Ok(x) => x,
+                // a later stage gave up
+                Err(_) => break,
+            };
+            let batch = Batch {
+                first_nonce,
+                nonces: batch_nonces.min(nonces - first_nonce),
+                data,
+            };
+            let event = {
+                let buffer = batch.data.get_buffer();
+                let mut buffer = buffer.lock().unwrap();
+                let len = batch.nonces as usize * NONCE_SIZE;
+                // the readback keeps writing after the lock is gone, nobody else touches the
+                // buffer before it's sent on below
+                unsafe {
+                    gpu_noncegen_read(
+                        gpu_context,
+                        numeric_id,
+                        start_nonce + batch.first_nonce,
+                        batch.nonces,
+                        &mut buffer[..len],
+                    )
+                }
+            };
+            first_nonce += batch.nonces;
+            Some((batch, event))
+        } else {
+            None
+        };
+        // the next batch is queued behind this one, so the gpu never idles while we wait
+        let previous = pending.take();
+        pending = next;
+        if let Some((batch, event)) = previous {
+            gpu_wait(&event);
+            let done = batch.first_nonce + batch.nonces;
+            if tx_generated.send(batch).is_err() {
+                break;
+            }
+            print_progress(done, nonces, &sw);
+        }
+        if pending.is_none() {
+            break;
+        }
+    }
+    // the device may still write into a pending buffer
+    if let Some((_, event)) = pending {
+        gpu_wait(&event);
+    }
+    drop(tx_generated);
+
+    deinterleaver.join().unwrap();
+    match writer.join().unwrap() {
+        Ok(()) => {
+            info!(
+                "{: <80}",
+                format!(
+                    "plot done: file={}, {:.0} nonces/min",
+                    path.display(),
+                    nonces as f64 * 60_000.0 / (1 + sw.elapsed_ms()) as f64
+                )
+            );
+            true
+        }
+        Err(e) => {
+            error!("{: <80}", format!("plot: write error: {}", e));
+            false
+        }
+    }
+}
+
+fn deinterleave(
+    rx_generated: Receiver<Batch>,
+    tx_host_free: Sender<PageAlignedByteBuffer>,
+    rx_scoop_free: Receiver<PageAlignedByteBuffer>,
+    tx_reordered: Sender<Batch>,
+) {
+    for batch in rx_generated {
+        let out = match rx_scoop_free.recv() {
+            Ok(x) => x,
+            Err(_) => return,
+        };
+        {
+            let data = batch.data.get_buffer();
+            let data = data.lock().unwrap();
+            let buffer = out.get_buffer();
+            let mut buffer = buffer.lock().unwrap();
+            to_scoop_order(&data, batch.nonces as usize, &mut buffer);
+        }
+        let reordered = Batch {
+            first_nonce: batch.first_nonce,
+            nonces: batch.nonces,
+            data: out,
+        };
+        if tx_host_free.send(batch.data).is_err() || tx_reordered.send(reordered).is_err() {
+            return;
+        }
+    }
+}
+
+// scoop major: scoop * nonces * 64 + nonce * 64
+fn to_scoop_order(interleaved: &[u8], nonces: usize, out: &mut [u8]) {
+    let row = nonces * SCOOP_SIZE;
+    for scoop in 0..NUM_SCOOPS {
+        for nonce in 0..nonces {
+            let offset = scoop * row + nonce * SCOOP_SIZE;
+            poc2_scoop(
+                interleaved,
+                GPU_LANES,
+                nonce,
+                scoop,
+                &mut out[offset..offset + SCOOP_SIZE],
+            );
+        }
+    }
+}
+
+fn write_batches(
+    file: &File,
+    direct: bool,
+    nonces: u64,
+    rx_reordered: Receiver<Batch>,
+    tx_scoop_free: Sender<PageAlignedByteBuffer>,
+) -> io::Result<()> {
+    for batch in rx_reordered {
+        {
+            let data = batch.data.get_buffer();
+            let data = data.lock().unwrap();
+            let row = batch.nonces as usize * SCOOP_SIZE;
+            for scoop in 0..NUM_SCOOPS {
+                let offset = (scoop as u64 * nonces + batch.first_nonce) * SCOOP_SIZE as u64;
+                write_at(file, &data[scoop * row..(scoop + 1) * row], offset)?;
+            }
+        }
+        // the de-interleaver may be gone already after the last batch
+        let _ = tx_scoop_free.send(batch.data);
+    }
+    if !direct {
+        file.sync_all()?;
+    }
+    Ok(())
+}
+
+fn print_progress(done: u64, total: u64, sw: &Stopwatch) {
+    print!(
+        "{: <80}",
+        format!(
+            "\rgenerated {}/{} nonces ({:.1}%), {:.0} nonces/min",
+            done,
+            total,
+            done as f64 * 100.0 / total.max(1) as f64,
+            done as f64 * 60_000.0 / (1 + sw.elapsed_ms()) as f64
+        )
+    );
+}
+
+// creates the file at its final size, returns it and whether it was opened for direct I/O
+#[cfg(target_os = "linux")]
+fn create(path: &Path, size: u64) -> io::Result<(File, bool)> {
+    use std::fs::OpenOptions;
+    use std::os::unix::fs::OpenOptionsExt;
+    const O_DIRECT: i32 = 0o40000;
+    let file = OpenOptions::new()
+        .write(true)
+        .create(true)
+        .truncate(true)
+        .open(path)?;
+    file.set_len(size)?;
+    drop(file);
+    match OpenOptions::new()
+        .write(true)
+        .custom_flags(O_DIRECT)
+        .open(path)
+    {
+        Ok(x) => Ok((x, true)),
+        // e.g. tmpfs doesn't support direct I/O
+        Err(_) => OpenOptions::new()
+            .write(true)
+            .open(path)
+            .map(|x| (x, false)),
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn create(path: &Path, size: u64) -> io::Result<(File, bool)> {
+    let file = File::create(path)?;
+    file.set_len(size)?;
+    Ok((file, false))
+}
+
+#[cfg(unix)]
+fn write_at(file: &File, buf: &[u8], offset: u64) -> io::Result<()> {
+    use std::os::unix::fs::FileExt;
+    file.write_all_at(buf, offset)
+}
+
+#[cfg(windows)]
+fn write_at(file: &File, buf: &[u8], offset: u64) -> io::Result<()> {
+    use std::os::windows::fs::FileExt;
+    let mut written = 0;
+    while written < buf.len() {
+        match file.seek_write(&buf[written..], offset + written as u64)? {
+            0 => return Err(io::Error::new(io::ErrorKind::WriteZero, "short write")),
+            n => written += n,
+        }
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::poc_hashing::HASH_SIZE;
+
+    // the layout of Address(nonce, hash, word) in kernel.cl, in bytes
+    fn address(nonce: usize, hash: usize, word: usize) -> usize {
+        let words = (nonce / GPU_LANES) * GPU_LANES * NONCE_SIZE / 4
+            + hash * GPU_LANES * HASH_SIZE / 4
+            + word * GPU_LANES
+            + nonce % GPU_LANES;
+        words * 4
+    }
+
+    #[test]
+    fn test_to_scoop_order() {
+        let nonces = 2 * GPU_LANES;
+        let mut interleaved = vec![0u8; nonces * NONCE_SIZE];
+        // every word holds its nonce, hash and word
+        for nonce in 0..nonces {
+            for hash in 0..2 * NUM_SCOOPS {
+                for word in 0..HASH_SIZE / 4 {
+                    let value = (nonce << 24 | hash << 3 | word) as u32;
+                    let at = address(nonce, hash, word);
+                    interleaved[at..at + 4].clone_from_slice(&value.to_le_bytes());
+                }
+            }
+        }
+        let mut out = vec![0u8; nonces * NONCE_SIZE];
+        to_scoop_order(&interleaved, nonces, &mut out);
+        for &(nonce, scoop) in &[(0, 0), (5, 17), (GPU_LANES + 3, 4095), (nonces - 1, 2048)] {
+            let offset = (scoop * nonces + nonce) * SCOOP_SIZE;
+            for word in 0..SCOOP_SIZE / 4 {
+                // first hash of the scoop, then the second hash of its mirror scoop
+                let hash = if word < 8 {
+                    2 * scoop
+                } else {
+                    2 * (NUM_SCOOPS - 1 - scoop) + 1
+                };
+                let expected = (nonce << 24 | hash << 3 | word % 8) as u32;
+                let at = offset + word * 4;
+                assert_eq!(out[at..at + 4], expected.to_le_bytes());
+            }
+        }
+    }
+}
@@ -3,10 +3,10 @@ use hex;
 use std::mem::transmute;
 use std::u64;
 
-const HASH_SIZE: usize = 32;
+pub const HASH_SIZE: usize = 32;
 const HASH_CAP: usize = 4096;
-const NUM_SCOOPS: usize = 4096;
-const SCOOP_SIZE: usize = 64;
+pub const NUM_SCOOPS: usize = 4096;
+pub const SCOOP_SIZE: usize = 64;
 pub const NONCE_SIZE: usize = NUM_SCOOPS * SCOOP_SIZE;
 const MESSAGE_SIZE: usize = 16;
 
@@ -54,6 +54,45 @@ pub fn find_best_deadline_rust(
     (best_deadline, best_offset as u64)
 }
 
+/// `find_best_deadline_rust` on one scoop of a scoop-major nonce cache, every nonce is its
+/// first hash followed by the second hash of its mirror scoop.
+pub fn find_best_deadline_sm_rust(
+    data: &[u8],
+    number_of_nonces: u64,
+    gensig: &[u8; 32],
+) -> (u64, u64) {
+    let mut best_deadline = u64::MAX;
+    let mut best_offset = 0;
+    for i in 0..number_of_nonces as usize {
+        let scoop = &data[i * SCOOP_SIZE..(i + 1) * SCOOP_SIZE];
+        let result = shabal256_deadline_fast(&scoop[..HASH_SIZE], &scoop[HASH_SIZE..], &gensig);
+        if result < best_deadline {
+            best_deadline = result;
+            best_offset = i;
+        }
+    }
+    (best_deadline, best_offset as u64)
+}
+
+/// Copies the PoC2 scoop of a nonce out of a noncegen buffer into `out` (64 bytes).
+///
+/// The SIMD kernels interleave the hashes of `lanes` nonces word by word, so word `w` of hash
+/// `h` of a nonce lives at `group + h * 32 * lanes + w * 4 * lanes + lane * 4`. A PoC2 scoop is
+/// the first hash of the scoop followed by the second hash of its mirror scoop.
+pub fn poc2_scoop(data: &[u8], lanes: usize, nonce: usize, scoop: usize, out: &mut [u8]) {
+    let group = nonce / lanes * lanes * NONCE_SIZE;
+    let lane = nonce % lanes;
+    let mirror_scoop = NUM_SCOOPS - 1 - scoop;
+    for (half, hash) in [2 * scoop, 2 * mirror_scoop + 1].iter().enumerate() {
+        let base = group + hash * HASH_SIZE * lanes + lane * 4;
+        for w in 0..HASH_SIZE / 4 {
+            let src = base + w * 4 * lanes;
+            let dst = half * HASH_SIZE + w * 4;
+            out[dst..dst + 4].clone_from_slice(&data[src..src + 4]);
+        }
+    }
+}
+
 // cache:		    cache to save to
 // local_num:		thread number
 // numeric_id:		numeric account id
@@ -148,3 +187,24 @@ pub fn noncegen_rust(cache: &mut [u8], numeric_id: u64, local_startnonce: u64, l
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_poc2_scoop() {
+        let mut data = vec![0u8; 2 * NONCE_SIZE];
+        noncegen_rust(&mut data, 7900104405094198526, 1000, 2);
+        let gensig = [7u8; 32];
+        let mut scoop_data = [0u8; SCOOP_SIZE];
+        for &scoop in [0usize, 1, 2047, 4095].iter() {
+            let (deadline, offset) = find_best_deadline_rust(&data, scoop as u64, 2, &gensig);
+            poc2_scoop(&data, 1, offset as usize, scoop, &mut scoop_data);
+            assert_eq!(
+                shabal256_deadline_fast(&scoop_data[..HASH_SIZE], &scoop_data[HASH_SIZE..], &gensig),
+                deadline
+            );
+        }
+    }
+}
@@ -0,0 +1,146 @@
+//! When to poll the mining info next.
+//!
+//! Block times are modelled as Erlang distributed with shape k and the configured blocktime
+//! as mean. Right after a block the hazard h(t) of the next one is low and it rises towards
+//! k / blocktime, so the schedule polls sparsely early and fast late. Weighing the expected
+//! detection latency, about f(t) * interval / 2, against the polls, S(t) / interval, gives
+//! intervals proportional to 1 / sqrt(h(t)). They're scaled so that the expected number of
+//! polls per block stays blocktime / get_mining_info_interval, the same as polling at a
+//! fixed interval. Shape 1 is memoryless and polls at the fixed interval.
+
+use std::time::Duration;
+
+const MIN_INTERVAL_MS: f64 = 250.0;
+// the longest interval as multiple of the base interval, bounds the latency of early blocks
+const MAX_INTERVAL_FACTOR: f64 = 8.0;
+const MAX_SHAPE: u32 = 16;
+
+pub struct PollSchedule {
+    interval_ms: f64,
+    shape: u32,
+    // per ms
+    rate: f64,
+    // interval = scale / sqrt(h)
+    scale: f64,
+}
+
+impl PollSchedule {
+    pub fn new(interval_ms: u64, blocktime_s: u64, shape: u32) -> PollSchedule {
+        let blocktime_ms = (blocktime_s.max(1) * 1000) as f64;
+        let shape = shape.max(1).min(MAX_SHAPE);
+        let mut schedule = PollSchedule {
+            interval_ms: interval_ms as f64,
+            shape,
+            rate: f64::from(shape) / blocktime_ms,
+            scale: 0.0,
+        };
+        // expected polls are the integral of S(t) * sqrt(h(t)) / scale
+        let (mut integral, mut survival, mut t) = (0.0, 1.0, 0.0);
+        let dt = blocktime_ms / 10_000.0;
+        while survival > 1e-9 {
+            let hazard = schedule.hazard(t);
+            integral += survival * hazard.sqrt() * dt;
+            survival -= survival * hazard * dt;
+            t += dt;
+        }
+        schedule.scale = integral * interval_ms as f64 / blocktime_ms;
+        schedule
+    }
+
+    // hazard per ms of a block at `t_ms` after the last one
+    fn hazard(&self, t_ms: f64) -> f64 {
+        // h = rate * x^(k-1)/(k-1)! / sum_{n<k} x^n/n!
+        let x = self.rate * t_ms;
+        let mut term = 1.0;
+        let mut sum = 1.0;
+        for n in 1..self.shape {
+            term *= x / f64::from(n);
+            sum += term;
+        }
+        self.rate * term / sum
+    }
+
+    /// Delay of the next poll, `since_block` after the last block was seen.
+    pub fn next_interval(&self, since_block: Duration) -> Duration {
+        if self.shape == 1 {
+            return Duration::from_millis(self.interval_ms as u64);
+        }
+        let t = since_block.as_secs() as f64 * 1000.0 + f64::from(since_block.subsec_millis());
+        let interval = self.scale / self.hazard(t).sqrt();
+        let interval = interval
+            .max(MIN_INTERVAL_MS)
+            .min(self.interval_ms * MAX_INTERVAL_FACTOR);
+        Duration::from_millis(interval as u64)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // expected polls per block and detection latency in ms, block times integrated over the
+    // Erlang density of `model`
+    fn expectation(schedule: &PollSchedule, model: &PollSchedule) -> (f64, f64) {
+        let mut polls = vec![0.0];
+        while *polls.last().unwrap() < 20.0 * 240_000.0 {
+            let last = *polls.last().unwrap();
+            let next = schedule.next_interval(Duration::from_millis(last as u64));
+            polls.push(last + next.as_secs() as f64 * 1000.0 + f64::from(next.subsec_millis()));
+        }
+        let (mut expected_polls, mut latency, mut survival) = (0.0, 0.0, 1.0);
+        let mut next = 1;
+        let dt = 10.0;
+        let mut t = 0.0;
+        while survival > 1e-9 {
+            let density = model.hazard(t) * survival;
+            while polls[next] < t {
+                next += 1;
+            }
+            expected_polls += density * dt * next as f64;
+            latency += density * dt * (polls[next] - t);
+            survival -= density * dt;
+            t += dt;
+        }
+        (expected_polls, latency)
+    }
+
+    #[test]
+    fn test_shape_one_is_fixed() {
+        let schedule = PollSchedule::new(1000, 240, 1);
+        assert_eq!(
+            schedule.next_interval(Duration::from_secs(0)),
+            Duration::from_secs(1)
+        );
+        assert_eq!(
+            schedule.next_interval(Duration::from_secs(500)),
+            Duration::from_secs(1)
+        );
+    }
+
+    #[test]
+    fn test_sparse_early_fast_late() {
+        let schedule = PollSchedule::new(1000, 240, 3);
+        assert_eq!(
+            schedule.next_interval(Duration::from_secs(0)),
+            Duration::from_secs(8)
+        );
+        assert!(schedule.next_interval(Duration::from_secs(480)) < Duration::from_millis(700));
+
+        let fixed = PollSchedule::new(1000, 240, 1);
+        let (fixed_polls, fixed_latency) = expectation(&fixed, &schedule);
+        let (polls, latency) = expectation(&schedule, &schedule);
+        // same volume, latency drops by about 14%
+        assert!(
+            polls <= fixed_polls * 1.01,
+            "{} vs {} polls",
+            polls,
+            fixed_polls
+        );
+        assert!(
+            latency < fixed_latency * 0.9,
+            "{} vs {}ms",
+            latency,
+            fixed_latency
+        );
+    }
+}
@@ -0,0 +1,643 @@
+//! `bencher proxy`: serves the miners of a LAN with one upstream connection.
+//!
+//! The proxy speaks the `/burst?requestType=...` api the miner's client uses. It polls the
+//! upstream mining info on its own and answers every getMiningInfo out of that cache. Of the
+//! submitted deadlines it keeps the best per account and block and only forwards improvements
+//! upstream, through one submission queue per account like the miner. Downstream miners get
+//! their deadline confirmed right away, the upstream answer is only logged.
+//!
+//! The proxy doesn't trust the deadlines a miner claims, it hashes every submitted nonce itself
+//! and rejects claims that don't match. Otherwise a single bad submission would block the real
+//! improvements of its account for the rest of the block.
+//!
+//! Submissions are forwarded with the proxy's own secret phrase, the one of a miner is ignored.
+//! The capacity sent upstream is the sum of what the miners report in X-Capacity.
+
+use crate::com::api::MiningInfoResponse as MiningInfo;
+use crate::config::Cfg;
+use crate::future::interval::ScheduledInterval;
+use crate::poc_hashing;
+use crate::poll_schedule::PollSchedule;
+use crate::request::RequestHandler;
+use futures::future::{self, Future};
+use futures::stream::Stream;
+use std::collections::HashMap;
+use std::io::{self, BufRead, BufReader, Read, Write};
+use std::net::{TcpListener, TcpStream};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+use tokio::runtime::TaskExecutor;
+
+const MAX_HEADERS: usize = 64;
+const MAX_BODY: u64 = 64 * 1024;
+// a miner that hasn't polled for this long no longer counts to the capacity
+const CAPACITY_TIMEOUT: Duration = Duration::from_secs(600);
+// idle keep-alive connections are closed after this
+const READ_TIMEOUT: Duration = Duration::from_secs(120);
+
+#[derive(Debug, PartialEq)]
+struct Request {
+    method: String,
+    path: String,
+    query: HashMap<String, String>,
+    // lower case names
+    headers: HashMap<String, String>,
+    keep_alive: bool,
+}
+
+// reads one http request, None once the peer closed the connection
+fn read_request<R: BufRead>(reader: &mut R) -> io::Result<Option<Request>> {
+    let invalid = |msg: &str| io::Error::new(io::ErrorKind::InvalidData, msg.to_owned());
+    let mut line = String::new();
+    if reader.read_line(&mut line)? == 0 {
+        return Ok(None);
+    }
+    let mut parts = line.split_whitespace();
+    let (method, target, version) = match (parts.next(), parts.next(), parts.next()) {
+        (Some(m), Some(t), Some(v)) => (m.to_owned(), t.to_owned(), v.to_owned()),
+        _ => return Err(invalid("malformed request line")),
+    };
+
+    let mut headers = HashMap::new();
+    loop {
+        line.clear();
+        if reader.read_line(&mut line)? == 0 {
+            return Err(invalid("connection closed in headers"));
+        }
+        let header = line.trim_end();
+        if header.is_empty() {
+            break;
+        }
+        if headers.len() == MAX_HEADERS {
+            return Err(invalid("too many headers"));
+        }
+        if let Some(i) = header.find(':') {
+            headers.insert(
+                header[..i].trim().to_lowercase(),
+                header[i + 1..].trim().to_owned(),
+            );
+        }
+    }
+
+    // submissions carry everything in the query, a body is skipped
+    let length = match headers.get("content-length") {
+        Some(x) => x
+            .parse::<u64>()
+            .map_err(|_| invalid("bad content-length"))?,
+        None => 0,
+    };
+    if length > MAX_BODY {
+        return Err(invalid("body too large"));
+    }
+    io::copy(&mut reader.take(length), &mut io::sink())?;
+
+    let connection = headers
+        .get("connection")
+        .map(|x| x.to_lowercase())
+        .unwrap_or_default();
+    let keep_alive = if version == "HTTP/1.0" {
+        connection == "keep-alive"
+    } else {
+        connection != "close"
+    };
+
+    let (path, query) = match target.find('?') {
+        Some(i) => (target[..i].to_owned(), &target[i + 1..]),
+        None => (target.clone(), ""),
+    };
+    let query = url::form_urlencoded::parse(query.as_bytes())
+        .into_owned()
+        .collect();
+    Ok(Some(Request {
+        method,
+        path,
+        query,
+        headers,
+        keep_alive,
+    }))
+}
+
+fn error_json(code: i32, message: &str) -> String {
+    serde_json::json!({ "error": { "code": code, "message": message } }).to_string()
+}
+
+struct Round {
+    generation_signature: String,
+    height: u64,
+    base_target: u64,
+    gen_sig: [u8; 32],
+    block: u64,
+    seen: Instant,
+    // served as is
+    json: String,
+}
+
+/// A submission of the current round, the claimed deadlines not yet verified.
+#[derive(Debug)]
+struct Submission {
+    account_id: u64,
+    nonce: u64,
+    height: u64,
+    block: u64,
+    base_target: u64,
+    gen_sig: [u8; 32],
+    deadline_unadjusted: Option<u64>,
+    deadline: Option<u64>,
+}
+
+impl Submission {
+    // the unadjusted deadline of the nonce, one nonce is hashed in a few ms
+    fn verify(&self) -> u64 {
+        let mut cache = vec![0u8; poc_hashing::NONCE_SIZE];
+        poc_hashing::noncegen_rust(&mut cache, self.account_id, self.nonce, 1);
+        let scoop = poc_hashing::calculate_scoop(self.height, &self.gen_sig);
+        poc_hashing::find_best_deadline_rust(&cache, u64::from(scoop), 1, &self.gen_sig).0
+    }
+}
+
+/// A submission that improved the best deadline of its account and goes upstream.
+#[derive(Debug, PartialEq)]
+struct Forward {
+    account_id: u64,
+    nonce: u64,
+    height: u64,
+    block: u64,
+    deadline_unadjusted: u64,
+    deadline: u64,
+    gen_sig: [u8; 32],
+}
+
+#[derive(Default)]
+struct ProxyState {
+    round: Option<Round>,
+    // per account, of the current round
+    best_deadline: HashMap<u64, u64>,
+    // per miner, (capacity in GiB, last poll)
+    capacity: HashMap<String, (u64, Instant)>,
+    polls: u64,
+    submissions: u64,
+    forwarded: u64,
+}
+
+impl ProxyState {
+    // true if the block changed
+    fn update_mining_info(&mut self, mining_info: &MiningInfo) -> bool {
+        if let Some(round) = &self.round {
+            if round.generation_signature == mining_info.generation_signature {
+                return false;
+            }
+        }
+        let block = self.round.as_ref().map_or(1, |x| x.block + 1);
+        self.round = Some(Round {
+            generation_signature: mining_info.generation_signature.clone(),
+            height: mining_info.height,
+            base_target: mining_info.base_target.max(1),
+            gen_sig: poc_hashing::decode_gensig(&mining_info.generation_signature),
+            block,
+            seen: Instant::now(),
+            json: serde_json::json!({
+                "generationSignature": mining_info.generation_signature,
+                "baseTarget": mining_info.base_target.to_string(),
+                "height": mining_info.height.to_string(),
+                "targetDeadline": mining_info.target_deadline,
+            })
+            .to_string(),
+        });
+        self.best_deadline.clear();
+        true
+    }
+
+    fn mining_info(&mut self, miner: String, capacity: Option<u64>) -> Result<String, String> {
+        self.polls += 1;
+        if let Some(capacity) = capacity {
+            self.capacity.insert(miner, (capacity, Instant::now()));
+        }
+        match &self.round {
+            Some(round) => Ok(round.json.clone()),
+            None => Err(error_json(1, "proxy has no mining info yet")),
+        }
+    }
+
+    // capacity of the miners that polled lately
+    fn capacity(&mut self) -> u64 {
+        self.capacity
+            .retain(|_, (_, seen)| seen.elapsed() < CAPACITY_TIMEOUT);
+        self.capacity.values().map(|x| x.0).sum()
+    }
+
+    // the submission of the current round in a request, or an error reply
+    fn parse_submission(
+        &mut self,
+        query: &HashMap<String, String>,
+        headers: &HashMap<String, String>,
+    ) -> Result<Submission, String> {
+        self.submissions += 1;
+        let number = |x: Option<&String>| x.and_then(|x| x.parse::<u64>().ok());
+        let round = match &self.round {
+            Some(x) => x,
+            None => return Err(error_json(1, "proxy has no mining info yet")),
+        };
+        let (account_id, nonce) = match (number(query.get("accountId")), number(query.get("nonce")))
+        {
+            (Some(a), Some(n)) => (a, n),
+            _ => return Err(error_json(2, "missing accountId or nonce")),
+        };
+        if let Some(height) = number(query.get("blockheight")) {
+            if height != round.height {
+                return Err(error_json(
+                    1005,
+                    &format!(
+                        "submitted on wrong height {}, current {}",
+                        height, round.height
+                    ),
+                ));
+            }
+        }
+        // miners send the adjusted deadline in X-Deadline and without a secret phrase the
+        // unadjusted one in the query
+        Ok(Submission {
+            account_id,
+            nonce,
+            height: round.height,
+            block: round.block,
+            base_target: round.base_target,
+            gen_sig: round.gen_sig,
+            deadline_unadjusted: number(query.get("deadline")),
+            deadline: number(headers.get("x-deadline")),
+        })
+    }
+
+    // the adjusted deadline to confirm and what to forward, or an error reply, with
+    // `deadline_unadjusted` as computed by `Submission::verify`
+    fn submit_nonce(
+        &mut self,
+        submission: Submission,
+        deadline_unadjusted: u64,
+    ) -> Result<(u64, Option<Forward>), String> {
+        if self.round.as_ref().map(|x| x.block) != Some(submission.block) {
+            return Err(error_json(1005, "the block changed during the submission"));
+        }
+        let deadline = deadline_unadjusted / submission.base_target;
+        if submission
+            .deadline_unadjusted
+            .map_or(false, |x| x != deadline_unadjusted)
+            || submission.deadline.map_or(false, |x| x != deadline)
+        {
+            return Err(error_json(
+                2,
+                &format!(
+                    "deadline of nonce {} doesn't match, it is {}",
+                    submission.nonce, deadline
+                ),
+            ));
+        }
+
+        let best = self
+            .best_deadline
+            .entry(submission.account_id)
+            .or_insert(u64::max_value());
+        if deadline >= *best {
+            return Ok((deadline, None));
+        }
+        *best = deadline;
+        self.forwarded += 1;
+        Ok((
+            deadline,
+            Some(Forward {
+                account_id: submission.account_id,
+                nonce: submission.nonce,
+                height: submission.height,
+                block: submission.block,
+                deadline_unadjusted,
+                deadline,
+                gen_sig: submission.gen_sig,
+            }),
+        ))
+    }
+}
+
+struct Proxy {
+    state: Mutex<ProxyState>,
+    request_handler: RequestHandler,
+    // one submission queue per account, submissions replace each other within a queue
+    submission_queues: Mutex<HashMap<u64, RequestHandler>>,
+    executor: TaskExecutor,
+}
+
+impl Proxy {
+    // (status line, body)
+    fn handle(&self, request: &Request, peer: &str) -> (&'static str, String) {
+        if !request.path.ends_with("/burst") {
+            return ("404 Not Found", error_json(404, "not found"));
+        }
+        let request_type = request.query.get("requestType").map(String::as_str);
+        let reply = match (request.method.as_str(), request_type) {
+            (_, Some("getMiningInfo")) => {
+                // miners without a name are told apart by their address
+                let miner = request
+                    .headers
+                    .get("x-minername")
+                    .cloned()
+                    .unwrap_or_else(|| peer.to_owned());
+                let capacity = request
+                    .headers
+                    .get("x-capacity")
+                    .and_then(|x| x.parse::<u64>().ok());
+                self.state.lock().unwrap().mining_info(miner, capacity)
+            }
+            ("POST", Some("submitNonce")) => {
+                let submission = self
+                    .state
+                    .lock()
+                    .unwrap()
+                    .parse_submission(&request.query, &request.headers);
+                // hashed without the lock, the other miners keep being served
+                submission
+                    .and_then(|submission| {
+                        let deadline_unadjusted = submission.verify();
+                        self.state
+                            .lock()
+                            .unwrap()
+                            .submit_nonce(submission, deadline_unadjusted)
+                    })
+                    .map(|(deadline, forward)| {
+                        if let Some(forward) = forward {
+                            self.forward(forward);
+                        }
+                        serde_json::json!({ "result": "success", "deadline": deadline }).to_string()
+                    })
+            }
+            _ => Err(error_json(2, "unsupported request")),
+        };
+        match reply {
+            Ok(body) => ("200 OK", body),
+            Err(body) => ("400 Bad Request", body),
+        }
+    }
+
+    fn forward(&self, forward: Forward) {
+        let mut queues = self.submission_queues.lock().unwrap();
+        let queue = queues.entry(forward.account_id).or_insert_with(|| {
+            self.request_handler
+                .new_submission_queue(self.executor.clone())
+        });
+        queue.submit_nonce(
+            forward.account_id,
+            forward.nonce,
+            forward.height,
+            forward.block,
+            forward.deadline_unadjusted,
+            forward.deadline,
+            forward.gen_sig,
+        );
+    }
+
+    fn serve(&self, stream: TcpStream) -> io::Result<()> {
+        let peer = stream.peer_addr()?.ip().to_string();
+        stream.set_read_timeout(Some(READ_TIMEOUT))?;
+        stream.set_nodelay(true)?;
+        let mut writer = stream.try_clone()?;
+        let mut reader = BufReader::new(stream);
+        while let Some(request) = read_request(&mut reader)? {
+            let (status, body) = self.handle(&request, &peer);
+            // one write, the miner waits for the whole response
+            let response = format!(
+                "HTTP/1.1 {}\r\nContent-Type: application/json\r\nContent-Length: {}\r\n{}\r\n{}",
+                status,
+                body.len(),
+                if request.keep_alive {
+                    ""
+                } else {
+                    "Connection: close\r\n"
+                },
+                body
+            );
+            writer.write_all(response.as_bytes())?;
+            if !request.keep_alive {
+                break;
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Polls upstream and serves the miners connecting to `listen` until the process ends.
+pub fn run(cfg: Cfg, listen: &str, executor: TaskExecutor) {
+    info!("proxy: upstream={}, listen={}", cfg.url, listen);
+    let listener = match TcpListener::bind(listen) {
+        Ok(x) => x,
+        Err(e) => {
+            error!("proxy: can't listen on {}: {}", listen, e);
+            return;
+        }
+    };
+
+    let additional_headers = Arc::new(cfg.additional_headers);
+    let request_handler = RequestHandler::new(
+        cfg.url,
+        cfg.secret_phrase,
+        cfg.timeout,
+        cfg.send_proxy_details,
+        additional_headers.clone(),
+        cfg.submission_debounce,
+        cfg.get_mining_info_hedge,
+        executor.clone(),
+    );
+    let proxy = Arc::new(Proxy {
+        state: Mutex::new(ProxyState::default()),
+        request_handler,
+        submission_queues: Mutex::new(HashMap::new()),
+        executor: executor.clone(),
+    });
+
+    let poller = proxy.clone();
+    let xpu_string = Arc::new("proxy".to_owned());
+    // one upstream connection serves all miners, on average it polls at most once a second
+    let interval = cfg.get_mining_info_interval.max(1000);
+    let poll_schedule = PollSchedule::new(interval, cfg.blocktime, cfg.block_time_shape);
+    let schedule_state = proxy.clone();
+    executor.spawn(
+        ScheduledInterval::new(move || {
+            let state = schedule_state.state.lock().unwrap();
+            match &state.round {
+                Some(round) => poll_schedule.next_interval(round.seen.elapsed()),
+                None => Duration::from_millis(interval),
+            }
+        })
+        .for_each(move |_| {
+            let proxy = poller.clone();
+            let capacity = proxy.state.lock().unwrap().capacity();
+            proxy
+                .request_handler
+                .get_mining_info(capacity, additional_headers.clone(), xpu_string.clone())
+                .then(move |mining_info| {
+                    match mining_info {
+                        Ok(mining_info) => {
+                            let mut state = proxy.state.lock().unwrap();
+                            let (polls, submissions, forwarded) =
+                                (state.polls, state.submissions, state.forwarded);
+                            if state.update_mining_info(&mining_info) {
+                                info!(
+                                    "{: <80}",
+                                    format!(
+                                        "proxy: new block height={}, served last block: \
+                                             polls={}, submissions={}, forwarded={}",
+                                        mining_info.height, polls, submissions, forwarded
+                                    )
+                                );
+                                state.polls = 0;
+                                state.submissions = 0;
+                                state.forwarded = 0;
+                            }
+                        }
+                        Err(e) => warn!("proxy: error getting mining info: {:?}", e),
+                    }
+                    future::ok(())
+                })
+        })
+        .map_err(|e| panic!("interval errored: err={:?}", e)),
+    );
+
+    for stream in listener.incoming() {
+        let stream = match stream {
+            Ok(x) => x,
+            Err(e) => {
+                warn!("proxy: {}", e);
+                continue;
+            }
+        };
+        let proxy = proxy.clone();
+        thread::spawn(move || {
+            if let Err(e) = proxy.serve(stream) {
+                if e.kind() != io::ErrorKind::WouldBlock && e.kind() != io::ErrorKind::TimedOut {
+                    warn!("proxy: connection: {}", e);
+                }
+            }
+        });
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Cursor;
+
+    fn mining_info(gen_sig: u8, height: u64) -> MiningInfo {
+        serde_json::from_str(&format!(
+            r#"{{"generationSignature":"{}","baseTarget":"100","height":"{}"}}"#,
+            hex::encode([gen_sig; 32]),
+            height
+        ))
+        .unwrap()
+    }
+
+    #[test]
+    fn test_read_request() {
+        let raw = "GET /burst?requestType=getMiningInfo HTTP/1.1\r\nX-Capacity: 42\r\n\r\n\
+                   POST /burst?requestType=submitNonce&nonce=7 HTTP/1.1\r\n\
+                   Content-Length: 3\r\nConnection: close\r\n\r\nabc";
+        let mut reader = Cursor::new(raw.as_bytes());
+        let request = read_request(&mut reader).unwrap().unwrap();
+        assert_eq!(request.method, "GET");
+        assert_eq!(request.path, "/burst");
+        assert_eq!(request.query["requestType"], "getMiningInfo");
+        assert_eq!(request.headers["x-capacity"], "42");
+        assert!(request.keep_alive);
+
+        let request = read_request(&mut reader).unwrap().unwrap();
+        assert_eq!(request.query["nonce"], "7");
+        assert!(!request.keep_alive);
+        assert_eq!(read_request(&mut reader).unwrap(), None);
+
+        let mut reader = Cursor::new("GET\r\n\r\n".as_bytes());
+        assert!(read_request(&mut reader).is_err());
+    }
+
+    fn query(deadline: Option<u64>, height: u64) -> HashMap<String, String> {
+        let mut q: HashMap<String, String> = [
+            ("accountId", "1".to_owned()),
+            ("nonce", "5".to_owned()),
+            ("blockheight", height.to_string()),
+        ]
+        .iter()
+        .map(|(k, v)| (k.to_string(), v.clone()))
+        .collect();
+        if let Some(deadline) = deadline {
+            q.insert("deadline".to_owned(), deadline.to_string());
+        }
+        q
+    }
+
+    #[test]
+    fn test_only_improvements_are_forwarded() {
+        let mut state = ProxyState::default();
+        let headers = HashMap::new();
+        // the deadlines are claimed and verified as they are, the hashing is tested apart
+        let submit = |state: &mut ProxyState, deadline: u64, height: u64| {
+            let submission = state.parse_submission(&query(Some(deadline), height), &headers)?;
+            state.submit_nonce(submission, deadline)
+        };
+        assert!(submit(&mut state, 1000, 10).is_err());
+        assert!(state.mining_info("a".to_owned(), Some(10)).is_err());
+
+        assert!(state.update_mining_info(&mining_info(1, 10)));
+        assert!(!state.update_mining_info(&mining_info(1, 10)));
+        state.mining_info("a".to_owned(), Some(10)).unwrap();
+        state.mining_info("b".to_owned(), Some(5)).unwrap();
+        state.mining_info("a".to_owned(), Some(20)).unwrap();
+        assert_eq!(state.capacity(), 25);
+
+        let (deadline, forward) = submit(&mut state, 1000, 10).unwrap();
+        assert_eq!(deadline, 10);
+        assert_eq!(forward.unwrap().block, 1);
+        let (_, forward) = submit(&mut state, 2000, 10).unwrap();
+        assert_eq!(forward, None);
+        let (_, forward) = submit(&mut state, 500, 10).unwrap();
+        assert_eq!(forward.unwrap().deadline_unadjusted, 500);
+
+        // a new block starts over
+        assert!(state.update_mining_info(&mining_info(2, 11)));
+        assert!(submit(&mut state, 2000, 10).is_err());
+        let (_, forward) = submit(&mut state, 2000, 11).unwrap();
+        assert_eq!(forward.unwrap().block, 2);
+        assert_eq!(state.forwarded, 3);
+    }
+
+    #[test]
+    fn test_claimed_deadlines_are_verified() {
+        let mut state = ProxyState::default();
+        state.update_mining_info(&mining_info(1, 10));
+        let mut headers = HashMap::new();
+        let submission = state.parse_submission(&query(None, 10), &headers).unwrap();
+        let deadline_unadjusted = submission.verify();
+        let gen_sig = [1u8; 32];
+        let mut cache = vec![0u8; poc_hashing::NONCE_SIZE];
+        poc_hashing::noncegen_rust(&mut cache, 1, 5, 1);
+        let scoop = poc_hashing::calculate_scoop(10, &gen_sig);
+        assert_eq!(
+            deadline_unadjusted,
+            poc_hashing::find_best_deadline_rust(&cache, u64::from(scoop), 1, &gen_sig).0
+        );
+
+        // a fabricated claim neither blocks nor replaces the real deadline
+        let lower = Some(deadline_unadjusted / 2);
+        let fake = state.parse_submission(&query(lower, 10), &headers).unwrap();
+        assert!(state.submit_nonce(fake, deadline_unadjusted).is_err());
+        headers.insert("x-deadline".to_owned(), "0".to_owned());
+        let fake = state.parse_submission(&query(None, 10), &headers).unwrap();
+        assert!(state.submit_nonce(fake, deadline_unadjusted).is_err());
+
+        // without a claim the computed deadline goes upstream
+        let (deadline, forward) = state.submit_nonce(submission, deadline_unadjusted).unwrap();
+        assert_eq!(deadline, deadline_unadjusted / 100);
+        assert_eq!(forward.unwrap().deadline_unadjusted, deadline_unadjusted);
+
+        // the block changed while the nonce was hashed
+        let late = state
+            .parse_submission(&query(None, 10), &HashMap::new())
+            .unwrap();
+        state.update_mining_info(&mining_info(2, 10));
+        assert!(state.submit_nonce(late, deadline_unadjusted).is_err());
+    }
+}
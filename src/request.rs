@@ -1,22 +1,71 @@
 use crate::com::api::{FetchError, MiningInfoResponse};
 use crate::com::client::{Client, ProxyDetails, SubmissionParameters};
+use crate::com::hedge::{Hedge, HedgeStats};
+use crate::future::debounce::{Debounce, Window};
 use crate::future::prio_retry::PrioRetry;
-use futures::future::Future;
+use crate::trace;
+use futures::future::{self, Either, Future};
 use futures::stream::Stream;
-use futures::sync::mpsc;
+use futures::sync::{mpsc, oneshot};
 use std::collections::HashMap;
-use std::time::Duration;
+use std::time::{Duration, Instant};
 use std::u64;
 use tokio;
 use tokio::runtime::TaskExecutor;
+use tokio::timer::Delay;
 use url::Url;
 use stopwatch::Stopwatch;
+use std::sync::atomic::{AtomicU64, Ordering};
 use std::sync::Arc;
 
+// submissions of one queue that may wait for the pool at the same time
+const MAX_SUBMISSIONS_IN_FLIGHT: usize = 4;
+
+/// Outcome counters of the submissions of one or more handlers.
+#[derive(Default)]
+pub struct SubmissionStats {
+    pub accepted: AtomicU64,
+    // accepted, but the pool calculated a different deadline
+    pub mismatched: AtomicU64,
+    pub rejected: AtomicU64,
+    // pool busy or http errors, the submission is resent
+    pub retried: AtomicU64,
+    // cancelled in flight, a better deadline of the same block was sent
+    pub superseded: AtomicU64,
+    pub latency_ms: AtomicU64,
+}
+
+// The best deadline per (account, block) sent to the pool. Sending a better one drops the
+// cancel handle of the previous best, which aborts its request if it's still in flight.
+#[derive(Default)]
+struct InFlight {
+    best: HashMap<(u64, u64), (u64, oneshot::Sender<()>)>,
+}
+
+impl InFlight {
+    // None if a better deadline of the same block was already sent
+    fn begin(&mut self, params: &SubmissionParameters) -> Option<oneshot::Receiver<()>> {
+        let key = (params.account_id, params.block);
+        if let Some((deadline, _)) = self.best.get(&key) {
+            if *deadline < params.deadline {
+                return None;
+            }
+        }
+        // earlier blocks are over, what's left of their submissions is cancelled
+        self.best.retain(|k, _| k.1 >= params.block);
+        let (tx_cancel, rx_cancel) = oneshot::channel();
+        self.best.insert(key, (params.deadline, tx_cancel));
+        Some(rx_cancel)
+    }
+}
+
 #[derive(Clone)]
 pub struct RequestHandler {
     client: Client,
     tx_submit_data: mpsc::UnboundedSender<SubmissionParameters>,
+    // shared by the queues of a client, pools rate limit per host
+    debounce: Arc<Window>,
+    hedge: Arc<Hedge>,
 }
 
 impl RequestHandler {
@@ -26,6 +75,8 @@ impl RequestHandler {
         timeout: u64,
         send_proxy_details: bool,
         additional_headers: Arc<HashMap<String, String>>,
+        submission_debounce: u64,
+        hedge_budget: u64,
         executor: TaskExecutor,
     ) -> RequestHandler {
         // TODO
@@ -43,54 +94,146 @@ impl RequestHandler {
             additional_headers,
         );
 
+        let mut request_handler = RequestHandler::with_client(
+            client,
+            Arc::new(SubmissionStats::default()),
+            true,
+            Window::new(submission_debounce),
+            executor,
+        );
+        request_handler.hedge = Arc::new(Hedge::new(hedge_budget));
+        request_handler
+    }
+
+    /// Creates a handler with its own submission queue on top of an existing client, so that
+    /// many handlers can share one connection pool. Improvements of a deadline are coalesced
+    /// over a window of at most the max of `debounce`.
+    pub fn with_client(
+        client: Client,
+        stats: Arc<SubmissionStats>,
+        log_submissions: bool,
+        debounce: Arc<Window>,
+        executor: TaskExecutor,
+    ) -> RequestHandler {
         let (tx_submit_data, rx_submit_nonce_data) = mpsc::unbounded();
         RequestHandler::handle_submissions(
             client.clone(),
             rx_submit_nonce_data,
             tx_submit_data.clone(),
+            stats,
+            log_submissions,
+            debounce.clone(),
             executor,
         );
 
         RequestHandler {
             client,
             tx_submit_data,
+            debounce,
+            hedge: Arc::new(Hedge::new(0)),
         }
     }
 
+    /// A handler on the same client with a queue of its own. Submissions replace each other
+    /// within a queue, so every account needs its own.
+    pub fn new_submission_queue(&self, executor: TaskExecutor) -> RequestHandler {
+        let mut request_handler = RequestHandler::with_client(
+            self.client.clone(),
+            Arc::new(SubmissionStats::default()),
+            true,
+            self.debounce.clone(),
+            executor,
+        );
+        request_handler.hedge = self.hedge.clone();
+        request_handler
+    }
+
     fn handle_submissions(
         client: Client,
         rx: mpsc::UnboundedReceiver<SubmissionParameters>,
         tx_submit_data: mpsc::UnboundedSender<SubmissionParameters>,
+        stats: Arc<SubmissionStats>,
+        log_submissions: bool,
+        debounce: Arc<Window>,
         executor: TaskExecutor,
     ) {
+        let mut in_flight = InFlight::default();
+        // the first deadline of a block goes out right away, improvements are coalesced
+        let rx = Debounce::new(rx, |x: &SubmissionParameters| x.block, debounce.clone());
         let stream = PrioRetry::new(rx, Duration::from_secs(3))
-            .and_then(move |submission_params| {
+            .map(move |submission_params| {
+                let rx_cancel = match in_flight.begin(&submission_params) {
+                    Some(x) => x,
+                    None => return Either::A(future::ok(())),
+                };
                 let tx_submit_data = tx_submit_data.clone();
+                let stats = stats.clone();
+                let debounce = debounce.clone();
                 let mut sw = Stopwatch::new();
                 sw.start();
-                client
+                let submit_start = trace::now();
+                let submission = client
                     .clone()
                     .submit_nonce(&submission_params)
+                    .select2(rx_cancel)
+                    .then(|res| -> Result<_, ()> {
+                        // None if a better deadline cancelled it
+                        Ok(match res {
+                            Ok(Either::A((res, _))) => Some(Ok(res)),
+                            Err(Either::A((e, _))) => Some(Err(e)),
+                            Ok(Either::B(_)) | Err(Either::B(_)) => None,
+                        })
+                    })
                     .then(move |res| {
                         sw.stop();
-                        match res {
-                            Ok(res) => {
-                                if submission_params.deadline != res.deadline {
-                                    log_deadline_mismatch(
+                        let res = match res {
+                            Ok(Some(res)) => res,
+                            _ => {
+                                stats.superseded.fetch_add(1, Ordering::Relaxed);
+                                if log_submissions {
+                                    debug!(
+                                        "submission superseded: height={}, id={}, nonce={}, dl={}",
                                         submission_params.height,
                                         submission_params.account_id,
                                         submission_params.nonce,
                                         submission_params.deadline,
-                                        res.deadline,
-                                        sw.elapsed_ms()
                                     );
-                                } else {
+                                }
+                                return Ok(());
+                            }
+                        };
+                        trace::record(
+                            "submit_nonce",
+                            "request",
+                            submit_start,
+                            Some(("deadline", submission_params.deadline)),
+                        );
+                        stats
+                            .latency_ms
+                            .fetch_add(sw.elapsed_ms() as u64, Ordering::Relaxed);
+                        match res {
+                            Ok(res) => {
+                                debounce.observe_latency(sw.elapsed_ms() as u64);
+                                stats.accepted.fetch_add(1, Ordering::Relaxed);
+                                if submission_params.deadline != res.deadline {
+                                    stats.mismatched.fetch_add(1, Ordering::Relaxed);
+                                    if log_submissions {
+                                        log_deadline_mismatch(
+                                            submission_params.height,
+                                            submission_params.account_id,
+                                            submission_params.nonce,
+                                            submission_params.deadline,
+                                            res.deadline,
+                                            sw.elapsed_ms(),
+                                        );
+                                    }
+                                } else if log_submissions {
                                     log_submission_accepted(
                                         submission_params.height,
                                         submission_params.account_id,
                                         submission_params.nonce,
                                         submission_params.deadline,
-                                        sw.elapsed_ms()
+                                        sw.elapsed_ms(),
                                     );
                                 }
                             }
@@ -98,37 +241,47 @@ impl RequestHandler {
                                 // Very intuitive, if some pools send an empty message they are
                                 // experiencing too much load expect the submission to be resent later.
                                 if e.message.is_empty() || e.message == "limit exceeded" {
-                                    log_pool_busy(
-                                        submission_params.height,
-                                        submission_params.account_id,
-                                        submission_params.nonce,
-                                        submission_params.deadline,
-                                        sw.elapsed_ms()
-                                    );
+                                    debounce.rate_limited();
+                                    stats.retried.fetch_add(1, Ordering::Relaxed);
+                                    if log_submissions {
+                                        log_pool_busy(
+                                            submission_params.height,
+                                            submission_params.account_id,
+                                            submission_params.nonce,
+                                            submission_params.deadline,
+                                            sw.elapsed_ms(),
+                                        );
+                                    }
                                     let res = tx_submit_data.unbounded_send(submission_params);
                                     if let Err(e) = res {
                                         error!("can't send submission params: {}", e);
                                     }
                                 } else {
-                                    log_submission_not_accepted(
+                                    stats.rejected.fetch_add(1, Ordering::Relaxed);
+                                    if log_submissions {
+                                        log_submission_not_accepted(
+                                            submission_params.height,
+                                            submission_params.account_id,
+                                            submission_params.nonce,
+                                            submission_params.deadline,
+                                            sw.elapsed_ms(),
+                                            e.code,
+                                            &e.message,
+                                        );
+                                    }
+                                }
+                            }
+                            Err(FetchError::Http(x)) => {
+                                stats.retried.fetch_add(1, Ordering::Relaxed);
+                                if log_submissions {
+                                    log_submission_failed(
                                         submission_params.height,
                                         submission_params.account_id,
                                         submission_params.nonce,
                                         submission_params.deadline,
-                                        sw.elapsed_ms(),
-                                        e.code,
-                                        &e.message,
+                                        &x.to_string(),
                                     );
                                 }
-                            }
-                            Err(FetchError::Http(x)) => {
-                                log_submission_failed(
-                                    submission_params.height,
-                                    submission_params.account_id,
-                                    submission_params.nonce,
-                                    submission_params.deadline,
-                                    &x.to_string(),
-                                );
                                 let res = tx_submit_data.unbounded_send(submission_params);
                                 if let Err(e) = res {
                                     error!("can't send submission params: {}", e);
@@ -136,15 +289,86 @@ impl RequestHandler {
                             }
                         };
                         Ok(())
-                    })
+                    });
+                Either::B(submission)
             })
+            // a slow submission doesn't hold back a better deadline found meanwhile
+            .buffer_unordered(MAX_SUBMISSIONS_IN_FLIGHT)
             .for_each(|_| Ok(()))
             .map_err(|e| error!("can't handle submission params: {:?}", e));
         executor.spawn(stream);
     }
 
+    /// Gets the mining info, a request slower than the p90 latency is hedged by a second one
+    /// on a fresh connection within the hedge budget.
     pub fn get_mining_info(&self, capacity: u64,  additional_headers: Arc<HashMap<String, String>>, xpu_string: Arc<String>) -> impl Future<Item = MiningInfoResponse, Error = FetchError> {
-        self.client.get_mining_info(capacity, additional_headers, xpu_string)
+        let start = Instant::now();
+        let hedge = self.hedge.clone();
+        let primary = self
+            .client
+            .get_mining_info(capacity, additional_headers.clone(), xpu_string.clone());
+        let delay = match hedge.delay() {
+            Some(delay) => delay,
+            None => {
+                return Either::A(primary.map(move |mining_info| {
+                    hedge.observe(start.elapsed());
+                    mining_info
+                }))
+            }
+        };
+
+        let client = self.client.clone();
+        let inner_hedge = hedge.clone();
+        // None if the hedge wasn't sent
+        let backup = Delay::new(start + delay).then(
+            move |res| -> Box<
+                dyn Future<Item = Option<MiningInfoResponse>, Error = FetchError> + Send,
+            > {
+                // out of budget the first request has to answer on its own
+                if res.is_err() || !inner_hedge.fire() {
+                    return Box::new(future::ok(None));
+                }
+                Box::new(
+                    client
+                        .get_mining_info_hedge(capacity, additional_headers, xpu_string)
+                        .map(Some),
+                )
+            },
+        );
+        Either::B(primary.select2(backup).then(
+            move |res| -> Box<dyn Future<Item = MiningInfoResponse, Error = FetchError> + Send> {
+                match res {
+                    Ok(Either::A((mining_info, _))) => {
+                        hedge.observe(start.elapsed());
+                        Box::new(future::ok(mining_info))
+                    }
+                    Ok(Either::B((Some(mining_info), _))) => {
+                        hedge.observe(start.elapsed());
+                        hedge.won();
+                        Box::new(future::ok(mining_info))
+                    }
+                    Ok(Either::B((None, primary))) => Box::new(primary.map(move |mining_info| {
+                        hedge.observe(start.elapsed());
+                        mining_info
+                    })),
+                    // the first request failed, the hedge may still answer
+                    Err(Either::A((e, backup))) => Box::new(backup.then(move |res| match res {
+                        Ok(Some(mining_info)) => {
+                            hedge.observe(start.elapsed());
+                            hedge.won();
+                            Ok(mining_info)
+                        }
+                        _ => Err(e),
+                    })),
+                    // the hedge failed, the first request may still answer
+                    Err(Either::B((_, primary))) => Box::new(primary),
+                }
+            },
+        ))
+    }
+
+    pub fn hedge_stats(&self) -> &HedgeStats {
+        &self.hedge.stats
     }
 
     pub fn submit_nonce(
@@ -240,11 +464,12 @@ mod tests {
 
         let request_handler = RequestHandler::new(
             BASE_URL.parse().unwrap(),
-            HashMap::new(),
+            "".to_owned(),
             3,
-            12,
             true,
-            HashMap::new(),
+            Arc::new(HashMap::new()),
+            0,
+            0,
             rt.executor(),
         );
 
@@ -252,4 +477,25 @@ mod tests {
 
         rt.shutdown_on_idle();
     }
+
+    #[test]
+    fn test_in_flight_supersedes() {
+        let params = |block, deadline| SubmissionParameters {
+            account_id: 1337,
+            nonce: 12,
+            height: 111,
+            block,
+            deadline_unadjusted: deadline,
+            deadline,
+            gen_sig: [0; 32],
+        };
+        let mut in_flight = InFlight::default();
+        let first = in_flight.begin(&params(1, 100)).unwrap();
+        assert!(in_flight.begin(&params(1, 200)).is_none());
+        let second = in_flight.begin(&params(1, 50)).unwrap();
+        // the better deadline dropped the cancel handle of the first
+        assert!(first.wait().is_err());
+        in_flight.begin(&params(2, 500)).unwrap();
+        assert!(second.wait().is_err());
+    }
 }
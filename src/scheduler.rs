@@ -1,16 +1,34 @@
-use crate::cpu_hasher::{hash_cpu, CpuTask, SimdExtension};
+use crate::buffer::MemoryBudget;
+use crate::config::Account;
+use crate::control::ControlCommand;
+use crate::cpu_hasher::{hash_cpu, CpuTask, SimdExtension, CPU_TASK_ALIGNMENT};
+use crate::governor::Governor;
 #[cfg(feature = "opencl")]
 use crate::gpu_hasher::{create_gpu_hasher_thread, GpuTask};
 use crate::miner::NonceData;
+use crate::nonce_cache::{rescan, NonceCache};
 #[cfg(feature = "opencl")]
-use crate::ocl::gpu_init;
+use crate::ocl::{gpu_available, gpu_init, GpuContext};
 use crate::ocl::GpuConfig;
+use crate::perf;
+use crate::poc_hashing::NONCE_SIZE;
+#[cfg(feature = "opencl")]
+use crate::simulation::create_sim_gpu_thread;
+use crate::simulation::{hash_cpu_sim, SimDevices};
+#[cfg(feature = "opencl")]
+use crate::supervisor::{restart_gpu_later, Backoff, GpuWatch};
+use crate::supervisor::{start_heartbeat, supervise_cpu_task, CpuTaskState, CpuWatch, Orphans};
+use crate::trace;
 use chrono::Local;
-use crossbeam_channel::{unbounded, Receiver};
+use crossbeam_channel::{unbounded, Receiver, Sender};
 use futures::sync::mpsc::UnboundedSender;
 use std::cmp::min;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
 #[cfg(feature = "opencl")]
+use std::panic;
 use std::thread;
+use std::time::Instant;
 use std::u64;
 use stopwatch::Stopwatch;
 
@@ -21,37 +39,181 @@ pub struct RoundInfo {
     pub scoop: u64,
     pub height: u64,
     pub block: u64,
+    // the lower of the configured and the pool's target deadline
+    pub target_deadline: u64,
 }
 
 pub enum HasherMessage {
-    CpuRequestForWork,
+    CpuRequestForWork(u64),                      //(nonces of the finished task)
     GpuRequestForWork(usize),
-    NoncesProcessed(u64),
-    SubmitDeadline((u64, u64, u64, u64)), //(height, nonce, deadline, block)
+    NoncesProcessed(usize, u64, u64),             //(account, nonces, block)
+    SubmitDeadline((usize, u64, u64, u64, u64)), //(account, height, nonce, deadline, block)
+    Control(ControlCommand, Sender<String>),
+    CpuTaskFailed(usize, u64, u64, u64),         //(account, start_nonce, nonces, block)
+    GpuFailed(usize),
+    GpuRestart(usize),
+    Heartbeat,
 }
 
-pub fn create_scheduler_thread(
+/// Work done by the devices, shared with whoever observes the scheduler.
+#[derive(Default)]
+pub struct SchedulerStats {
+    pub processed: AtomicU64,
+    // nonces of tasks that finished after their round was superseded
+    pub wasted: AtomicU64,
+}
+
+struct AccountState {
     numeric_id: u64,
     start_nonce: u64,
+    weight: u64,
+    // nonces after start_nonce the nonce cache rescans this round, tasks start behind them
+    cached: u64,
+    requested: u64,
+    processed: u64,
+    // a deadline below the goal was found this round
+    goal_met: bool,
+}
+
+impl AccountState {
+    fn remaining(&self) -> u64 {
+        u64::MAX - self.start_nonce - self.cached - self.requested
+    }
+
+    // nonce range of the next task, the caller accounts it with `requested`
+    fn next_start_nonce(&self) -> u64 {
+        self.start_nonce + self.cached + self.requested
+    }
+}
+
+// Picks the account that got the fewest nonces relative to its weight, so that devices are
+// shared in proportion to the weights no matter which device asks for work.
+fn next_account(accounts: &[AccountState]) -> usize {
+    let mut next = 0;
+    for (i, account) in accounts.iter().enumerate().skip(1) {
+        // requested / weight < next.requested / next.weight
+        if u128::from(account.requested) * u128::from(accounts[next].weight)
+            < u128::from(accounts[next].requested) * u128::from(account.weight)
+        {
+            next = i;
+        }
+    }
+    next
+}
+
+pub fn create_scheduler_thread(
+    accounts: Vec<Account>,
     cpu_threads: u8,
+    max_cpu_threads: usize,
     cpu_task_size: u64,
+    max_memory: u64,
+    nonce_cache_size: u64,
+    nonce_cache_shm: String,
+    cache_build_deadline: u64,
+    nonce_cache_gpu: bool,
+    cpu_governor: Option<Governor>,
     simd_ext: SimdExtension,
     gpus: Vec<GpuConfig>,
     blocktime: u64,
     rx_rounds: Receiver<RoundInfo>,
     tx_nonce: UnboundedSender<NonceData>,
+    hasher_channel: (Sender<HasherMessage>, Receiver<HasherMessage>),
+    sim_devices: Option<Arc<SimDevices>>,
+    stats: Arc<SchedulerStats>,
 ) -> impl FnOnce() {
     move || {
-        let thread_pool = rayon::ThreadPoolBuilder::new()
-            .num_threads(cpu_threads as usize)
-            .build()
-            .unwrap();
+        let mut thread_pool = create_thread_pool(cpu_threads as usize);
+        let mut cpu_workers = u64::from(cpu_threads);
+        // lowers cpu_workers below the pool size while that costs no throughput
+        let mut cpu_governor = cpu_governor;
+        let governor_sw = Stopwatch::start_new();
+        let mut cpu_task_size = cpu_task_size;
+        let mut simd_ext = simd_ext;
+        // tasks handed out and not yet reported back, a worker is idle if this is below
+        // cpu_workers, either because it's starting up or the memory budget didn't admit it
+        let mut cpu_tasks_in_flight = 0u64;
+        // paused via the control socket, running tasks finish but no new ones are handed out
+        let mut paused = false;
+        // an engine switch waits for the next round, then the cpu tasks drain before the
+        // engine is initialized, its tables are shared by every task of the engine
+        let mut pending_engine: Option<SimdExtension> = None;
+        let mut draining = false;
+        // ranges of failed tasks, handed out before new nonces
+        let mut orphans = Orphans::default();
+        // cpu tasks in flight with their deadlines
+        let mut cpu_watch = CpuWatch::default();
 
-        let (tx, rx) = unbounded();
+        let (tx, rx) = hasher_channel;
+
+        let mut accounts: Vec<AccountState> = accounts
+            .iter()
+            .map(|x| AccountState {
+                numeric_id: x.numeric_id,
+                start_nonce: x.start_nonce,
+                weight: x.weight.max(1),
+                cached: 0,
+                requested: 0,
+                processed: 0,
+                goal_met: false,
+            })
+            .collect();
+
+        let memory_budget = MemoryBudget::new(max_memory as usize);
+
+        // the cache only keeps what the cpu hashed, simulated devices don't produce nonces
+        let nonce_cache = if nonce_cache_size > 0 && cpu_threads > 0 && sim_devices.is_none() {
+            let granularity = CPU_TASK_ALIGNMENT as usize * NONCE_SIZE * accounts.len();
+            // the cpu workers' buffers go first, otherwise they'd never get a reservation
+            let worker_memory = u64::from(cpu_threads) * cpu_task_size * NONCE_SIZE as u64;
+            let cache_size = cache_budget(nonce_cache_size, max_memory, worker_memory);
+            if cache_size < nonce_cache_size {
+                warn!(
+                    "nonce cache shrunk to {}MiB, the cpu workers need {}MiB of max_memory",
+                    cache_size / 1024 / 1024,
+                    worker_memory / 1024 / 1024
+                );
+            }
+            match memory_budget.reserve(cache_size as usize, granularity) {
+                Some(memory) => {
+                    info!(
+                        "nonce cache: {}MiB, {} nonces",
+                        memory.bytes() / 1024 / 1024,
+                        memory.bytes() / NONCE_SIZE
+                    );
+                    let weights: Vec<(u64, u64, u64)> = accounts
+                        .iter()
+                        .map(|x| (x.numeric_id, x.start_nonce, x.weight))
+                        .collect();
+                    let cache =
+                        NonceCache::start(&weights, memory, simd_ext.clone(), &nonce_cache_shm);
+                    // continue where the nonces in a shared cache start
+                    for (i, account) in accounts.iter_mut().enumerate() {
+                        if cache.start_nonce(i) != account.start_nonce {
+                            account.start_nonce = cache.start_nonce(i);
+                            info!(
+                                "account {}: {} cached nonces, start_nonce={}",
+                                account.numeric_id,
+                                cache.cached(i),
+                                account.start_nonce
+                            );
+                        }
+                    }
+                    Some(cache)
+                }
+                None => {
+                    warn!("nonce cache disabled, max_memory too small");
+                    None
+                }
+            }
+        } else {
+            None
+        };
 
         // create gpu threads and channels
         #[cfg(feature = "opencl")]
-        let gpu_contexts = if gpus.len() > 0 {
+        let gpu_configs = gpus.clone();
+        #[cfg(feature = "opencl")]
+        let gpu_contexts = if gpus.len() > 0 && sim_devices.is_none() {
             Some(gpu_init(&gpus))
         } else {
             None
@@ -63,13 +225,47 @@ pub fn create_scheduler_thread(
             None => Vec::new(),
         };
         #[cfg(feature = "opencl")]
+        {
+            if nonce_cache_gpu {
+                match (&nonce_cache, gpus.first()) {
+                    (Some(cache), Some(gpu)) => {
+                        info!("nonce cache: rescanning on gpu 0");
+                        cache.use_gpu(gpu.scanner());
+                    }
+                    (Some(_), None) => warn!("nonce_cache_gpu: no gpu, rescanning on the cpu"),
+                    _ => (),
+                }
+            }
+        }
+        #[cfg(not(feature = "opencl"))]
+        {
+            if nonce_cache_gpu {
+                warn!("nonce_cache_gpu: built without opencl, rescanning on the cpu");
+            }
+        }
+        #[cfg(feature = "opencl")]
+        // nonces per gpu task
+        let mut gpu_worksizes: Vec<u64> = gpus.iter().map(|x| x.task_size() as u64).collect();
+        #[cfg(feature = "opencl")]
         let mut gpu_threads = Vec::new();
         #[cfg(feature = "opencl")]
         let mut gpu_channels = Vec::new();
+        // gpus removed via the control socket keep their id, but get no more tasks
+        #[cfg(feature = "opencl")]
+        let mut gpu_active = Vec::new();
+        // gpus that asked for work while paused
+        #[cfg(feature = "opencl")]
+        let mut idle_gpus: Vec<usize> = Vec::new();
+        // current task of each gpu and the config to re-create it from
+        #[cfg(feature = "opencl")]
+        let mut gpu_watch: Vec<GpuWatch> = Vec::new();
+        start_heartbeat(tx.clone());
 
         #[cfg(feature = "opencl")]
         for (i, gpu) in gpus.iter().enumerate() {
             gpu_channels.push(unbounded());
+            gpu_active.push(true);
+            gpu_watch.push(GpuWatch::new(Some(gpu_configs[i].clone()), Backoff::new()));
             gpu_threads.push(thread::spawn({
                 create_gpu_hasher_thread(
                     i,
@@ -80,54 +276,103 @@ pub fn create_scheduler_thread(
             }));
         }
 
+        // simulated gpus replace the real ones
+        #[cfg(feature = "opencl")]
+        for gpu in sim_devices.iter().flat_map(|x| x.gpus.iter()) {
+            gpu_channels.push(unbounded());
+            gpu_active.push(true);
+            gpu_watch.push(GpuWatch::new(None, Backoff::new()));
+            gpu_worksizes.push(gpu.worksize);
+            gpu_threads.push(thread::spawn(create_sim_gpu_thread(
+                gpu_channels.len() - 1,
+                gpu.clone(),
+                sim_devices.as_ref().unwrap().speedup,
+                tx.clone(),
+                gpu_channels.last().unwrap().1.clone(),
+            )));
+        }
+
         let mut sw = Stopwatch::start_new();
         let mut init = true;
 
         for round in &rx_rounds {
+            trace::record("round_start", "scheduler", trace::now(), Some(("block", round.block)));
+            perf::report(sw.elapsed_ms());
+            if accounts.len() > 1 && !init {
+                for account in accounts.iter() {
+                    info!(
+                        "{: <80}",
+                        format!(
+                            "account {}: weight={}, nonces={}, capacity={}GiB",
+                            account.numeric_id,
+                            account.weight,
+                            account.processed,
+                            capacity(account.processed, &sw, blocktime)
+                        )
+                    );
+                }
+            }
             sw.restart();
-            let nonces_to_hash = u64::MAX - start_nonce;
-            let mut requested = 0u64;
+            for (i, account) in accounts.iter_mut().enumerate() {
+                account.cached = nonce_cache.as_ref().map_or(0, |x| x.cached(i));
+                account.requested = 0;
+                account.processed = 0;
+                account.goal_met = false;
+            }
+            orphans.clear();
+            // cached nonces are only rescanned, on their own thread so they don't queue
+            // behind the cpu tasks
+            if let Some(cache) = &nonce_cache {
+                let cached = accounts.iter().map(|x| x.cached).collect();
+                thread::spawn(rescan(cache.clone(), tx.clone(), round.clone(), cached));
+            }
             let mut processed = 0u64;
+            if pending_engine.is_some() {
+                draining = true;
+                if cpu_tasks_in_flight == 0 {
+                    switch_engine(&mut pending_engine, &mut simd_ext, &mut cpu_watch);
+                    draining = false;
+                }
+            }
             
             if init{
-                // kickoff first gpu and cpu runs
+                // kickoff first gpu runs, cpu workers are all idle
                 #[cfg(feature = "opencl")]
-                for (i, gpu) in gpus.iter().enumerate() {
+                for (i, worksize) in gpu_worksizes.iter().enumerate() {
                     // schedule next gpu task
-                    let task_size = min(gpu.worksize as u64, nonces_to_hash - requested);
-                    if task_size > 0 {
-                        gpu_channels[i]
-                            .0
-                            .send(Some(GpuTask {
-                                numeric_id,
-                                local_startnonce: start_nonce + requested,
-                                local_nonces: task_size,
-                                round: round.clone(),
-                            }))
-                            .unwrap();
-                    }
-                    requested += task_size;
+                    schedule_gpu_task(
+                        &gpu_channels[i].0,
+                        *worksize,
+                        &mut accounts,
+                        &round,
+                        &mut orphans,
+                        &mut gpu_watch[i],
+                    );
                 }
+                init = false;
+            }
 
-                // kickoff first cpu runs
-                for _ in 0..cpu_threads {
-                    let task_size = min(cpu_task_size, nonces_to_hash - requested);
-                    if task_size > 0 {
-                        let task = hash_cpu(
-                            tx.clone(),
-                            CpuTask {
-                                numeric_id,
-                                local_startnonce: start_nonce + requested,
-                                local_nonces: task_size,
-                                round: round.clone(),
-                            },
-                            simd_ext.clone(),
-                        );
-                        thread_pool.spawn(task);
-                    }
-                    requested += task_size;
+            if !paused && !draining {
+                schedule_cpu_tasks(
+                    &thread_pool,
+                    &tx,
+                    &memory_budget,
+                    cpu_workers,
+                    &mut cpu_tasks_in_flight,
+                    &mut accounts,
+                    cpu_task_size,
+                    &round,
+                    &simd_ext,
+                    &sim_devices,
+                    &nonce_cache,
+                    &mut orphans,
+                    &mut cpu_watch,
+                );
+            }
+            if let Some(governor) = &mut cpu_governor {
+                if cpu_tasks_in_flight > 0 {
+                    governor.resume(governor_sw.elapsed_ms() as u64);
                 }
-                init = false;
             }
 
             // control loop
@@ -135,63 +380,458 @@ pub fn create_scheduler_thread(
             for msg in rx {
                 match msg {
                     // schedule next cpu task
-                    HasherMessage::CpuRequestForWork => {
-                        let task_size = min(cpu_task_size, nonces_to_hash - requested);
-                        if task_size > 0 {
-                            let task = hash_cpu(
-                                tx.clone(),
-                                CpuTask {
-                                    numeric_id: numeric_id,
-                                    local_startnonce: start_nonce + requested,
-                                    local_nonces: task_size,
-                                    round: round.clone(),
-                                },
-                                simd_ext.clone(),
+                    HasherMessage::CpuRequestForWork(nonces) => {
+                        let _span = trace::span("dispatch_cpu", "scheduler");
+                        cpu_tasks_in_flight = cpu_tasks_in_flight.saturating_sub(1);
+                        cpu_watch.finished(Instant::now());
+                        if let Some(governor) = &mut cpu_governor {
+                            if let Some(workers) =
+                                governor.record(nonces, governor_sw.elapsed_ms() as u64)
+                            {
+                                cpu_workers = workers;
+                            }
+                        }
+                        if !paused && !draining {
+                            schedule_cpu_tasks(
+                                &thread_pool,
+                                &tx,
+                                &memory_budget,
+                                cpu_workers,
+                                &mut cpu_tasks_in_flight,
+                                &mut accounts,
+                                cpu_task_size,
+                                &round,
+                                &simd_ext,
+                                &sim_devices,
+                                &nonce_cache,
+                                &mut orphans,
+                                &mut cpu_watch,
                             );
-                            thread_pool.spawn(task);
                         }
-                        requested += task_size;
                         print_status(processed, &sw, blocktime)
                     }
                     // schedule next gpu task
                     HasherMessage::GpuRequestForWork(id) => {
+                        let _span = trace::span_with("dispatch_gpu", "scheduler", "gpu", id as u64);
                         #[cfg(feature = "opencl")]
-                        let task_size = min(gpus[id].worksize as u64, nonces_to_hash - requested);
-                        #[cfg(not(feature = "opencl"))]
-                        let task_size = 0;
-                        #[cfg(feature = "opencl")]
-                        gpu_channels[id]
-                            .0
-                            .send(Some(GpuTask {
-                                numeric_id: numeric_id,
-                                local_startnonce: start_nonce + requested,
-                                local_nonces: task_size,
-                                round: round.clone(),
-                            }))
-                            .unwrap();
-                        requested += task_size;
+                        {
+                            if !gpu_active[id] {
+                                // removed, the thread is shutting down
+                            } else if paused {
+                                gpu_watch[id].finished();
+                                idle_gpus.push(id);
+                            } else {
+                                gpu_watch[id].finished();
+                                schedule_gpu_task(
+                                    &gpu_channels[id].0,
+                                    gpu_worksizes[id],
+                                    &mut accounts,
+                                    &round,
+                                    &mut orphans,
+                                    &mut gpu_watch[id],
+                                );
+                            }
+                        }
                         print_status(processed, &sw, blocktime)
                     }
-                    HasherMessage::NoncesProcessed(nonces) => {
+                    HasherMessage::NoncesProcessed(account, nonces, block) => {
+                        stats.processed.fetch_add(nonces, Ordering::Relaxed);
+                        if block != round.block {
+                            stats.wasted.fetch_add(nonces, Ordering::Relaxed);
+                        }
+                        accounts[account].processed += nonces;
                         processed += nonces;
                     }
-                    HasherMessage::SubmitDeadline((height, nonce, deadline, block)) => {
-                        // calc capacity
-                        let capacity = processed * 250 * blocktime / 1024 / (1 + sw.elapsed_ms()) as u64;
+                    HasherMessage::SubmitDeadline((account, height, nonce, deadline, block)) => {
+                        let goal = cache_build_deadline.min(round.target_deadline);
+                        let account = &mut accounts[account];
+                        if block == round.block
+                            && nonce_cache.is_some()
+                            && !account.goal_met
+                            && deadline / round.base_target < goal
+                        {
+                            account.goal_met = true;
+                            info!(
+                                "{: <80}",
+                                format!(
+                                    "account {}: deadline below {}s, building the nonce cache",
+                                    account.numeric_id, goal
+                                )
+                            );
+                        }
                         tx_nonce
                             .clone()
                             .unbounded_send(NonceData {
-                                numeric_id,
+                                numeric_id: account.numeric_id,
                                 nonce,
                                 height,
                                 block,
                                 deadline,
                                 deadline_adjusted: deadline / round.base_target,
-                                capacity,
+                                capacity: capacity(account.processed, &sw, blocktime),
                                 base_target: round.base_target,
                             })
                             .expect("failed to send nonce data");
                     }
+                    HasherMessage::CpuTaskFailed(account, start_nonce, nonces, block) => {
+                        cpu_tasks_in_flight = cpu_tasks_in_flight.saturating_sub(1);
+                        error!(
+                            "cpu task failed, {} nonces of account {}",
+                            nonces, accounts[account].numeric_id
+                        );
+                        // a superseded round's nonces aren't needed anymore
+                        if block == round.block {
+                            orphans.push(account, start_nonce, nonces);
+                        }
+                        if !paused && !draining {
+                            schedule_cpu_tasks(
+                                &thread_pool,
+                                &tx,
+                                &memory_budget,
+                                cpu_workers,
+                                &mut cpu_tasks_in_flight,
+                                &mut accounts,
+                                cpu_task_size,
+                                &round,
+                                &simd_ext,
+                                &sim_devices,
+                                &nonce_cache,
+                                &mut orphans,
+                                &mut cpu_watch,
+                            );
+                        }
+                    }
+                    HasherMessage::GpuFailed(id) => {
+                        #[cfg(feature = "opencl")]
+                        {
+                            if gpu_active[id] {
+                                error!("gpu {}: device error, re-creating its context", id);
+                                drop_gpu(
+                                    id,
+                                    &tx,
+                                    &mut gpu_active,
+                                    &mut idle_gpus,
+                                    &gpu_channels,
+                                    &mut gpu_watch,
+                                    &mut orphans,
+                                    &round,
+                                );
+                            }
+                        }
+                    }
+                    HasherMessage::Heartbeat => {
+                        let hung = cpu_watch.abandon_timed_out(Instant::now());
+                        if !hung.is_empty() {
+                            for (account, start_nonce, nonces, block) in hung {
+                                error!(
+                                    "cpu task timed out, {} nonces of account {}",
+                                    nonces, accounts[account].numeric_id
+                                );
+                                cpu_tasks_in_flight = cpu_tasks_in_flight.saturating_sub(1);
+                                if block == round.block {
+                                    orphans.push(account, start_nonce, nonces);
+                                }
+                            }
+                            // hung threads can't be stopped, the other tasks finish on the old
+                            // pool
+                            thread_pool = create_thread_pool(thread_pool.current_num_threads());
+                            if !paused && !draining {
+                                schedule_cpu_tasks(
+                                    &thread_pool,
+                                    &tx,
+                                    &memory_budget,
+                                    cpu_workers,
+                                    &mut cpu_tasks_in_flight,
+                                    &mut accounts,
+                                    cpu_task_size,
+                                    &round,
+                                    &simd_ext,
+                                    &sim_devices,
+                                    &nonce_cache,
+                                    &mut orphans,
+                                    &mut cpu_watch,
+                                );
+                            }
+                        }
+                        #[cfg(feature = "opencl")]
+                        for id in 0..gpu_watch.len() {
+                            if gpu_active[id] && gpu_watch[id].timed_out() {
+                                error!("gpu {}: task timed out, re-creating its context", id);
+                                drop_gpu(
+                                    id,
+                                    &tx,
+                                    &mut gpu_active,
+                                    &mut idle_gpus,
+                                    &gpu_channels,
+                                    &mut gpu_watch,
+                                    &mut orphans,
+                                    &round,
+                                );
+                            }
+                        }
+                    }
+                    HasherMessage::GpuRestart(id) => {
+                        #[cfg(feature = "opencl")]
+                        {
+                            let config = gpu_watch[id].config.clone().unwrap();
+                            let contexts = if gpu_available(&config) {
+                                panic::catch_unwind(|| gpu_init(&[config.clone()])).ok()
+                            } else {
+                                None
+                            };
+                            match contexts {
+                                Some(mut contexts) => {
+                                    let backoff = gpu_watch[id].backoff.clone();
+                                    let new_id = spawn_gpu(
+                                        contexts.pop().unwrap(),
+                                        GpuWatch::new(Some(config), backoff),
+                                        &tx,
+                                        &mut gpu_channels,
+                                        &mut gpu_active,
+                                        &mut gpu_worksizes,
+                                        &mut gpu_watch,
+                                        &mut gpu_threads,
+                                    );
+                                    info!("gpu {}: restarted as gpu {}", id, new_id);
+                                    if paused {
+                                        idle_gpus.push(new_id);
+                                    } else {
+                                        schedule_gpu_task(
+                                            &gpu_channels[new_id].0,
+                                            gpu_worksizes[new_id],
+                                            &mut accounts,
+                                            &round,
+                                            &mut orphans,
+                                            &mut gpu_watch[new_id],
+                                        );
+                                    }
+                                }
+                                None => {
+                                    let delay = gpu_watch[id].backoff.next();
+                                    warn!(
+                                        "gpu {}: restart failed, next attempt in {}s",
+                                        id,
+                                        delay.as_secs()
+                                    );
+                                    restart_gpu_later(tx.clone(), id, delay);
+                                }
+                            }
+                        }
+                    }
+                    HasherMessage::Control(command, tx_reply) => {
+                        let reply = match command {
+                            ControlCommand::Status => {
+                                #[cfg(feature = "opencl")]
+                                let gpu_list: Vec<String> = gpu_active
+                                    .iter()
+                                    .enumerate()
+                                    .filter(|(_, active)| **active)
+                                    .map(|(i, _)| format!("{}:{}", i, gpu_worksizes[i]))
+                                    .collect();
+                                #[cfg(not(feature = "opencl"))]
+                                let gpu_list: Vec<String> = Vec::new();
+                                format!(
+                                    "paused={}, engine={:?}, cpu_threads={}, cpu_task_size={}, \
+                                     cpu_tasks={}, gpus=[{}], height={}, nonces={}, \
+                                     capacity={}GiB, wasted={}, cached={}, requeued={}, \
+                                     memory={}/{}MiB",
+                                    paused,
+                                    simd_ext,
+                                    cpu_workers,
+                                    cpu_task_size,
+                                    cpu_tasks_in_flight,
+                                    gpu_list.join(", "),
+                                    round.height,
+                                    processed,
+                                    capacity(processed, &sw, blocktime),
+                                    stats.wasted.load(Ordering::Relaxed),
+                                    accounts.iter().map(|x| x.cached).sum::<u64>(),
+                                    orphans.nonces(),
+                                    memory_budget.used() / 1024 / 1024,
+                                    memory_budget.limit() / 1024 / 1024,
+                                )
+                            }
+                            ControlCommand::Pause => {
+                                paused = true;
+                                format!("paused, {} cpu tasks draining", cpu_tasks_in_flight)
+                            }
+                            ControlCommand::Resume => {
+                                paused = false;
+                                if !draining {
+                                    schedule_cpu_tasks(
+                                        &thread_pool,
+                                        &tx,
+                                        &memory_budget,
+                                        cpu_workers,
+                                        &mut cpu_tasks_in_flight,
+                                        &mut accounts,
+                                        cpu_task_size,
+                                        &round,
+                                        &simd_ext,
+                                        &sim_devices,
+                                        &nonce_cache,
+                                        &mut orphans,
+                                        &mut cpu_watch,
+                                    );
+                                }
+                                #[cfg(feature = "opencl")]
+                                for id in idle_gpus.drain(..) {
+                                    schedule_gpu_task(
+                                        &gpu_channels[id].0,
+                                        gpu_worksizes[id],
+                                        &mut accounts,
+                                        &round,
+                                        &mut orphans,
+                                        &mut gpu_watch[id],
+                                    );
+                                }
+                                "resumed".to_owned()
+                            }
+                            ControlCommand::CpuThreads(0) => {
+                                "error: cpu_threads must be at least 1, pause stops the cpu"
+                                    .to_owned()
+                            }
+                            ControlCommand::CpuThreads(threads) => {
+                                // capped like the configured cpu_threads at startup
+                                let threads = threads.min(max_cpu_threads);
+                                // the old pool finishes its tasks in the background
+                                thread_pool = create_thread_pool(threads);
+                                cpu_workers = threads as u64;
+                                cpu_watch.reset();
+                                if let Some(governor) = &mut cpu_governor {
+                                    governor.reset(cpu_workers, governor_sw.elapsed_ms() as u64);
+                                }
+                                if !paused && !draining {
+                                    schedule_cpu_tasks(
+                                        &thread_pool,
+                                        &tx,
+                                        &memory_budget,
+                                        cpu_workers,
+                                        &mut cpu_tasks_in_flight,
+                                        &mut accounts,
+                                        cpu_task_size,
+                                        &round,
+                                        &simd_ext,
+                                        &sim_devices,
+                                        &nonce_cache,
+                                        &mut orphans,
+                                        &mut cpu_watch,
+                                    );
+                                }
+                                format!(
+                                    "cpu_threads={}, {} cpu tasks in flight",
+                                    cpu_workers, cpu_tasks_in_flight
+                                )
+                            }
+                            ControlCommand::CpuTaskSize(size) => {
+                                cpu_task_size = (size / CPU_TASK_ALIGNMENT * CPU_TASK_ALIGNMENT)
+                                    .max(CPU_TASK_ALIGNMENT);
+                                format!("cpu_task_size={}", cpu_task_size)
+                            }
+                            ControlCommand::Engine(engine) => {
+                                if engine.supported() {
+                                    let reply = format!(
+                                        "engine={:?} from the next round, once the cpu tasks \
+                                         drained",
+                                        engine
+                                    );
+                                    pending_engine = Some(engine);
+                                    reply
+                                } else {
+                                    format!("error: {:?} isn't supported by this cpu", engine)
+                                }
+                            }
+                            #[cfg(feature = "opencl")]
+                            ControlCommand::GpuAdd(platform_id, device_id, cores) => {
+                                let config = GpuConfig::new(platform_id, device_id, cores);
+                                if sim_devices.is_some() {
+                                    "error: can't add gpus to a simulation".to_owned()
+                                } else if !gpu_available(&config) {
+                                    format!("error: no gpu {}:{}", platform_id, device_id)
+                                } else {
+                                    match panic::catch_unwind(|| gpu_init(&[config.clone()])) {
+                                        Ok(mut contexts) => {
+                                            let id = spawn_gpu(
+                                                contexts.pop().unwrap(),
+                                                GpuWatch::new(Some(config), Backoff::new()),
+                                                &tx,
+                                                &mut gpu_channels,
+                                                &mut gpu_active,
+                                                &mut gpu_worksizes,
+                                                &mut gpu_watch,
+                                                &mut gpu_threads,
+                                            );
+                                            if paused {
+                                                idle_gpus.push(id);
+                                            } else {
+                                                schedule_gpu_task(
+                                                    &gpu_channels[id].0,
+                                                    gpu_worksizes[id],
+                                                    &mut accounts,
+                                                    &round,
+                                                    &mut orphans,
+                                                    &mut gpu_watch[id],
+                                                );
+                                            }
+                                            format!(
+                                                "gpu {} added, worksize={}",
+                                                id, gpu_worksizes[id]
+                                            )
+                                        }
+                                        Err(_) => "error: gpu initialisation failed".to_owned(),
+                                    }
+                                }
+                            }
+                            #[cfg(feature = "opencl")]
+                            ControlCommand::GpuRemove(id) => {
+                                if id < gpu_active.len() && gpu_active[id] {
+                                    gpu_active[id] = false;
+                                    idle_gpus.retain(|&x| x != id);
+                                    // the thread exits after its current task
+                                    let _ = gpu_channels[id].0.send(None);
+                                    format!("gpu {} removed", id)
+                                } else {
+                                    format!("error: no active gpu {}", id)
+                                }
+                            }
+                            #[cfg(not(feature = "opencl"))]
+                            ControlCommand::GpuAdd(..) | ControlCommand::GpuRemove(_) => {
+                                "error: built without opencl".to_owned()
+                            }
+                        };
+                        let _ = tx_reply.send(reply);
+                    }
+                }
+                if draining && cpu_tasks_in_flight == 0 {
+                    switch_engine(&mut pending_engine, &mut simd_ext, &mut cpu_watch);
+                    draining = false;
+                    if !paused {
+                        schedule_cpu_tasks(
+                            &thread_pool,
+                            &tx,
+                            &memory_budget,
+                            cpu_workers,
+                            &mut cpu_tasks_in_flight,
+                            &mut accounts,
+                            cpu_task_size,
+                            &round,
+                            &simd_ext,
+                            &sim_devices,
+                            &nonce_cache,
+                            &mut orphans,
+                            &mut cpu_watch,
+                        );
+                    }
+                }
+                // the governor's window only runs while the cpu is busy, not in idle time
+                // between rounds or while paused
+                if let Some(governor) = &mut cpu_governor {
+                    let now = governor_sw.elapsed_ms() as u64;
+                    if cpu_tasks_in_flight == 0 {
+                        governor.pause(now);
+                    } else {
+                        governor.resume(now);
+                    }
                 }
                 if rx_rounds.len() > 0 {
                     break;
@@ -201,6 +841,222 @@ pub fn create_scheduler_thread(
     }
 }
 
+// initializes the pending engine, only while no cpu task runs
+fn switch_engine(
+    pending_engine: &mut Option<SimdExtension>,
+    simd_ext: &mut SimdExtension,
+    cpu_watch: &mut CpuWatch,
+) {
+    if let Some(engine) = pending_engine.take() {
+        engine.init();
+        info!("{: <80}", format!("cpu engine switched to {:?}", engine));
+        *simd_ext = engine;
+        cpu_watch.reset();
+    }
+}
+
+fn create_thread_pool(threads: usize) -> rayon::ThreadPool {
+    rayon::ThreadPoolBuilder::new()
+        .num_threads(threads)
+        .build()
+        .unwrap()
+}
+
+// capacity in GiB that hashes `processed` nonces in one blocktime
+fn capacity(processed: u64, sw: &Stopwatch, blocktime: u64) -> u64 {
+    processed * 250 * blocktime / 1024 / (1 + sw.elapsed_ms()) as u64
+}
+
+// starts the hasher thread of a new gpu, returns its id
+#[cfg(feature = "opencl")]
+fn spawn_gpu(
+    context: Arc<GpuContext>,
+    watch: GpuWatch,
+    tx: &Sender<HasherMessage>,
+    gpu_channels: &mut Vec<(Sender<Option<GpuTask>>, Receiver<Option<GpuTask>>)>,
+    gpu_active: &mut Vec<bool>,
+    gpu_worksizes: &mut Vec<u64>,
+    gpu_watch: &mut Vec<GpuWatch>,
+    gpu_threads: &mut Vec<thread::JoinHandle<()>>,
+) -> usize {
+    let id = gpu_channels.len();
+    gpu_channels.push(unbounded());
+    gpu_active.push(true);
+    gpu_worksizes.push(context.task_size() as u64);
+    gpu_watch.push(watch);
+    gpu_threads.push(thread::spawn(create_gpu_hasher_thread(
+        id,
+        context,
+        tx.clone(),
+        gpu_channels[id].1.clone(),
+    )));
+    id
+}
+
+// Takes a failed or hung gpu out of service and queues its task again. The id stays
+// inactive, a restarted context gets a new one so that a late report of a hung thread
+// can't be confused with it.
+#[cfg(feature = "opencl")]
+fn drop_gpu(
+    id: usize,
+    tx: &Sender<HasherMessage>,
+    gpu_active: &mut [bool],
+    idle_gpus: &mut Vec<usize>,
+    gpu_channels: &[(Sender<Option<GpuTask>>, Receiver<Option<GpuTask>>)],
+    gpu_watch: &mut [GpuWatch],
+    orphans: &mut Orphans,
+    round: &RoundInfo,
+) {
+    gpu_active[id] = false;
+    idle_gpus.retain(|&x| x != id);
+    let _ = gpu_channels[id].0.send(None);
+    if let Some((account, start_nonce, nonces, block)) = gpu_watch[id].abandon() {
+        if block == round.block {
+            orphans.push(account, start_nonce, nonces);
+        }
+    }
+    if gpu_watch[id].config.is_some() {
+        let delay = gpu_watch[id].backoff.next();
+        restart_gpu_later(tx.clone(), id, delay);
+    }
+}
+
+#[cfg(feature = "opencl")]
+fn schedule_gpu_task(
+    tx_gpu: &Sender<Option<GpuTask>>,
+    worksize: u64,
+    accounts: &mut [AccountState],
+    round: &RoundInfo,
+    orphans: &mut Orphans,
+    watch: &mut GpuWatch,
+) {
+    // ranges of failed tasks go first
+    let (i, start_nonce, task_size) = match orphans.take(worksize) {
+        Some(x) => x,
+        None => {
+            let i = next_account(accounts);
+            let account = &mut accounts[i];
+            let task_size = min(worksize, account.remaining());
+            let start_nonce = account.next_start_nonce();
+            account.requested += task_size;
+            (i, start_nonce, task_size)
+        }
+    };
+    tx_gpu
+        .send(Some(GpuTask {
+            account: i,
+            numeric_id: accounts[i].numeric_id,
+            local_startnonce: start_nonce,
+            local_nonces: task_size,
+            round: round.clone(),
+        }))
+        .unwrap();
+    watch.dispatched(i, start_nonce, task_size, round.block);
+}
+
+// Hands tasks to idle cpu workers as long as the memory budget admits them. If the budget is
+// short the task shrinks, if not even the smallest task fits the worker stays idle until
+// a running task returns its memory.
+fn schedule_cpu_tasks(
+    thread_pool: &rayon::ThreadPool,
+    tx: &Sender<HasherMessage>,
+    memory_budget: &MemoryBudget,
+    cpu_workers: u64,
+    cpu_tasks_in_flight: &mut u64,
+    accounts: &mut [AccountState],
+    cpu_task_size: u64,
+    round: &RoundInfo,
+    simd_ext: &SimdExtension,
+    sim_devices: &Option<Arc<SimDevices>>,
+    nonce_cache: &Option<Arc<NonceCache>>,
+    orphans: &mut Orphans,
+    cpu_watch: &mut CpuWatch,
+) {
+    while *cpu_tasks_in_flight < cpu_workers {
+        // ranges of failed tasks go first
+        let orphan = orphans.take(cpu_task_size);
+        let (i, task_size) = match orphan {
+            Some((i, _, nonces)) => (i, nonces),
+            None => {
+                let i = next_account(accounts);
+                (i, min(cpu_task_size, accounts[i].remaining()))
+            }
+        };
+        if task_size == 0 {
+            break;
+        }
+        // a small orphan may be below the alignment
+        let memory = match memory_budget.reserve(
+            task_size as usize * NONCE_SIZE,
+            min(task_size, CPU_TASK_ALIGNMENT) as usize * NONCE_SIZE,
+        ) {
+            Some(x) => x,
+            None => {
+                if let Some((i, start_nonce, nonces)) = orphan {
+                    orphans.push(i, start_nonce, nonces);
+                }
+                break;
+            }
+        };
+        let task_size = (memory.bytes() / NONCE_SIZE) as u64;
+        let account = &mut accounts[i];
+        let start_nonce = match orphan {
+            Some((i, start_nonce, nonces)) => {
+                orphans.push(i, start_nonce + task_size, nonces - task_size);
+                start_nonce
+            }
+            None => {
+                let start_nonce = account.next_start_nonce();
+                account.requested += task_size;
+                start_nonce
+            }
+        };
+        let task = CpuTask {
+            account: i,
+            numeric_id: account.numeric_id,
+            local_startnonce: start_nonce,
+            local_nonces: task_size,
+            round: round.clone(),
+            memory,
+            // Once the goal of the round is met, a better deadline is worth little. A task the
+            // nonce cache keeps as a whole then only generates nonces, next round rescans them.
+            scan: !(account.goal_met
+                && nonce_cache.as_ref().map_or(false, |x| {
+                    x.keeps(i, start_nonce, task_size, simd_ext.lanes())
+                })),
+            state: CpuTaskState::new(),
+        };
+        let block = round.block;
+        match sim_devices {
+            Some(sim_devices) => {
+                thread_pool.spawn(hash_cpu_sim(tx.clone(), task, sim_devices.clone()))
+            }
+            None => {
+                let state = task.state.clone();
+                cpu_watch.dispatched(state.clone(), i, start_nonce, task_size, block);
+                thread_pool.spawn(supervise_cpu_task(
+                    tx.clone(),
+                    state,
+                    i,
+                    start_nonce,
+                    task_size,
+                    block,
+                    hash_cpu(tx.clone(), task, simd_ext.clone(), nonce_cache.clone()),
+                ))
+            }
+        }
+        *cpu_tasks_in_flight += 1;
+    }
+}
+
+// The part of the memory budget left for the nonce cache once every cpu worker holds a buffer.
+fn cache_budget(nonce_cache_size: u64, max_memory: u64, worker_memory: u64) -> u64 {
+    if max_memory == 0 {
+        return nonce_cache_size;
+    }
+    nonce_cache_size.min(max_memory.saturating_sub(worker_memory))
+}
+
 fn print_status(processed: u64, sw: &Stopwatch, blocktime: u64) {
     let datetime = Local::now();
     print!(
@@ -215,3 +1071,43 @@ fn print_status(processed: u64, sw: &Stopwatch, blocktime: u64) {
         )
     );
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_next_account() {
+        let mut accounts: Vec<AccountState> = [1, 3]
+            .iter()
+            .enumerate()
+            .map(|(i, &weight)| AccountState {
+                numeric_id: i as u64,
+                start_nonce: 0,
+                weight,
+                cached: 0,
+                requested: 0,
+                processed: 0,
+                goal_met: false,
+            })
+            .collect();
+        for _ in 0..400 {
+            let i = next_account(&accounts);
+            accounts[i].requested += 64;
+        }
+        assert_eq!(accounts[0].requested, 100 * 64);
+        assert_eq!(accounts[1].requested, 300 * 64);
+    }
+
+    #[test]
+    fn test_cache_budget_leaves_worker_memory() {
+        assert_eq!(cache_budget(1 << 30, 0, 64 << 20), 1 << 30);
+        assert_eq!(cache_budget(256 << 20, 1 << 30, 64 << 20), 256 << 20);
+        // a cache as large as max_memory gets what the workers leave
+        assert_eq!(
+            cache_budget(1 << 30, 1 << 30, 64 << 20),
+            (1 << 30) - (64 << 20)
+        );
+        assert_eq!(cache_budget(1 << 30, 32 << 20, 64 << 20), 0);
+    }
+}
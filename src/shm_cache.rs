@@ -0,0 +1,331 @@
+//! Nonce cache segments in a shared memory file, e.g. /dev/shm/bencher, so that several
+//! bencher processes on a host share their cached nonces and a restarted one rescans them
+//! right away instead of starting cold.
+//!
+//! The file is a one page header followed by the segment data:
+//!
+//!   magic, version, lanes, slots in use, data bytes handed out,
+//!   MAX_SLOTS x (numeric_id, start_nonce, capacity, offset, nonces)
+//!
+//! One process at a time is the writer, it holds an exclusive flock on the file and is the
+//! only one that adds slots and appends nonces. It publishes a slot with a release store of
+//! the slot count and appended nonces with a release store of `nonces` after their data is
+//! written. Readers take no lock, they acquire-load the counters and only touch what those
+//! cover, data below `nonces` never changes. When the writer exits its lock is released and
+//! the next process that hashes new nonces takes over.
+
+use std::fs::{File, OpenOptions};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::thread;
+use std::time::Duration;
+
+// "BNCHSHM1"
+const MAGIC: u64 = 0x424e_4348_5348_4d31;
+const VERSION: u64 = 1;
+const HEADER_SIZE: usize = 4096;
+const MAX_SLOTS: usize = 64;
+
+#[repr(C)]
+struct Slot {
+    numeric_id: AtomicU64,
+    start_nonce: AtomicU64,
+    capacity: AtomicU64,
+    // of the data, relative to the end of the header
+    offset: AtomicU64,
+    nonces: AtomicU64,
+}
+
+#[repr(C)]
+struct Header {
+    magic: AtomicU64,
+    version: AtomicU64,
+    lanes: AtomicU64,
+    slots: AtomicU64,
+    used: AtomicU64,
+    slot: [Slot; MAX_SLOTS],
+}
+
+pub struct ShmCache {
+    file: File,
+    base: *mut u8,
+    size: usize,
+    writer: AtomicBool,
+}
+
+unsafe impl Send for ShmCache {}
+unsafe impl Sync for ShmCache {}
+
+/// A cached account, `offset` is relative to the start of the data.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct SlotInfo {
+    pub index: usize,
+    pub start_nonce: u64,
+    pub capacity: u64,
+    pub offset: u64,
+}
+
+impl ShmCache {
+    /// Opens or creates the cache file at `path`. A new file gets `size` bytes of data,
+    /// the layout of an existing one is kept, `lanes` has to match it.
+    pub fn open(path: &str, size: usize, lanes: usize) -> Result<ShmCache, String> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .open(path)
+            .map_err(|e| format!("can't open {}: {}", path, e))?;
+        let writer = sys::try_lock(&file);
+        let len = file.metadata().map_err(|e| e.to_string())?.len() as usize;
+        if writer && len < HEADER_SIZE {
+            file.set_len((HEADER_SIZE + size) as u64)
+                .map_err(|e| format!("can't size {}: {}", path, e))?;
+        }
+        // a writer that just created the file initializes it
+        let mut len = 0;
+        for _ in 0..20 {
+            len = file.metadata().map_err(|e| e.to_string())?.len() as usize;
+            if len >= HEADER_SIZE {
+                break;
+            }
+            thread::sleep(Duration::from_millis(100));
+        }
+        if len < HEADER_SIZE {
+            return Err(format!("{} isn't initialized", path));
+        }
+        let base = sys::map(&file, len).map_err(|e| format!("can't map {}: {}", path, e))?;
+        let cache = ShmCache {
+            file,
+            base,
+            size: len,
+            writer: AtomicBool::new(writer),
+        };
+        let header = cache.header();
+        if writer && header.magic.load(Ordering::Acquire) == 0 {
+            header.version.store(VERSION, Ordering::Relaxed);
+            header.lanes.store(lanes as u64, Ordering::Relaxed);
+            header.magic.store(MAGIC, Ordering::Release);
+        }
+        for _ in 0..20 {
+            if header.magic.load(Ordering::Acquire) == MAGIC {
+                break;
+            }
+            thread::sleep(Duration::from_millis(100));
+        }
+        if header.magic.load(Ordering::Acquire) != MAGIC
+            || header.version.load(Ordering::Relaxed) != VERSION
+        {
+            return Err(format!("{} isn't a bencher cache", path));
+        }
+        let file_lanes = header.lanes.load(Ordering::Relaxed);
+        if file_lanes != lanes as u64 {
+            return Err(format!(
+                "{} holds nonces for {} lanes, the engine uses {}",
+                path, file_lanes, lanes
+            ));
+        }
+        Ok(cache)
+    }
+
+    fn header(&self) -> &Header {
+        unsafe { &*(self.base as *const Header) }
+    }
+
+    /// True if this process is the writer, tries to take over if the writer exited.
+    pub fn writer(&self) -> bool {
+        if !self.writer.load(Ordering::Relaxed) && sys::try_lock(&self.file) {
+            info!("nonce cache: took over writing the shared cache");
+            self.writer.store(true, Ordering::Relaxed);
+        }
+        self.writer.load(Ordering::Relaxed)
+    }
+
+    pub fn find(&self, numeric_id: u64) -> Option<SlotInfo> {
+        let header = self.header();
+        let slots = header.slots.load(Ordering::Acquire) as usize;
+        header.slot[..slots.min(MAX_SLOTS)]
+            .iter()
+            .position(|x| x.numeric_id.load(Ordering::Relaxed) == numeric_id)
+            .map(|index| self.info(index))
+    }
+
+    fn info(&self, index: usize) -> SlotInfo {
+        let slot = &self.header().slot[index];
+        SlotInfo {
+            index,
+            start_nonce: slot.start_nonce.load(Ordering::Relaxed),
+            capacity: slot.capacity.load(Ordering::Relaxed),
+            offset: slot.offset.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Adds a slot for `numeric_id`, writer only. `capacity` shrinks to the data left, in
+    /// multiples of `granularity` nonces.
+    pub fn create(
+        &self,
+        numeric_id: u64,
+        start_nonce: u64,
+        capacity: u64,
+        granularity: u64,
+        nonce_size: usize,
+    ) -> Option<SlotInfo> {
+        if !self.writer() {
+            return None;
+        }
+        let header = self.header();
+        let slots = header.slots.load(Ordering::Relaxed) as usize;
+        if slots >= MAX_SLOTS {
+            return None;
+        }
+        let used = header.used.load(Ordering::Relaxed);
+        let left = (self.size - HEADER_SIZE) as u64 - used;
+        let capacity = capacity.min(left / nonce_size as u64) / granularity * granularity;
+        if capacity == 0 {
+            return None;
+        }
+        let slot = &header.slot[slots];
+        slot.numeric_id.store(numeric_id, Ordering::Relaxed);
+        slot.start_nonce.store(start_nonce, Ordering::Relaxed);
+        slot.capacity.store(capacity, Ordering::Relaxed);
+        slot.offset.store(used, Ordering::Relaxed);
+        slot.nonces.store(0, Ordering::Relaxed);
+        header
+            .used
+            .store(used + capacity * nonce_size as u64, Ordering::Relaxed);
+        header.slots.store(slots as u64 + 1, Ordering::Release);
+        Some(self.info(slots))
+    }
+
+    pub fn data(&self, slot: &SlotInfo) -> *mut u8 {
+        unsafe { self.base.add(HEADER_SIZE + slot.offset as usize) }
+    }
+
+    /// Nonces of the slot whose data is complete.
+    pub fn nonces(&self, slot: &SlotInfo) -> u64 {
+        self.header().slot[slot.index]
+            .nonces
+            .load(Ordering::Acquire)
+    }
+
+    pub fn publish(&self, slot: &SlotInfo, nonces: u64) {
+        self.header().slot[slot.index]
+            .nonces
+            .store(nonces, Ordering::Release);
+    }
+}
+
+impl Drop for ShmCache {
+    fn drop(&mut self) {
+        sys::unmap(self.base, self.size);
+    }
+}
+
+#[cfg(unix)]
+mod sys {
+    use libc::{c_int, c_void, size_t};
+    use std::fs::File;
+    use std::io;
+    use std::os::unix::io::AsRawFd;
+
+    const PROT_READ: c_int = 1;
+    const PROT_WRITE: c_int = 2;
+    const MAP_SHARED: c_int = 1;
+    const LOCK_EX: c_int = 2;
+    const LOCK_NB: c_int = 4;
+
+    extern "C" {
+        fn mmap(
+            addr: *mut c_void,
+            len: size_t,
+            prot: c_int,
+            flags: c_int,
+            fd: c_int,
+            offset: i64,
+        ) -> *mut c_void;
+        fn munmap(addr: *mut c_void, len: size_t) -> c_int;
+        fn flock(fd: c_int, operation: c_int) -> c_int;
+    }
+
+    // the lock is held until the file is closed
+    pub fn try_lock(file: &File) -> bool {
+        unsafe { flock(file.as_raw_fd(), LOCK_EX | LOCK_NB) == 0 }
+    }
+
+    pub fn map(file: &File, len: usize) -> io::Result<*mut u8> {
+        let ptr = unsafe {
+            mmap(
+                std::ptr::null_mut(),
+                len as size_t,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        // MAP_FAILED
+        if ptr as isize == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(ptr as *mut u8)
+    }
+
+    pub fn unmap(ptr: *mut u8, len: usize) {
+        unsafe {
+            munmap(ptr as *mut c_void, len as size_t);
+        }
+    }
+}
+
+#[cfg(not(unix))]
+mod sys {
+    use std::fs::File;
+    use std::io;
+
+    pub fn try_lock(_file: &File) -> bool {
+        false
+    }
+
+    pub fn map(_file: &File, _len: usize) -> io::Result<*mut u8> {
+        Err(io::Error::new(
+            io::ErrorKind::Other,
+            "shared caches are only supported on unix",
+        ))
+    }
+
+    pub fn unmap(_ptr: *mut u8, _len: usize) {}
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_shared_slots() {
+        let path = std::env::temp_dir().join(format!("bencher-shm-{}", std::process::id()));
+        let path = path.to_str().unwrap();
+        let _ = std::fs::remove_file(path);
+
+        let writer = ShmCache::open(path, 1 << 20, 8).unwrap();
+        assert!(writer.writer());
+        let slot = writer.create(42, 1000, 1 << 20, 8, 1024).unwrap();
+        // shrinks to the 1MiB of data
+        assert_eq!(slot.capacity, 1024);
+        assert!(writer.create(43, 0, 1 << 20, 8, 1024).is_none());
+        unsafe {
+            *writer.data(&slot) = 7;
+        }
+        writer.publish(&slot, 16);
+
+        // a second mapping, as another process would see it
+        let reader = ShmCache::open(path, 0, 8).unwrap();
+        assert!(!reader.writer());
+        let found = reader.find(42).unwrap();
+        assert_eq!(found, slot);
+        assert_eq!(reader.nonces(&found), 16);
+        assert_eq!(unsafe { *reader.data(&found) }, 7);
+        assert!(reader.find(43).is_none());
+        assert!(ShmCache::open(path, 0, 16).is_err());
+
+        drop(writer);
+        let _ = std::fs::remove_file(path);
+    }
+}
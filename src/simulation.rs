@@ -0,0 +1,425 @@
+//! Offline replay of recorded rounds through the scheduler.
+//!
+//! With `round_log` set the miner appends every new round to a timeline file. `bencher
+//! simulate` replays such a timeline with the recorded block intervals (optionally sped up)
+//! through `create_scheduler_thread`, either on simulated devices that hash at a configured
+//! rate or on the real cpu engines. Simulated devices sample their deadlines from the exact
+//! distribution, seeded by the nonce range, so every policy sees the same deadlines for the
+//! same nonces.
+
+use crate::com::api::MiningInfoResponse as MiningInfo;
+use crate::config::Cfg;
+use crate::cpu_hasher::{CpuTask, SimdExtension};
+use crate::governor::Governor;
+#[cfg(feature = "opencl")]
+use crate::gpu_hasher::GpuTask;
+use crate::load_test::sample_best_deadline;
+use crate::miner::NonceData;
+use crate::poc_hashing;
+use crate::scheduler::{create_scheduler_thread, HasherMessage, RoundInfo, SchedulerStats};
+#[cfg(feature = "opencl")]
+use crossbeam_channel::Receiver;
+use crossbeam_channel::{unbounded, Sender};
+use futures::stream::Stream;
+use futures::sync::mpsc;
+use rand::rngs::StdRng;
+use rand::{Rng, SeedableRng};
+use std::fs::{self, OpenOptions};
+use std::io::Write;
+use std::sync::atomic::Ordering;
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+#[derive(Debug, Serialize, Deserialize)]
+pub struct RecordedRound {
+    // unix time in ms
+    pub time: u64,
+    pub height: u64,
+    pub base_target: u64,
+    pub generation_signature: String,
+}
+
+/// Appends a round to the timeline at `path`.
+pub fn record_round(path: &str, mining_info: &MiningInfo) {
+    let round = RecordedRound {
+        time: SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .map(|x| x.as_secs() * 1000 + u64::from(x.subsec_millis()))
+            .unwrap_or(0),
+        height: mining_info.height,
+        base_target: mining_info.base_target,
+        generation_signature: mining_info.generation_signature.clone(),
+    };
+    let res = OpenOptions::new()
+        .create(true)
+        .append(true)
+        .open(path)
+        .and_then(|mut file| writeln!(file, "{}", serde_json::to_string(&round).unwrap()));
+    if let Err(e) = res {
+        warn!("can't record round to {}: {}", path, e);
+    }
+}
+
+#[derive(Clone, Debug)]
+pub struct SimGpu {
+    // nonces per second
+    pub rate: f64,
+    pub worksize: u64,
+}
+
+pub struct SimDevices {
+    // nonces per second of every cpu worker
+    pub cpu_rate: f64,
+    pub gpus: Vec<SimGpu>,
+    pub speedup: f64,
+}
+
+// Takes as long as the device needs for the task and returns the best deadline and its offset.
+fn simulate_task(
+    numeric_id: u64,
+    start_nonce: u64,
+    nonces: u64,
+    round: &RoundInfo,
+    rate: f64,
+    speedup: f64,
+) -> (u64, u64) {
+    let secs = nonces as f64 / (rate * speedup).max(1.0);
+    thread::sleep(Duration::from_micros((secs * 1_000_000.0) as u64));
+    let mut rng = StdRng::seed_from_u64(
+        numeric_id ^ start_nonce.rotate_left(20) ^ round.height.rotate_left(40),
+    );
+    let deadline = sample_best_deadline(&mut rng, nonces);
+    (deadline, rng.gen_range(0, nonces.max(1)))
+}
+
+pub fn hash_cpu_sim(
+    tx: Sender<HasherMessage>,
+    hasher_task: CpuTask,
+    sim_devices: Arc<SimDevices>,
+) -> impl FnOnce() {
+    move || {
+        let (deadline, offset) = simulate_task(
+            hasher_task.numeric_id,
+            hasher_task.local_startnonce,
+            hasher_task.local_nonces,
+            &hasher_task.round,
+            sim_devices.cpu_rate,
+            sim_devices.speedup,
+        );
+        drop(hasher_task.memory);
+
+        tx.send(HasherMessage::NoncesProcessed(
+            hasher_task.account,
+            hasher_task.local_nonces,
+            hasher_task.round.block,
+        ))
+        .expect("CPU task can't communicate with scheduler thread.");
+
+        tx.send(HasherMessage::SubmitDeadline((
+            hasher_task.account,
+            hasher_task.round.height,
+            hasher_task.local_startnonce + offset,
+            deadline,
+            hasher_task.round.block,
+        )))
+        .expect("CPU task can't communicate with scheduler thread.");
+
+        tx.send(HasherMessage::CpuRequestForWork(hasher_task.local_nonces))
+            .expect("CPU task can't communicate with scheduler thread.");
+    }
+}
+
+#[cfg(feature = "opencl")]
+pub fn create_sim_gpu_thread(
+    gpu_id: usize,
+    gpu: SimGpu,
+    speedup: f64,
+    tx: Sender<HasherMessage>,
+    rx_hasher_task: Receiver<Option<GpuTask>>,
+) -> impl FnOnce() {
+    move || {
+        for task in rx_hasher_task {
+            let task = match task {
+                Some(x) => x,
+                None => break,
+            };
+            let (deadline, offset) = simulate_task(
+                task.numeric_id,
+                task.local_startnonce,
+                task.local_nonces,
+                &task.round,
+                gpu.rate,
+                speedup,
+            );
+
+            tx.send(HasherMessage::NoncesProcessed(
+                task.account,
+                task.local_nonces,
+                task.round.block,
+            ))
+            .expect("GPU task can't communicate with scheduler thread.");
+
+            tx.send(HasherMessage::SubmitDeadline((
+                task.account,
+                task.round.height,
+                task.local_startnonce + offset,
+                deadline,
+                task.round.block,
+            )))
+            .expect("GPU task can't communicate with scheduler thread.");
+
+            tx.send(HasherMessage::GpuRequestForWork(gpu_id))
+                .expect("GPU task can't communicate with scheduler thread.");
+        }
+    }
+}
+
+#[derive(Default, Clone)]
+struct RoundResult {
+    height: u64,
+    duration_ms: u64,
+    first_deadline_ms: Option<u64>,
+    best_deadline: Option<u64>,
+    processed: u64,
+    wasted: u64,
+}
+
+pub fn load_timeline(path: &str) -> Result<Vec<RecordedRound>, String> {
+    let content = fs::read_to_string(path).map_err(|e| e.to_string())?;
+    let mut rounds = Vec::new();
+    for (i, line) in content.lines().enumerate() {
+        if line.trim().is_empty() {
+            continue;
+        }
+        let round: RecordedRound =
+            serde_json::from_str(line).map_err(|e| format!("line {}: {}", i + 1, e))?;
+        rounds.push(round);
+    }
+    if rounds.is_empty() {
+        return Err("timeline is empty".to_owned());
+    }
+    Ok(rounds)
+}
+
+/// Replays `rounds` through the scheduler and logs the per round results and a summary.
+/// `sim_devices` None hashes with the real cpu engine.
+pub fn run(
+    cfg: &Cfg,
+    rounds: Vec<RecordedRound>,
+    cpu_threads: usize,
+    simd_ext: SimdExtension,
+    sim_devices: Option<SimDevices>,
+    speedup: f64,
+) {
+    info!(
+        "simulate: rounds={}, speedup={}, engine={}",
+        rounds.len(),
+        speedup,
+        match &sim_devices {
+            Some(x) => format!(
+                "simulated (cpu {:.0} nonces/s x {}, {} gpus)",
+                x.cpu_rate,
+                cpu_threads,
+                x.gpus.len()
+            ),
+            None => format!("real ({:?} x {})", simd_ext, cpu_threads),
+        }
+    );
+
+    let (tx_rounds, rx_rounds) = unbounded();
+    let (tx_nonce_data, rx_nonce_data) = mpsc::unbounded::<NonceData>();
+    let stats = Arc::new(SchedulerStats::default());
+    thread::spawn(create_scheduler_thread(
+        cfg.accounts(),
+        cpu_threads as u8,
+        cpu_threads,
+        cfg.cpu_worker_task_size,
+        // configured in MiB
+        cfg.max_memory * 1024 * 1024,
+        cfg.nonce_cache_size * 1024 * 1024,
+        cfg.nonce_cache_shm.clone(),
+        cfg.cache_build_deadline,
+        cfg.nonce_cache_gpu,
+        Governor::new(cpu_threads as u64, cfg.cpu_governor, cfg.cpu_governor_window),
+        simd_ext,
+        if sim_devices.is_some() {
+            Vec::new()
+        } else {
+            cfg.gpus.clone()
+        },
+        cfg.blocktime,
+        rx_rounds,
+        tx_nonce_data,
+        unbounded(),
+        sim_devices.map(Arc::new),
+        stats.clone(),
+    ));
+
+    let results = Arc::new(Mutex::new(vec![RoundResult::default(); rounds.len()]));
+    let starts: Arc<Mutex<Vec<Instant>>> = Arc::new(Mutex::new(Vec::new()));
+    {
+        let results = results.clone();
+        let starts = starts.clone();
+        thread::spawn(move || {
+            for nonce_data in rx_nonce_data.wait() {
+                let nonce_data = match nonce_data {
+                    Ok(x) => x,
+                    Err(_) => break,
+                };
+                let round = nonce_data.block as usize - 1;
+                let start = starts.lock().unwrap()[round];
+                let mut results = results.lock().unwrap();
+                let result = &mut results[round];
+                if result.first_deadline_ms.is_none() {
+                    result.first_deadline_ms = Some(elapsed_ms(start));
+                }
+                if result
+                    .best_deadline
+                    .map_or(true, |x| nonce_data.deadline_adjusted < x)
+                {
+                    result.best_deadline = Some(nonce_data.deadline_adjusted);
+                }
+            }
+        });
+    }
+
+    let mut last_processed = 0;
+    let mut last_wasted = 0;
+    for (i, round) in rounds.iter().enumerate() {
+        let gensig = poc_hashing::decode_gensig(&round.generation_signature);
+        starts.lock().unwrap().push(Instant::now());
+        tx_rounds
+            .send(RoundInfo {
+                gensig,
+                base_target: round.base_target,
+                scoop: poc_hashing::calculate_scoop(round.height, &gensig).into(),
+                height: round.height,
+                block: i as u64 + 1,
+                target_deadline: cfg.target_deadline,
+            })
+            .expect("simulation can't communicate with scheduler thread");
+
+        // the last round lasts one blocktime
+        let duration_ms = match rounds.get(i + 1) {
+            Some(next) => next.time.saturating_sub(round.time),
+            None => cfg.blocktime * 1000,
+        };
+        let duration_ms = (duration_ms as f64 / speedup) as u64;
+        thread::sleep(Duration::from_millis(duration_ms));
+
+        let processed = stats.processed.load(Ordering::Relaxed);
+        let wasted = stats.wasted.load(Ordering::Relaxed);
+        let mut results = results.lock().unwrap();
+        let result = &mut results[i];
+        result.height = round.height;
+        result.duration_ms = duration_ms;
+        result.processed = processed - last_processed;
+        result.wasted = wasted - last_wasted;
+        last_processed = processed;
+        last_wasted = wasted;
+        info!("{: <80}", format_round(result));
+    }
+
+    let results = results.lock().unwrap();
+    for line in summarize(&results) {
+        info!("{: <80}", line);
+    }
+}
+
+fn elapsed_ms(start: Instant) -> u64 {
+    let elapsed = start.elapsed();
+    elapsed.as_secs() * 1000 + u64::from(elapsed.subsec_millis())
+}
+
+fn format_round(result: &RoundResult) -> String {
+    format!(
+        "round: height={}, duration={}ms, first_deadline={}, best_deadline={}, nonces={}, \
+         wasted={}",
+        result.height,
+        result.duration_ms,
+        result
+            .first_deadline_ms
+            .map_or("none".to_owned(), |x| format!("{}ms", x)),
+        result
+            .best_deadline
+            .map_or("none".to_owned(), |x| x.to_string()),
+        result.processed,
+        result.wasted
+    )
+}
+
+// value at quantile `q` of sorted `values`
+fn quantile(values: &[u64], q: f64) -> u64 {
+    if values.is_empty() {
+        return 0;
+    }
+    values[((values.len() - 1) as f64 * q).round() as usize]
+}
+
+fn summarize(results: &[RoundResult]) -> Vec<String> {
+    let processed: u64 = results.iter().map(|x| x.processed).sum();
+    let wasted: u64 = results.iter().map(|x| x.wasted).sum();
+    let mut first_deadlines: Vec<u64> =
+        results.iter().filter_map(|x| x.first_deadline_ms).collect();
+    let mut best_deadlines: Vec<u64> = results.iter().filter_map(|x| x.best_deadline).collect();
+    first_deadlines.sort();
+    best_deadlines.sort();
+    vec![
+        format!(
+            "simulate: rounds={}, nonces={}, wasted={} ({:.2}%)",
+            results.len(),
+            processed,
+            wasted,
+            wasted as f64 * 100.0 / processed.max(1) as f64
+        ),
+        format!(
+            "time to first deadline: p50={}ms, p90={}ms, max={}ms, rounds without deadline={}",
+            quantile(&first_deadlines, 0.5),
+            quantile(&first_deadlines, 0.9),
+            first_deadlines.last().cloned().unwrap_or(0),
+            results.len() - first_deadlines.len()
+        ),
+        format!(
+            "best deadline: min={}, p10={}, p50={}, p90={}, max={}",
+            best_deadlines.first().cloned().unwrap_or(0),
+            quantile(&best_deadlines, 0.1),
+            quantile(&best_deadlines, 0.5),
+            quantile(&best_deadlines, 0.9),
+            best_deadlines.last().cloned().unwrap_or(0)
+        ),
+    ]
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_summarize() {
+        let results: Vec<RoundResult> = (0..10)
+            .map(|i| RoundResult {
+                height: i,
+                duration_ms: 1000,
+                first_deadline_ms: if i == 0 { None } else { Some(i * 10) },
+                best_deadline: Some(i * 100),
+                processed: 90,
+                wasted: 10,
+            })
+            .collect();
+        let summary = summarize(&results);
+        assert!(summary[0].contains("wasted=100 (11.11%)"));
+        assert!(summary[1].contains("p50=50ms"));
+        assert!(summary[1].contains("rounds without deadline=1"));
+        assert!(summary[2].contains("min=0, p10=100"));
+    }
+
+    #[test]
+    fn test_recorded_round() {
+        let line =
+            "{\"time\":1000,\"height\":5,\"base_target\":70000,\"generation_signature\":\"ab\"}";
+        let round: RecordedRound = serde_json::from_str(line).unwrap();
+        assert_eq!(round.height, 5);
+        assert_eq!(round.base_target, 70000);
+    }
+}
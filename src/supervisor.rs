@@ -0,0 +1,356 @@
+//! Recovery of failed hashing workers.
+//!
+//! A panicking cpu task or gpu thread reports its nonce range, which goes back into the
+//! orphan queue and is handed out again before new nonces. Cpu and gpu tasks also get a
+//! deadline, a task that doesn't finish in time is considered hung. Failed and hung gpus are
+//! dropped and their device context is created again with exponential backoff. The thread of
+//! a hung gpu or cpu task can't be stopped and is left behind, the cpu gets a new pool.
+
+#[cfg(feature = "opencl")]
+use crate::ocl::GpuConfig;
+use crate::scheduler::HasherMessage;
+use crossbeam_channel::Sender;
+use std::panic::{self, AssertUnwindSafe};
+use std::sync::atomic::{AtomicU8, Ordering};
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, Instant};
+
+const BACKOFF_MIN: Duration = Duration::from_secs(1);
+const BACKOFF_MAX: Duration = Duration::from_secs(300);
+// a task may take this many times as long as the slowest one finished so far
+const TIMEOUT_FACTOR: u32 = 8;
+const TIMEOUT_MIN: Duration = Duration::from_secs(60);
+const HEARTBEAT_INTERVAL: Duration = Duration::from_secs(1);
+
+// states of a cpu task
+const RUNNING: u8 = 0;
+const REPORTED: u8 = 1;
+const FINISHED: u8 = 2;
+const ABANDONED: u8 = 3;
+
+/// Delays between restart attempts, doubling up to BACKOFF_MAX.
+#[derive(Clone)]
+pub struct Backoff {
+    next: Duration,
+}
+
+impl Backoff {
+    pub fn new() -> Backoff {
+        Backoff { next: BACKOFF_MIN }
+    }
+
+    pub fn next(&mut self) -> Duration {
+        let delay = self.next;
+        self.next = (self.next * 2).min(BACKOFF_MAX);
+        delay
+    }
+
+    pub fn reset(&mut self) {
+        self.next = BACKOFF_MIN;
+    }
+}
+
+/// Nonce ranges of failed tasks of the current round, (account, start_nonce, nonces).
+#[derive(Default)]
+pub struct Orphans {
+    ranges: Vec<(usize, u64, u64)>,
+}
+
+impl Orphans {
+    pub fn push(&mut self, account: usize, start_nonce: u64, nonces: u64) {
+        if nonces > 0 {
+            self.ranges.push((account, start_nonce, nonces));
+        }
+    }
+
+    /// Up to `max` nonces of one range.
+    pub fn take(&mut self, max: u64) -> Option<(usize, u64, u64)> {
+        let (account, start_nonce, nonces) = self.ranges.pop()?;
+        if nonces > max {
+            self.ranges.push((account, start_nonce + max, nonces - max));
+            return Some((account, start_nonce, max));
+        }
+        Some((account, start_nonce, nonces))
+    }
+
+    pub fn nonces(&self) -> u64 {
+        self.ranges.iter().map(|x| x.2).sum()
+    }
+
+    pub fn clear(&mut self) {
+        self.ranges.clear();
+    }
+}
+
+/// Progress of a cpu task, shared by the task and the scheduler. A task only reports its
+/// nonces while the scheduler hasn't given up on it, so a range is either counted or handed
+/// out again, never both.
+#[derive(Clone)]
+pub struct CpuTaskState(Arc<AtomicU8>);
+
+impl CpuTaskState {
+    pub fn new() -> CpuTaskState {
+        CpuTaskState(Arc::new(AtomicU8::new(RUNNING)))
+    }
+
+    /// Called before the task reports its nonces, false if it was abandoned meanwhile.
+    pub fn report(&self) -> bool {
+        self.transition(RUNNING, REPORTED)
+    }
+
+    /// Called before the task asks for new work.
+    pub fn finish(&self) {
+        self.0.store(FINISHED, Ordering::SeqCst);
+    }
+
+    fn transition(&self, from: u8, to: u8) -> bool {
+        self.0
+            .compare_exchange(from, to, Ordering::SeqCst, Ordering::SeqCst)
+            .is_ok()
+    }
+
+    fn get(&self) -> u8 {
+        self.0.load(Ordering::SeqCst)
+    }
+}
+
+/// Runs a cpu task, if it panics the scheduler gets its range back and the worker slot freed.
+pub fn supervise_cpu_task(
+    tx: Sender<HasherMessage>,
+    state: CpuTaskState,
+    account: usize,
+    start_nonce: u64,
+    nonces: u64,
+    block: u64,
+    task: impl FnOnce(),
+) -> impl FnOnce() {
+    move || {
+        if panic::catch_unwind(AssertUnwindSafe(task)).is_err() {
+            // nonces the task reported aren't hashed again, an abandoned task's slot is
+            // already free
+            let nonces = if state.transition(RUNNING, ABANDONED) {
+                nonces
+            } else if state.transition(REPORTED, FINISHED) {
+                0
+            } else {
+                return;
+            };
+            let _ = tx.send(HasherMessage::CpuTaskFailed(
+                account,
+                start_nonce,
+                nonces,
+                block,
+            ));
+        }
+    }
+}
+
+/// The cpu tasks in flight. Their deadline scales with their size, by the slowest time per
+/// nonce of a finished task. Until one finished there's no deadline.
+#[derive(Default)]
+pub struct CpuWatch {
+    // (dispatched, state, account, start_nonce, nonces, block)
+    tasks: Vec<(Instant, CpuTaskState, usize, u64, u64, u64)>,
+    slowest_per_nonce: Option<Duration>,
+}
+
+impl CpuWatch {
+    pub fn dispatched(
+        &mut self,
+        state: CpuTaskState,
+        account: usize,
+        start_nonce: u64,
+        nonces: u64,
+        block: u64,
+    ) {
+        self.tasks
+            .push((Instant::now(), state, account, start_nonce, nonces, block));
+    }
+
+    /// Forgets finished and failed tasks, the finished ones set the deadlines.
+    pub fn finished(&mut self, now: Instant) {
+        let mut slowest = self.slowest_per_nonce;
+        self.tasks
+            .retain(|(dispatched, state, _, _, nonces, _)| match state.get() {
+                FINISHED => {
+                    let per_nonce = (now - *dispatched) / (*nonces).max(1) as u32;
+                    slowest = Some(slowest.map_or(per_nonce, |x| x.max(per_nonce)));
+                    false
+                }
+                ABANDONED => false,
+                _ => true,
+            });
+        self.slowest_per_nonce = slowest;
+    }
+
+    /// Gives up on the tasks past their deadline, returns their ranges,
+    /// (account, start_nonce, nonces, block).
+    pub fn abandon_timed_out(&mut self, now: Instant) -> Vec<(usize, u64, u64, u64)> {
+        self.finished(now);
+        let per_nonce = match self.slowest_per_nonce {
+            Some(x) => x,
+            None => return Vec::new(),
+        };
+        let mut abandoned = Vec::new();
+        self.tasks
+            .retain(|(dispatched, state, account, start_nonce, nonces, block)| {
+                let timeout = (per_nonce * *nonces as u32 * TIMEOUT_FACTOR).max(TIMEOUT_MIN);
+                // a task that reported already is about to ask for work
+                if now - *dispatched > timeout && state.transition(RUNNING, ABANDONED) {
+                    abandoned.push((*account, *start_nonce, *nonces, *block));
+                    false
+                } else {
+                    true
+                }
+            });
+        abandoned
+    }
+
+    /// Forgets the timings, e.g. after the engine or the thread count changed.
+    pub fn reset(&mut self) {
+        self.slowest_per_nonce = None;
+    }
+}
+
+/// The task a gpu is working on and what's needed to bring the gpu back.
+#[cfg(feature = "opencl")]
+pub struct GpuWatch {
+    // None for simulated gpus
+    pub config: Option<GpuConfig>,
+    pub backoff: Backoff,
+    // (dispatched, account, start_nonce, nonces, block)
+    task: Option<(Instant, usize, u64, u64, u64)>,
+    slowest: Duration,
+    // TIMEOUT_MIN per work size of a task, a persistent task is one long kernel launch
+    timeout_min: Duration,
+}
+
+#[cfg(feature = "opencl")]
+impl GpuWatch {
+    pub fn new(config: Option<GpuConfig>, backoff: Backoff) -> GpuWatch {
+        let worksizes = config.as_ref().map_or(1, GpuConfig::worksizes_per_task);
+        GpuWatch {
+            config,
+            backoff,
+            task: None,
+            slowest: Duration::from_secs(0),
+            timeout_min: TIMEOUT_MIN * worksizes,
+        }
+    }
+
+    pub fn dispatched(&mut self, account: usize, start_nonce: u64, nonces: u64, block: u64) {
+        self.task = Some((Instant::now(), account, start_nonce, nonces, block));
+    }
+
+    pub fn finished(&mut self) {
+        if let Some((dispatched, ..)) = self.task.take() {
+            self.slowest = self.slowest.max(dispatched.elapsed());
+            self.backoff.reset();
+        }
+    }
+
+    pub fn timed_out(&self) -> bool {
+        match self.task {
+            Some((dispatched, ..)) => {
+                dispatched.elapsed() > (self.slowest * TIMEOUT_FACTOR).max(self.timeout_min)
+            }
+            None => false,
+        }
+    }
+
+    /// The range of the unfinished task, (account, start_nonce, nonces, block).
+    pub fn abandon(&mut self) -> Option<(usize, u64, u64, u64)> {
+        self.task
+            .take()
+            .map(|(_, account, start_nonce, nonces, block)| (account, start_nonce, nonces, block))
+    }
+}
+
+/// Sends a heartbeat to the scheduler every HEARTBEAT_INTERVAL, so that it checks the task
+/// deadlines while no worker reports.
+pub fn start_heartbeat(tx: Sender<HasherMessage>) {
+    thread::spawn(move || loop {
+        thread::sleep(HEARTBEAT_INTERVAL);
+        if tx.send(HasherMessage::Heartbeat).is_err() {
+            break;
+        }
+    });
+}
+
+/// Asks the scheduler to create the context of gpu `id` again after `delay`.
+#[cfg(feature = "opencl")]
+pub fn restart_gpu_later(tx: Sender<HasherMessage>, id: usize, delay: Duration) {
+    thread::spawn(move || {
+        thread::sleep(delay);
+        let _ = tx.send(HasherMessage::GpuRestart(id));
+    });
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_backoff() {
+        let mut backoff = Backoff::new();
+        assert_eq!(backoff.next(), Duration::from_secs(1));
+        assert_eq!(backoff.next(), Duration::from_secs(2));
+        for _ in 0..20 {
+            backoff.next();
+        }
+        assert_eq!(backoff.next(), BACKOFF_MAX);
+        backoff.reset();
+        assert_eq!(backoff.next(), Duration::from_secs(1));
+    }
+
+    #[test]
+    fn test_orphans_split_to_task_size() {
+        let mut orphans = Orphans::default();
+        orphans.push(1, 1000, 100);
+        orphans.push(0, 0, 0);
+        assert_eq!(orphans.nonces(), 100);
+        assert_eq!(orphans.take(64), Some((1, 1000, 64)));
+        assert_eq!(orphans.take(64), Some((1, 1064, 36)));
+        assert_eq!(orphans.take(64), None);
+    }
+
+    #[test]
+    fn test_cpu_task_reported_once() {
+        // a task that reported its nonces can't be abandoned, one that was can't report
+        let state = CpuTaskState::new();
+        assert!(state.report());
+        assert!(!state.transition(RUNNING, ABANDONED));
+        let state = CpuTaskState::new();
+        assert!(state.transition(RUNNING, ABANDONED));
+        assert!(!state.report());
+    }
+
+    #[test]
+    fn test_cpu_watch_abandons_hung_tasks() {
+        let mut watch = CpuWatch::default();
+        let start = Instant::now();
+        let done = CpuTaskState::new();
+        let hung = CpuTaskState::new();
+        watch.dispatched(done.clone(), 0, 0, 100, 7);
+        watch.dispatched(hung.clone(), 1, 500, 100, 7);
+        // no deadline until a task finished
+        assert!(watch
+            .abandon_timed_out(start + Duration::from_secs(3600))
+            .is_empty());
+
+        // 100ms per nonce, the hung task of 100 nonces may take 80s
+        assert!(done.report());
+        done.finish();
+        watch.finished(start + Duration::from_secs(10));
+        assert!(watch
+            .abandon_timed_out(start + Duration::from_secs(79))
+            .is_empty());
+        assert_eq!(
+            watch.abandon_timed_out(start + Duration::from_secs(81)),
+            vec![(1, 500, 100, 7)]
+        );
+        assert!(!hung.report());
+        assert!(watch.tasks.is_empty());
+    }
+}
@@ -0,0 +1,256 @@
+//! Optional tracing of the block lifecycle in the chrome trace event format.
+//!
+//! Spans are recorded into a per-thread buffer without any locking and handed over in
+//! batches to a writer thread, which appends them to `trace_file`. The file can be loaded
+//! into chrome://tracing or https://ui.perfetto.dev. The closing bracket of the json array
+//! is never written, both viewers accept that, so the file stays valid if bencher is killed.
+
+use crossbeam_channel::{unbounded, Sender};
+use std::cell::RefCell;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::Once;
+use std::thread;
+use std::time::Instant;
+
+// hand over the thread buffer once it holds this many events or is older than a second
+const FLUSH_EVENTS: usize = 256;
+const FLUSH_INTERVAL_US: u64 = 1_000_000;
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static NEXT_TID: AtomicUsize = AtomicUsize::new(1);
+static INIT: Once = Once::new();
+
+// only written once in `init`, before ENABLED is set
+static mut EPOCH: Option<Instant> = None;
+static mut SINK: Option<Sender<Vec<Event>>> = None;
+
+enum Event {
+    Span {
+        name: &'static str,
+        cat: &'static str,
+        ts: u64,
+        dur: u64,
+        tid: usize,
+        arg: Option<(&'static str, u64)>,
+    },
+    ThreadName {
+        tid: usize,
+        name: String,
+    },
+}
+
+struct ThreadBuffer {
+    tid: usize,
+    events: Vec<Event>,
+    last_flush: u64,
+}
+
+impl ThreadBuffer {
+    fn new() -> Self {
+        let tid = NEXT_TID.fetch_add(1, Ordering::Relaxed);
+        let name = thread::current()
+            .name()
+            .map_or(format!("thread-{}", tid), |x| x.to_owned());
+        ThreadBuffer {
+            tid,
+            events: vec![Event::ThreadName { tid, name }],
+            last_flush: now(),
+        }
+    }
+
+    fn push(&mut self, event: Event) {
+        self.events.push(event);
+        let ts = now();
+        if self.events.len() >= FLUSH_EVENTS || ts - self.last_flush >= FLUSH_INTERVAL_US {
+            self.flush();
+            self.last_flush = ts;
+        }
+    }
+
+    fn flush(&mut self) {
+        if self.events.is_empty() {
+            return;
+        }
+        let events = std::mem::replace(&mut self.events, Vec::with_capacity(FLUSH_EVENTS));
+        if let Some(sink) = unsafe { SINK.as_ref() } {
+            let _ = sink.send(events);
+        }
+    }
+}
+
+impl Drop for ThreadBuffer {
+    fn drop(&mut self) {
+        self.flush();
+    }
+}
+
+thread_local! {
+    static BUFFER: RefCell<ThreadBuffer> = RefCell::new(ThreadBuffer::new());
+}
+
+/// Starts the trace writer, an empty path leaves tracing disabled.
+pub fn init(path: &str) {
+    if path.is_empty() {
+        return;
+    }
+    INIT.call_once(|| {
+        let file = match File::create(path) {
+            Ok(x) => x,
+            Err(e) => {
+                error!("can't create trace file {}: {}", path, e);
+                return;
+            }
+        };
+        let (tx, rx) = unbounded::<Vec<Event>>();
+        unsafe {
+            EPOCH = Some(Instant::now());
+            SINK = Some(tx);
+        }
+        thread::spawn(move || {
+            let mut writer = BufWriter::new(file);
+            let _ = writer.write_all(b"[\n");
+            for events in rx {
+                for event in events {
+                    let _ = writeln!(writer, "{},", to_json(&event));
+                }
+                let _ = writer.flush();
+            }
+        });
+        ENABLED.store(true, Ordering::Release);
+        info!("tracing to {}", path);
+    });
+}
+
+#[inline]
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Acquire)
+}
+
+/// Microseconds since tracing started, 0 if tracing is disabled.
+pub fn now() -> u64 {
+    match unsafe { EPOCH.as_ref() } {
+        Some(epoch) if enabled() => {
+            let elapsed = epoch.elapsed();
+            elapsed.as_secs() * 1_000_000 + u64::from(elapsed.subsec_micros())
+        }
+        _ => 0,
+    }
+}
+
+/// Records a span from `start` (taken with `now()`) until now. Used for work that isn't
+/// bound to a scope, e.g. futures.
+pub fn record(name: &'static str, cat: &'static str, start: u64, arg: Option<(&'static str, u64)>) {
+    if !enabled() {
+        return;
+    }
+    let end = now();
+    let _ = BUFFER.try_with(|buffer| {
+        let mut buffer = buffer.borrow_mut();
+        let tid = buffer.tid;
+        buffer.push(Event::Span {
+            name,
+            cat,
+            ts: start,
+            dur: end.saturating_sub(start),
+            tid,
+            arg,
+        });
+    });
+}
+
+/// Hands the events of the current thread to the writer.
+pub fn flush() {
+    if !enabled() {
+        return;
+    }
+    let _ = BUFFER.try_with(|buffer| buffer.borrow_mut().flush());
+}
+
+/// A span that is recorded when it goes out of scope.
+pub struct Span {
+    name: &'static str,
+    cat: &'static str,
+    start: u64,
+    arg: Option<(&'static str, u64)>,
+}
+
+pub fn span(name: &'static str, cat: &'static str) -> Span {
+    Span {
+        name,
+        cat,
+        start: now(),
+        arg: None,
+    }
+}
+
+pub fn span_with(name: &'static str, cat: &'static str, key: &'static str, value: u64) -> Span {
+    Span {
+        name,
+        cat,
+        start: now(),
+        arg: Some((key, value)),
+    }
+}
+
+impl Drop for Span {
+    fn drop(&mut self) {
+        record(self.name, self.cat, self.start, self.arg);
+    }
+}
+
+fn to_json(event: &Event) -> String {
+    match event {
+        Event::Span {
+            name,
+            cat,
+            ts,
+            dur,
+            tid,
+            arg,
+        } => {
+            let args = match arg {
+                Some((key, value)) => format!(",\"args\":{{\"{}\":{}}}", key, value),
+                None => "".to_owned(),
+            };
+            format!(
+                "{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":1,\"tid\":{}{}}}",
+                name, cat, ts, dur, tid, args
+            )
+        }
+        Event::ThreadName { tid, name } => format!(
+            "{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":{}}}}}",
+            tid,
+            serde_json::to_string(name).unwrap_or_else(|_| "\"\"".to_owned())
+        ),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_to_json() {
+        let span = Event::Span {
+            name: "noncegen",
+            cat: "cpu",
+            ts: 10,
+            dur: 5,
+            tid: 2,
+            arg: Some(("nonces", 64)),
+        };
+        let json: serde_json::Value = serde_json::from_str(&to_json(&span)).unwrap();
+        assert_eq!(json["ph"], "X");
+        assert_eq!(json["dur"], 5);
+        assert_eq!(json["args"]["nonces"], 64);
+
+        let name = Event::ThreadName {
+            tid: 2,
+            name: "gpu \"0\"".to_owned(),
+        };
+        let json: serde_json::Value = serde_json::from_str(&to_json(&name)).unwrap();
+        assert_eq!(json["args"]["name"], "gpu \"0\"");
+    }
+}